@@ -11,376 +11,3035 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/random.h>
+#include <pthread.h>
+#include <time.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "cdict.h"
+#include "cdict_internal.h"
+
+#ifndef NDEBUG
+#define DEBUG
+#endif
+
+#define DEFAULT_DICT_CAPACITY 8 // must be a power of two
+#define SMALL_DICT_SLOTS 4       // entries held in the dictionary itself; at
+                                 // most DEFAULT_DICT_CAPACITY * CD_MIN_LOAD_FACTOR
+#define MAX_DICT_CAPACITY (1u << 31)
+#define REHASH_THRESHOLD 0.6     // default maximum load factor
+
+/*
+ * Every slot has a one-byte control entry, kept in an array separate
+ * from the slots themselves so that a probe can examine a whole group
+ * of slots with a single 16-byte load. A control byte is either one
+ * of the negative markers below or, for a slot in use, the low 7 bits
+ * of its key's hash (H2). The remaining hash bits (H1) select the slot
+ * where probing starts.
+ */
+#define CTRL_EMPTY ((int8_t)-128) // 0b10000000
+#define CTRL_DELETED ((int8_t)-2) // 0b11111110
+
+#define GROUP_WIDTH 16
+#define SLOT_NOT_FOUND ((unsigned int)-1)
+
+// Keys looked up together by CD_retrieve_many and CD_contains_many
+#define LOOKUP_BATCH 16
+
+// Fewest slots worth handing to a thread of its own in CD_foreach_parallel
+#define MIN_SLOTS_PER_THREAD 16384
+
+// Slots moved from the old table to the new one per store or delete
+// while an incremental rehash is in progress. Anything above 2 is
+// enough to finish before the new table itself needs to grow.
+#define MIGRATE_SLOTS_PER_OP 32
+
+// Dictionary flags, the same as those in CDictOptions
+#define CD_FLAG_INCREMENTAL CD_NEW_INCREMENTAL // grow by migrating a few slots per operation
+#define CD_FLAG_OWNED CD_NEW_OWNED             // copy keys and values into the arena
+#define CD_FLAG_COMPACT CD_NEW_COMPACT         // keep entries in a dense array, in order
+
+// Owned keys and values are copied into chunks of at least this size
+#define ARENA_CHUNK_SIZE (64 * 1024)
+
+// A table being snapshotted is copied for the snapshot in pieces of
+// this size, each just before the dictionary first writes to it
+#define SNAPSHOT_CHUNK_SIZE 4096
+
+struct _hash_slot
+{
+  uint64_t hash; // full hash of key, cached so it is never recomputed
+  CDictKeyType key;
+  CDictValueType value;
+  size_t key_len; // compared before the key bytes themselves
+};
+
+/*
+ * A table's slots, or in a compact table its entries. A compact table
+ * keeps its entries in a dense array, in the order they were stored,
+ * and each full slot holds just the number of its entry, in as few
+ * bytes as that number needs. Deleting an entry leaves a hole in the
+ * array, with a NULL key, until the table is next rebuilt.
+ */
+struct _hash_table
+{
+  unsigned int num_stored;
+  unsigned int num_deleted;
+  unsigned int capacity;     // always a power of two; 0 if not allocated
+  CDictProbe probe;          // the dictionary's probe sequence
+  int8_t *ctrl;              // capacity + GROUP_WIDTH control bytes
+  struct _hash_slot *slot;   // one block shared with ctrl; entries if compact
+  void *index;               // entry number of each slot; NULL unless compact
+  unsigned int index_width;  // bytes per entry number; 0 unless compact
+  unsigned int num_entries;  // entries used, including holes; compact only
+  unsigned int max_entries;  // room for entries; compact only
+  struct _snapshot *cow;     // to be given each chunk before it changes
+};
+
+/*
+ * Bump-allocated storage for the keys and values of an owned
+ * dictionary. Each string is stored as a 32-bit length followed by its
+ * bytes and a terminating NUL. Chunks are never freed individually:
+ * space held by deleted or overwritten entries is only returned when
+ * the dictionary is freed.
+ */
+struct _arena_chunk
+{
+  struct _arena_chunk *next;
+  size_t size; // bytes available in data
+  size_t used;
+  char data[];
+};
+
+/*
+ * A file loaded by CD_load_tsv into a dictionary that does not own its
+ * keys and values, which point into the mapping
+ */
+struct _file_mapping
+{
+  struct _file_mapping *next;
+  void *addr;
+  size_t size;
+};
+
+#ifdef CDICT_STATS
+// Counters for CD_stats, updated with relaxed atomics since lookups
+// may run concurrently under a shared lock
+struct _dict_stats
+{
+  uint64_t hit_probes[CD_STATS_PROBE_BUCKETS];
+  uint64_t miss_probes[CD_STATS_PROBE_BUCKETS];
+  unsigned int max_hit_probes;
+  unsigned int max_miss_probes;
+  uint64_t num_rehashes;
+  double rehash_seconds;
+};
+#endif
+
+struct _dictionary
+{
+  CDictAllocator allocator;  // for this structure and the slot arrays
+  struct _hash_table table;  // receives all new entries
+  struct _hash_table old;    // being migrated into table, if capacity != 0
+  unsigned int migrate_pos;  // next slot of old to migrate
+  unsigned int min_capacity; // reserved by the caller; never shrunk below
+  unsigned int flags;
+  double max_load;           // rehash once the load factor passes this
+  CDictProbe probe;          // for every table the dictionary allocates
+  CD_hash_function hash;     // NULL for the built-in hash
+  struct _hash_seed seed;    // for the built-in hash
+  struct _arena_chunk *arena; // chunk being filled first; NULL unless owned
+  struct _file_mapping *mappings; // files holding keys and values
+  struct _snapshot *snapshot;     // taken of this dictionary and not yet freed
+  unsigned int num_small;         // entries in small, while table.capacity == 0
+  struct _hash_slot small[SMALL_DICT_SLOTS]; // unhashed entries, in no order
+#ifdef CDICT_STATS
+  struct _dict_stats stats;
+#endif
+};
+
+/*
+ * A read-only view of a dictionary as it was when CD_snapshot was
+ * called. The snapshot keeps a copy of the table's header and reads
+ * the arrays from the table's own block, except for the chunks of the
+ * block that the dictionary has written to since: the dictionary
+ * copies each chunk into the snapshot just before its first write to
+ * it. A dictionary that stops using the block, by moving to a new
+ * table or being freed, gives it to the snapshot instead of freeing
+ * it. A small dictionary's few entries are simply copied.
+ *
+ * Threads may read the snapshot while the dictionary is written to.
+ * The writer publishes each saved chunk before changing the block, so
+ * a reader that reads a chunk from the block and still finds no saved
+ * copy afterwards knows it read the chunk unchanged; one that finds a
+ * copy reads that instead. This is the read side of a seqlock, with
+ * the saved copy in place of the sequence number.
+ */
+struct _snapshot
+{
+  CDict dict;                 // NULL once the dictionary has been freed
+  struct _hash_table table;   // as it was; capacity 0 if the dict was small
+  char *block;                // the table's block
+  bool owns_block;            // given to the snapshot by the dictionary
+  char **chunks;              // saved copy of each chunk, or NULL if unchanged;
+                              // published with atomic stores
+  bool lost;                  // a chunk could not be saved; atomic
+  unsigned int size;
+  unsigned int num_small;
+  struct _hash_slot small[SMALL_DICT_SLOTS];
+  CD_hash_function hash;
+  struct _hash_seed seed;
+  CDictAllocator allocator;   // the dictionary's, for freeing the block
+  struct _arena_chunk *arena; // the dictionary's keys and values, once freed
+  struct _file_mapping *mappings;
+};
+
+/*
+ * Probe position within a table. Probing moves from group to group in
+ * steps that are whole multiples of GROUP_WIDTH, so that the groups
+ * visited never overlap, and that visit every group of a power-of-two
+ * table before repeating: triangular steps (GROUP_WIDTH,
+ * 2 * GROUP_WIDTH, ...), steps of one group, or steps of a fixed odd
+ * number of groups.
+ */
+struct _probe_seq
+{
+  unsigned int mask;
+  unsigned int pos;
+  unsigned int step;   // distance to the next group
+  unsigned int growth; // added to step after each move
+};
+
+// The allocator used when none is supplied
+static void *_CD_default_alloc(size_t size, void *ctx)
+{
+  return malloc(size);
+}
+
+static void _CD_default_free(void *ptr, size_t size, void *ctx)
+{
+  free(ptr);
+}
+
+static const CDictAllocator _CD_default_allocator = {_CD_default_alloc, _CD_default_free, NULL};
+
+static inline bool _CD_table_is_compact(const struct _hash_table *table)
+{
+  return table->index_width != 0;
+}
+
+// Size of the block holding the slot (or entry), index and control
+// arrays of a table
+static inline size_t _CD_table_bytes(const struct _hash_table *table)
+{
+  if (_CD_table_is_compact(table))
+    return sizeof(struct _hash_slot) * (size_t)table->max_entries +
+           ((size_t)table->index_width + 1) * table->capacity + GROUP_WIDTH;
+
+  return (sizeof(struct _hash_slot) + 1) * (size_t)table->capacity + GROUP_WIDTH;
+}
+
+/*
+ * Save a copy of each chunk of a snapshotted table's block that a
+ * write is about to change, unless the snapshot already has one. A
+ * chunk that cannot be copied leaves the snapshot unusable rather than
+ * holding the wrong entries.
+ *
+ * Parameters:
+ *   snap   The snapshot sharing the block
+ *   addr   The first byte to be written
+ *   len    Number of bytes to be written
+ *
+ * Returns: None
+ */
+static void _CD_snapshot_save(struct _snapshot *snap, const void *addr, size_t len)
+{
+  size_t bytes = _CD_table_bytes(&snap->table);
+  size_t offset = (const char *)addr - snap->block;
+
+  bool published = false;
+
+  for (size_t c = offset / SNAPSHOT_CHUNK_SIZE; c <= (offset + len - 1) / SNAPSHOT_CHUNK_SIZE; c++)
+  {
+    if (__atomic_load_n(&snap->chunks[c], __ATOMIC_RELAXED) != NULL)
+      continue;
+
+    size_t start = c * SNAPSHOT_CHUNK_SIZE;
+    size_t size = (bytes - start < SNAPSHOT_CHUNK_SIZE) ? bytes - start : SNAPSHOT_CHUNK_SIZE;
+    char *copy = malloc(size);
+
+    published = true;
+
+    if (copy == NULL)
+    {
+      if (!__atomic_load_n(&snap->lost, __ATOMIC_RELAXED))
+        printf("Error: memory allocation failed for snapshot chunk\n");
+      __atomic_store_n(&snap->lost, true, __ATOMIC_RELAXED);
+      continue;
+    }
+
+    memcpy(copy, snap->block + start, size);
+    __atomic_store_n(&snap->chunks[c], copy, __ATOMIC_RELEASE);
+  }
+
+  // Readers must be able to see each copy, or that it is missing,
+  // before they can see the write that follows
+  if (published)
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+// Called before every write to a table's block
+static inline void _CD_before_write(const struct _hash_table *table, const void *addr, size_t len)
+{
+  if (table->cow != NULL)
+    _CD_snapshot_save(table->cow, addr, len);
+}
+
+/*
+ * Allocate the arrays for one of a dictionary's tables as a single
+ * block, with every control byte marked empty
+ *
+ * Parameters:
+ *   dict      The dictionary
+ *   table     The table to initialize
+ *   capacity  Number of slots; must be a power of two
+ *
+ * Returns: True on success, false if memory allocation failed
+ */
+static bool _CD_table_init(CDict dict, struct _hash_table *table, unsigned int capacity)
+{
+  struct _hash_table init = {0, 0, capacity, dict->probe};
+
+  if (dict->flags & CD_FLAG_COMPACT)
+  {
+    // Stores check the load factor after inserting, so there may be one
+    // entry more than it allows
+    init.max_entries = (unsigned int)(capacity * dict->max_load) + 1;
+    init.index_width = (init.max_entries <= (1u << 8)) ? 1 : (init.max_entries <= (1u << 16)) ? 2 : 4;
+  }
+
+  size_t slot_bytes = sizeof(struct _hash_slot) * (_CD_table_is_compact(&init) ? init.max_entries : capacity);
+
+  init.slot = dict->allocator.alloc(_CD_table_bytes(&init), dict->allocator.ctx);
+
+  if (init.slot == NULL)
+    return false;
+
+  init.ctrl = (int8_t *)init.slot + slot_bytes;
+
+  if (_CD_table_is_compact(&init))
+  {
+    init.index = init.ctrl;
+    init.ctrl += (size_t)init.index_width * capacity;
+  }
+
+  memset(init.ctrl, CTRL_EMPTY, capacity + GROUP_WIDTH);
+  *table = init;
+
+  return true;
+}
+
+/*
+ * Free the arrays of a table, leaving it with zero capacity. A table
+ * with a snapshot is not freed but given to the snapshot, which no
+ * longer needs to save chunks of it.
+ *
+ * Parameters:
+ *   allocator The dictionary's allocator
+ *   table     The table
+ *
+ * Returns: None
+ */
+static void _CD_table_release(const CDictAllocator *allocator, struct _hash_table *table)
+{
+  if (table->cow != NULL)
+    table->cow->owns_block = true;
+  else if (table->capacity != 0)
+    allocator->free(table->slot, _CD_table_bytes(table), allocator->ctx);
+
+  memset(table, 0, sizeof(*table));
+}
+
+/*
+ * Return the capacity a table needs to hold a number of entries
+ * without its load factor exceeding a maximum
+ *
+ * Parameters:
+ *   num_entries   The number of entries
+ *   max_load      The maximum load factor
+ *
+ * Returns: A power of two capacity, at least DEFAULT_DICT_CAPACITY, or
+ *   0 if num_entries is too large for any table
+ */
+static unsigned int _CD_capacity_for(unsigned int num_entries, double max_load)
+{
+  unsigned int capacity = DEFAULT_DICT_CAPACITY;
+
+  while (num_entries > capacity * max_load)
+  {
+    if (capacity >= MAX_DICT_CAPACITY)
+      return 0;
+
+    capacity *= 2;
+  }
+
+  return capacity;
+}
+
+#ifdef CDICT_STATS
+/*
+ * Count a lookup in the probe-length histogram for hits or misses
+ *
+ * Parameters:
+ *   dict     The dictionary
+ *   hit      Whether the key was found
+ *   groups   Number of groups of control bytes examined
+ *
+ * Returns: None
+ */
+static void _CD_stats_probe(CDict dict, bool hit, unsigned int groups)
+{
+  uint64_t *histogram = hit ? dict->stats.hit_probes : dict->stats.miss_probes;
+  unsigned int *max = hit ? &dict->stats.max_hit_probes : &dict->stats.max_miss_probes;
+  unsigned int bucket = (groups < CD_STATS_PROBE_BUCKETS) ? groups - 1 : CD_STATS_PROBE_BUCKETS - 1;
+  unsigned int seen = __atomic_load_n(max, __ATOMIC_RELAXED);
+
+  __atomic_fetch_add(&histogram[bucket], 1, __ATOMIC_RELAXED);
+
+  while (groups > seen && !__atomic_compare_exchange_n(max, &seen, groups, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+}
+
+static double _CD_now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+#endif
+
+/*
+ * Is the dictionary still small? A small dictionary has no table: its
+ * few entries are kept in the dictionary itself and found by comparing
+ * keys one after another, without hashing them. It gets a table once
+ * it outgrows SMALL_DICT_SLOTS entries, and never goes back.
+ */
+static inline bool _CD_is_small(CDict dict)
+{
+  return dict->table.capacity == 0;
+}
+
+/*
+ * Find a key among the entries of a small dictionary
+ *
+ * Parameters:
+ *   dict   The dictionary, which must be small
+ *   key    The key
+ *   len    Length of key in bytes
+ *
+ * Returns: The index of the entry in dict->small, or SLOT_NOT_FOUND
+ */
+static inline unsigned int _CD_small_find(CDict dict, const void *key, size_t len)
+{
+  unsigned int index = SLOT_NOT_FOUND;
+
+  for (unsigned int i = 0; i < dict->num_small; i++)
+    if (dict->small[i].key_len == len && memcmp(dict->small[i].key, key, len) == 0)
+    {
+      index = i;
+      break;
+    }
+
+#ifdef CDICT_STATS
+  // The whole scan counts as probing one group
+  _CD_stats_probe(dict, index != SLOT_NOT_FOUND, 1);
+#endif
+
+  return index;
+}
+
+/*
+ * Hash a key for one of the functions below, which ignore the hash
+ * while the dictionary is small
+ */
+static inline uint64_t _CD_hash_if_needed(CDict dict, const void *key, size_t len)
+{
+  return _CD_is_small(dict) ? 0 : _CD_key_hash(dict, key, len);
+}
+
+// Documented in cdict_internal.h
+CDict _CD_new(const CDictOptions *options, const struct _hash_seed *seed)
+{
+  // A dictionary asked to make room for no more than SMALL_DICT_SLOTS
+  // entries starts small, with no table
+  const CDictAllocator *allocator = options->allocator ? options->allocator : &_CD_default_allocator;
+  double max_load = options->max_load_factor ? options->max_load_factor : REHASH_THRESHOLD;
+  unsigned int capacity = 0;
+
+  if (options->capacity > SMALL_DICT_SLOTS && (capacity = _CD_capacity_for(options->capacity, max_load)) == 0)
+  {
+    printf("Error: cannot create a dictionary for %u entries\n", options->capacity);
+    return NULL;
+  }
+
+  CDict dict = (CDict)allocator->alloc(sizeof(struct _dictionary), allocator->ctx);
+
+  if (dict == NULL)
+  {
+    printf("Error: memory allocation failed for dictionary\n");
+    return NULL;
+  }
+
+  memset(dict, 0, sizeof(struct _dictionary));
+  dict->allocator = *allocator;
+  dict->min_capacity = capacity;
+  dict->flags = options->flags;
+  dict->max_load = max_load;
+  dict->probe = options->probe;
+  dict->hash = options->hash;
+
+  if (seed != NULL)
+    dict->seed = *seed;
+  else if (options->flags & CD_NEW_DETERMINISTIC)
+    dict->seed = (struct _hash_seed){options->seed, 0};
+  else
+    _CD_random_seed(&dict->seed);
+
+  if (capacity != 0 && !_CD_table_init(dict, &dict->table, capacity))
+  {
+    printf("Error: memory allocation failed for dictionary slot\n");
+    CD_free(dict);
+    return NULL;
+  }
+
+  return dict;
+}
+
+// Documented in cdict_internal.h
+const char *_CD_arena_copy(struct _arena_chunk **arena, const void *str, size_t len)
+{
+  if (len > UINT32_MAX)
+    return NULL;
+
+  // Keep each length prefix aligned
+  size_t need = (sizeof(uint32_t) + len + 1 + sizeof(uint32_t) - 1) & ~(sizeof(uint32_t) - 1);
+  struct _arena_chunk *chunk = *arena;
+
+  if (chunk == NULL || chunk->size - chunk->used < need)
+  {
+    size_t size = need > ARENA_CHUNK_SIZE ? need : ARENA_CHUNK_SIZE;
+
+    chunk = malloc(sizeof(struct _arena_chunk) + size);
+
+    if (chunk == NULL)
+      return NULL;
+
+    chunk->size = size;
+    chunk->used = 0;
+
+    // An oversized string gets a chunk of its own, behind the one
+    // still being filled
+    if (size > ARENA_CHUNK_SIZE && *arena != NULL)
+    {
+      chunk->next = (*arena)->next;
+      (*arena)->next = chunk;
+    }
+    else
+    {
+      chunk->next = *arena;
+      *arena = chunk;
+    }
+  }
+
+  char *record = chunk->data + chunk->used;
+  uint32_t len32 = (uint32_t)len;
+
+  memcpy(record, &len32, sizeof(len32));
+  memcpy(record + sizeof(len32), str, len);
+  record[sizeof(len32) + len] = '\0';
+  chunk->used += need;
+
+  return record + sizeof(len32);
+}
+
+// Documented in cdict_internal.h
+void _CD_arena_free(struct _arena_chunk **arena)
+{
+  struct _arena_chunk *chunk = *arena;
+
+  while (chunk != NULL)
+  {
+    struct _arena_chunk *next = chunk->next;
+    free(chunk);
+    chunk = next;
+  }
+
+  *arena = NULL;
+}
+
+// Documented in .h file
+CDict CD_new()
+{
+  CDictOptions options = {0};
+  return _CD_new(&options, NULL);
+}
+
+// Documented in .h file
+CDict CD_new_with_hash(CD_hash_function hash)
+{
+  CDictOptions options = {.hash = hash};
+  return _CD_new(&options, NULL);
+}
+
+// Documented in .h file
+CDict CD_new_with_allocator(const CDictAllocator *allocator)
+{
+  CDictOptions options = {.allocator = allocator};
+  return _CD_new(&options, NULL);
+}
+
+// Documented in .h file
+CDict CD_new_incremental()
+{
+  CDictOptions options = {.flags = CD_FLAG_INCREMENTAL};
+  return _CD_new(&options, NULL);
+}
+
+// Documented in .h file
+CDict CD_new_with_capacity(unsigned int num_entries)
+{
+  CDictOptions options = {.capacity = num_entries};
+  return _CD_new(&options, NULL);
+}
+
+// Documented in .h file
+CDict CD_new_owned()
+{
+  CDictOptions options = {.flags = CD_FLAG_OWNED};
+  return _CD_new(&options, NULL);
+}
+
+// Documented in .h file
+CDict CD_new_compact()
+{
+  CDictOptions options = {.flags = CD_FLAG_COMPACT};
+  return _CD_new(&options, NULL);
+}
+
+// Documented in .h file
+CDict CD_new_with_options(const CDictOptions *options)
+{
+  CDictOptions defaults = {0};
+
+  if (options == NULL)
+    options = &defaults;
+
+  if (options->max_load_factor != 0 &&
+      !(options->max_load_factor >= CD_MIN_LOAD_FACTOR && options->max_load_factor <= CD_MAX_LOAD_FACTOR))
+  {
+    printf("Error: maximum load factor %g is outside [%g, %g]\n", options->max_load_factor, CD_MIN_LOAD_FACTOR,
+           CD_MAX_LOAD_FACTOR);
+    return NULL;
+  }
+
+  if (options->probe != CD_PROBE_TRIANGULAR && options->probe != CD_PROBE_LINEAR &&
+      options->probe != CD_PROBE_DOUBLE_HASH)
+  {
+    printf("Error: unknown probe sequence %d\n", (int)options->probe);
+    return NULL;
+  }
+
+  if (options->flags & ~(CD_NEW_INCREMENTAL | CD_NEW_OWNED | CD_NEW_DETERMINISTIC | CD_NEW_COMPACT))
+  {
+    printf("Error: unknown dictionary flags 0x%x\n", options->flags);
+    return NULL;
+  }
+
+  // Moving entries a few slots at a time would lose their order
+  if ((options->flags & CD_NEW_COMPACT) && (options->flags & CD_NEW_INCREMENTAL))
+  {
+    printf("Error: a compact dictionary cannot grow incrementally\n");
+    return NULL;
+  }
+
+  return _CD_new(options, NULL);
+}
+
+// Unmap every file in a list loaded by CD_load_tsv
+static void _CD_unmap_all(struct _file_mapping **mappings)
+{
+  while (*mappings != NULL)
+  {
+    struct _file_mapping *next = (*mappings)->next;
+    munmap((*mappings)->addr, (*mappings)->size);
+    free(*mappings);
+    *mappings = next;
+  }
+}
+
+// Documented in .h file
+void CD_free(CDict dict)
+{
+  if (dict)
+  {
+    // A snapshot outlives the dictionary, keeping the keys and values
+    // it may still return
+    if (dict->snapshot != NULL)
+    {
+      dict->snapshot->arena = dict->arena;
+      dict->snapshot->mappings = dict->mappings;
+      dict->snapshot->dict = NULL;
+      dict->arena = NULL;
+      dict->mappings = NULL;
+    }
+
+    _CD_table_release(&dict->allocator, &dict->table);
+    _CD_table_release(&dict->allocator, &dict->old);
+    _CD_arena_free(&dict->arena);
+    _CD_unmap_all(&dict->mappings);
+
+    CDictAllocator allocator = dict->allocator;
+    allocator.free(dict, sizeof(struct _dictionary), allocator.ctx);
+  }
+}
+
+/*
+ * 64x64 -> 128 bit multiply; on return *a holds the low half of the
+ * product and *b the high half.
+ */
+static inline void _CD_mum(uint64_t *a, uint64_t *b)
+{
+#ifdef __SIZEOF_INT128__
+  __uint128_t r = (__uint128_t)*a * *b;
+  *a = (uint64_t)r;
+  *b = (uint64_t)(r >> 64);
+#else
+  uint64_t ha = *a >> 32, la = (uint32_t)*a, hb = *b >> 32, lb = (uint32_t)*b;
+  uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+  uint64_t t = rl + (rm0 << 32);
+  uint64_t lo = t + (rm1 << 32);
+  *b = rh + (rm0 >> 32) + (rm1 >> 32) + (t < rl) + (lo < t);
+  *a = lo;
+#endif
+}
+
+/*
+ * Multiply two words and fold the 128-bit product back to 64 bits
+ */
+static inline uint64_t _CD_mix(uint64_t a, uint64_t b)
+{
+  _CD_mum(&a, &b);
+  return a ^ b;
+}
+
+static inline uint64_t _CD_read64(const uint8_t *p)
+{
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline uint64_t _CD_read32(const uint8_t *p)
+{
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+// Documented in cdict_internal.h
+uint64_t _CD_hash(const void *key, size_t len)
+{
+  return _CD_hash_seeded(key, len, 0);
+}
+
+// Documented in cdict_internal.h
+uint64_t _CD_hash_seeded(const void *key, size_t len, uint64_t seed)
+{
+  static const uint64_t secret[4] = {0x2d358dccaa6c78a5ull, 0x8bb84b93962eacc9ull,
+                                     0x4b33a62ed433d4a3ull, 0x4d5a2da51de1aa47ull};
+  const uint8_t *p = (const uint8_t *)key;
+  uint64_t a, b;
+
+  seed ^= _CD_mix(seed ^ secret[0], secret[1]);
+
+  if (len <= 16)
+  {
+    if (len >= 4)
+    {
+      a = (_CD_read32(p) << 32) | _CD_read32(p + ((len >> 3) << 2));
+      b = (_CD_read32(p + len - 4) << 32) | _CD_read32(p + len - 4 - ((len >> 3) << 2));
+    }
+    else if (len > 0)
+    {
+      a = ((uint64_t)p[0] << 16) | ((uint64_t)p[len >> 1] << 8) | p[len - 1];
+      b = 0;
+    }
+    else
+      a = b = 0;
+  }
+  else
+  {
+    size_t i = len;
+
+    if (i >= 48)
+    {
+      uint64_t see1 = seed, see2 = seed;
+
+      do
+      {
+        seed = _CD_mix(_CD_read64(p) ^ secret[1], _CD_read64(p + 8) ^ seed);
+        see1 = _CD_mix(_CD_read64(p + 16) ^ secret[2], _CD_read64(p + 24) ^ see1);
+        see2 = _CD_mix(_CD_read64(p + 32) ^ secret[3], _CD_read64(p + 40) ^ see2);
+        p += 48;
+        i -= 48;
+      } while (i >= 48);
+
+      seed ^= see1 ^ see2;
+    }
+
+    while (i > 16)
+    {
+      seed = _CD_mix(_CD_read64(p) ^ secret[1], _CD_read64(p + 8) ^ seed);
+      i -= 16;
+      p += 16;
+    }
+
+    a = _CD_read64(p + i - 16);
+    b = _CD_read64(p + i - 8);
+  }
+
+  a ^= secret[1];
+  b ^= seed;
+  _CD_mum(&a, &b);
+
+  return _CD_mix(a ^ secret[0] ^ len, b ^ secret[1]);
+}
+
+#define _CD_ROTL(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+
+// One SipRound, mixing the four words of SipHash state
+static inline void _CD_sipround(uint64_t v[4])
+{
+  v[0] += v[1];
+  v[1] = _CD_ROTL(v[1], 13) ^ v[0];
+  v[0] = _CD_ROTL(v[0], 32);
+  v[2] += v[3];
+  v[3] = _CD_ROTL(v[3], 16) ^ v[2];
+  v[0] += v[3];
+  v[3] = _CD_ROTL(v[3], 21) ^ v[0];
+  v[2] += v[1];
+  v[1] = _CD_ROTL(v[1], 17) ^ v[2];
+  v[2] = _CD_ROTL(v[2], 32);
+}
+
+// Documented in cdict_internal.h
+uint64_t _CD_siphash(const void *key, size_t len, const struct _hash_seed *seed)
+{
+  const uint8_t *p = (const uint8_t *)key;
+  const uint8_t *end = p + (len & ~(size_t)7);
+  uint64_t v[4] = {seed->k0 ^ 0x736f6d6570736575ull, seed->k1 ^ 0x646f72616e646f6dull,
+                   seed->k0 ^ 0x6c7967656e657261ull, seed->k1 ^ 0x7465646279746573ull};
+
+  // One round per word of input, rather than SipHash-2-4's two
+  for (; p != end; p += 8)
+  {
+    uint64_t m = _CD_read64(p);
+
+    v[3] ^= m;
+    _CD_sipround(v);
+    v[0] ^= m;
+  }
+
+  // The last 0-7 bytes, with the length in the top byte
+  uint64_t last = (uint64_t)len << 56;
+
+  for (unsigned int i = 0; i < (len & 7); i++)
+    last |= (uint64_t)p[i] << (8 * i);
+
+  v[3] ^= last;
+  _CD_sipround(v);
+  v[0] ^= last;
+
+  // Three finalization rounds, rather than four
+  v[2] ^= 0xff;
+  _CD_sipround(v);
+  _CD_sipround(v);
+  _CD_sipround(v);
+
+  return v[0] ^ v[1] ^ v[2] ^ v[3];
+}
+
+// Secret from which every dictionary's seed is derived
+static struct _hash_seed _CD_secret;
+static pthread_once_t _CD_secret_once = PTHREAD_ONCE_INIT;
+static uint64_t _CD_seeds_drawn;
+
+static void _CD_init_secret()
+{
+  if (getrandom(&_CD_secret, sizeof(_CD_secret), 0) != sizeof(_CD_secret))
+  {
+    // No entropy to be had: fall back on the clock and address layout
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    _CD_secret.k0 = _CD_mix(ts.tv_sec ^ (uintptr_t)&ts, ts.tv_nsec ^ getpid());
+    _CD_secret.k1 = _CD_mix((uintptr_t)&_CD_secret ^ _CD_secret.k0, (uintptr_t)_CD_init_secret);
+  }
+}
+
+// Documented in cdict_internal.h
+void _CD_random_seed(struct _hash_seed *seed)
+{
+  pthread_once(&_CD_secret_once, _CD_init_secret);
+
+  // Hashing a counter under the secret gives unpredictable seeds
+  // without a system call per dictionary
+  uint64_t n = __atomic_fetch_add(&_CD_seeds_drawn, 1, __ATOMIC_RELAXED) * 2;
+
+  seed->k0 = _CD_siphash(&n, sizeof(n), &_CD_secret);
+  n++;
+  seed->k1 = _CD_siphash(&n, sizeof(n), &_CD_secret);
+}
+
+// Documented in cdict_internal.h
+uint64_t _CD_key_hash(CDict dict, const void *key, size_t len)
+{
+  return dict->hash ? dict->hash(key, len) : _CD_siphash(key, len, &dict->seed);
+}
+
+// Split a hash into the part that picks the first slot and the part
+// kept in the control byte
+static inline uint64_t _CD_h1(uint64_t hash) { return hash >> 7; }
+static inline int8_t _CD_h2(uint64_t hash) { return (int8_t)(hash & 0x7f); }
+
+static inline bool _CD_ctrl_is_full(int8_t ctrl) { return ctrl >= 0; }
+
+/*
+ * Set the control byte of a slot. The first GROUP_WIDTH control bytes
+ * are mirrored after the end of the table, so that a group load
+ * starting at any slot reads past the end by wrapping around.
+ *
+ * Parameters:
+ *   table     The table
+ *   index     The slot
+ *   value     The new control byte
+ *
+ * Returns: None
+ */
+static inline void _CD_set_ctrl(struct _hash_table *table, unsigned int index, int8_t value)
+{
+  _CD_before_write(table, &table->ctrl[index], 1);
+  table->ctrl[index] = value;
+
+  for (unsigned int i = index + table->capacity; i < table->capacity + GROUP_WIDTH; i += table->capacity)
+  {
+    _CD_before_write(table, &table->ctrl[i], 1);
+    table->ctrl[i] = value;
+  }
+}
+
+/*
+ * Return the entry held in a full slot: the slot itself, or in a
+ * compact table the entry whose number it holds
+ *
+ * Parameters:
+ *   table     The table
+ *   index     The slot, which must be full
+ *
+ * Returns: The entry
+ */
+static inline struct _hash_slot *_CD_slot(const struct _hash_table *table, unsigned int index)
+{
+  switch (table->index_width)
+  {
+  case 0:
+    return &table->slot[index];
+  case 1:
+    return &table->slot[((const uint8_t *)table->index)[index]];
+  case 2:
+    return &table->slot[((const uint16_t *)table->index)[index]];
+  default:
+    return &table->slot[((const uint32_t *)table->index)[index]];
+  }
+}
+
+// Set the entry number held in a slot of a compact table
+static inline void _CD_set_index(struct _hash_table *table, unsigned int index, unsigned int entry)
+{
+  switch (table->index_width)
+  {
+  case 1:
+    ((uint8_t *)table->index)[index] = (uint8_t)entry;
+    break;
+  case 2:
+    ((uint16_t *)table->index)[index] = (uint16_t)entry;
+    break;
+  default:
+    ((uint32_t *)table->index)[index] = entry;
+  }
+}
+
+/*
+ * Compare each of the GROUP_WIDTH control bytes starting at group
+ * against value
+ *
+ * Returns: A bitmask with bit i set if group[i] == value
+ */
+static inline uint32_t _CD_group_match(const int8_t *group, int8_t value)
+{
+#ifdef __SSE2__
+  __m128i ctrl = _mm_loadu_si128((const __m128i *)group);
+  return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8(value)));
+#else
+  uint32_t match = 0;
+
+  for (unsigned int i = 0; i < GROUP_WIDTH; i++)
+    if (group[i] == value)
+      match |= 1u << i;
+
+  return match;
+#endif
+}
+
+/*
+ * Find the slots in use among the GROUP_WIDTH control bytes starting
+ * at group: those with the top bit clear
+ *
+ * Returns: A bitmask with bit i set if group[i] is full
+ */
+static inline uint32_t _CD_group_full(const int8_t *group)
+{
+#ifdef __SSE2__
+  __m128i ctrl = _mm_loadu_si128((const __m128i *)group);
+  return ~(uint32_t)_mm_movemask_epi8(ctrl) & ((1u << GROUP_WIDTH) - 1);
+#else
+  uint32_t full = 0;
+
+  for (unsigned int i = 0; i < GROUP_WIDTH; i++)
+    if (_CD_ctrl_is_full(group[i]))
+      full |= 1u << i;
+
+  return full;
+#endif
+}
+
+static inline struct _probe_seq _CD_probe_start(const struct _hash_table *table, uint64_t hash)
+{
+  unsigned int mask = table->capacity - 1;
+  struct _probe_seq seq = {mask, (unsigned int)_CD_h1(hash) & mask, GROUP_WIDTH, GROUP_WIDTH};
+
+  if (table->probe == CD_PROBE_LINEAR)
+    seq.growth = 0;
+  else if (table->probe == CD_PROBE_DOUBLE_HASH)
+  {
+    // An odd number of groups, from hash bits H1 leaves unused in
+    // tables of up to 2^33 slots
+    seq.step = ((unsigned int)(hash >> 40) | 1) * GROUP_WIDTH;
+    seq.growth = 0;
+  }
+
+  return seq;
+}
+
+static inline void _CD_probe_next(struct _probe_seq *seq)
+{
+  seq->pos = (seq->pos + seq->step) & seq->mask;
+  seq->step += seq->growth;
+}
+
+/*
+ * Find the slot holding a key. Each group of control bytes is
+ * compared against the key's H2 all at once, and only the slots whose
+ * byte matches are compared against the key itself.
+ *
+ * Parameters:
+ *   table  The table to search
+ *   hash   The full hash of key
+ *   key    The key
+ *   len    Length of key in bytes
+ *   groups Incremented for each group of control bytes examined
+ *
+ * Returns: The index of the slot holding key, or SLOT_NOT_FOUND
+ */
+static inline unsigned int _CD_find(const struct _hash_table *table, uint64_t hash, const void *key, size_t len,
+                                    unsigned int *groups)
+{
+  struct _probe_seq seq = _CD_probe_start(table, hash);
+  int8_t h2 = _CD_h2(hash);
+
+  for (unsigned int probed = 0; probed < table->capacity; probed += GROUP_WIDTH)
+  {
+    const int8_t *group = table->ctrl + seq.pos;
+
+    (*groups)++;
+
+    for (uint32_t match = _CD_group_match(group, h2); match; match &= match - 1)
+    {
+      unsigned int index = (seq.pos + __builtin_ctz(match)) & seq.mask;
+      const struct _hash_slot *slot = _CD_slot(table, index);
+
+      if (slot->hash == hash && slot->key_len == len && memcmp(slot->key, key, len) == 0)
+        return index;
+    }
+
+    // An empty slot ends every probe sequence that passes through it
+    if (_CD_group_match(group, CTRL_EMPTY))
+      return SLOT_NOT_FOUND;
+
+    _CD_probe_next(&seq);
+  }
+
+  return SLOT_NOT_FOUND;
+}
+
+/*
+ * Find the first empty or deleted slot on the probe sequence of a
+ * hash. Reusing a deleted slot is safe once the key is known not to be
+ * in the table, and keeps delete-then-insert workloads from using up
+ * the empty slots. The table must have at least one empty slot, which
+ * the load factor threshold guarantees.
+ *
+ * Parameters:
+ *   table     The table
+ *   hash      The full hash of the key to be inserted
+ *
+ * Returns: The index of the slot
+ */
+static unsigned int _CD_find_free(const struct _hash_table *table, uint64_t hash)
+{
+  struct _probe_seq seq = _CD_probe_start(table, hash);
+
+  while (true)
+  {
+    uint32_t unused = ~_CD_group_full(table->ctrl + seq.pos) & ((1u << GROUP_WIDTH) - 1);
+
+    if (unused)
+      return (seq.pos + __builtin_ctz(unused)) & seq.mask;
+
+    _CD_probe_next(&seq);
+  }
+}
+
+/*
+ * Can a slot being deleted be marked empty rather than deleted? A
+ * probe only moves on from a group of GROUP_WIDTH control bytes that
+ * has no empty slot. If the run of non-empty slots around the slot is
+ * shorter than GROUP_WIDTH, every group containing the slot also
+ * contains an empty slot, so no probe sequence has ever passed over
+ * it and no tombstone is needed to keep later probes going.
+ *
+ * Parameters:
+ *   table     The table
+ *   index     The slot being deleted
+ *
+ * Returns: True if the slot can be marked CTRL_EMPTY
+ */
+static bool _CD_can_erase_to_empty(const struct _hash_table *table, unsigned int index)
+{
+  // A group covers the whole table, and the table always has an empty slot
+  if (table->capacity <= GROUP_WIDTH)
+    return true;
+
+  unsigned int before = (index - GROUP_WIDTH) & (table->capacity - 1);
+  uint32_t empty_before = _CD_group_match(table->ctrl + before, CTRL_EMPTY);
+  uint32_t empty_after = _CD_group_match(table->ctrl + index, CTRL_EMPTY);
+
+  if (empty_before == 0 || empty_after == 0)
+    return false;
+
+  // Non-empty slots from index forwards, plus those just before index
+  unsigned int run = __builtin_ctz(empty_after) + (__builtin_clz(empty_before) - (32 - GROUP_WIDTH));
+
+  return run < GROUP_WIDTH;
+}
+
+/*
+ * Place an entry known not to be in the table in the first free slot
+ * on its probe sequence
+ *
+ * Parameters:
+ *   table     The table
+ *   entry     The entry, with its hash already set
+ *
+ * Returns: None
+ */
+static void _CD_table_insert(struct _hash_table *table, const struct _hash_slot *entry)
+{
+  unsigned int index = _CD_find_free(table, entry->hash);
+
+  if (table->ctrl[index] == CTRL_DELETED)
+    table->num_deleted--;
+
+  _CD_set_ctrl(table, index, _CD_h2(entry->hash));
+  table->num_stored++;
+
+  if (_CD_table_is_compact(table))
+  {
+    _CD_before_write(table, (char *)table->index + (size_t)index * table->index_width, table->index_width);
+    _CD_set_index(table, index, table->num_entries);
+    _CD_before_write(table, &table->slot[table->num_entries], sizeof(*entry));
+    table->slot[table->num_entries++] = *entry;
+  }
+  else
+  {
+    _CD_before_write(table, &table->slot[index], sizeof(*entry));
+    table->slot[index] = *entry;
+  }
+}
+
+/*
+ * Remove the entry in a slot, leaving a tombstone only if a probe
+ * sequence may have passed over the slot
+ *
+ * Parameters:
+ *   table     The table
+ *   index     The slot, which must be in use
+ *
+ * Returns: None
+ */
+static void _CD_table_erase(struct _hash_table *table, unsigned int index)
+{
+  struct _hash_slot *slot = _CD_slot(table, index);
+
+  // In a compact table this leaves a hole among the entries
+  _CD_before_write(table, slot, sizeof(*slot));
+  slot->key = NULL;
+  slot->value = NULL;
+  table->num_stored--;
+
+  if (_CD_can_erase_to_empty(table, index))
+    _CD_set_ctrl(table, index, CTRL_EMPTY);
+  else
+  {
+    _CD_set_ctrl(table, index, CTRL_DELETED);
+    table->num_deleted++;
+  }
+}
+
+/*
+ * Clear every tombstone from a table without reallocating it, moving
+ * each entry to the first free slot on its probe sequence. Every full
+ * slot is first marked deleted and every deleted slot empty; then
+ * each entry still marked deleted is placed in turn. An entry that
+ * lands in the group it is already in just gets its control byte
+ * back; one that lands on an empty slot moves there; and one that
+ * lands on a slot still marked deleted swaps with that slot's entry,
+ * which is then placed in the same way. Compact tables are rebuilt
+ * instead, which also closes the holes among their entries.
+ *
+ * Parameters:
+ *   table     The table, which must not be compact
+ *
+ * Returns: None
+ */
+static void _CD_table_purge(struct _hash_table *table)
+{
+  unsigned int mask = table->capacity - 1;
+
+  for (unsigned int i = 0; i < table->capacity; i++)
+    table->ctrl[i] = _CD_ctrl_is_full(table->ctrl[i]) ? CTRL_DELETED : CTRL_EMPTY;
+
+  for (unsigned int i = table->capacity; i < table->capacity + GROUP_WIDTH; i++)
+    table->ctrl[i] = table->ctrl[i & mask];
+
+  for (unsigned int i = 0; i < table->capacity; i++)
+  {
+    while (table->ctrl[i] == CTRL_DELETED)
+    {
+      uint64_t hash = table->slot[i].hash;
+      unsigned int start = _CD_probe_start(table, hash).pos;
+      unsigned int target = _CD_find_free(table, hash);
+
+      // Probes reach both slots at the same point in the sequence
+      if (((i - start) & mask) / GROUP_WIDTH == ((target - start) & mask) / GROUP_WIDTH)
+      {
+        _CD_set_ctrl(table, i, _CD_h2(hash));
+        break;
+      }
+
+      bool target_empty = (table->ctrl[target] == CTRL_EMPTY);
+      struct _hash_slot moved = table->slot[target];
+
+      _CD_set_ctrl(table, target, _CD_h2(hash));
+      table->slot[target] = table->slot[i];
+
+      if (target_empty)
+        _CD_set_ctrl(table, i, CTRL_EMPTY);
+      else
+        table->slot[i] = moved;
+    }
+  }
+
+  table->num_deleted = 0;
+}
+
+/*
+ * Move entries from the old table into the new one, continuing from
+ * where the last call stopped. The old table is freed once it is
+ * empty.
+ *
+ * Parameters:
+ *   dict     The dictionary, which must be rehashing
+ *   budget   The maximum number of old slots to examine
+ *
+ * Returns: None
+ */
+static void _CD_migrate(CDict dict, unsigned int budget)
+{
+  struct _hash_table *old = &dict->old;
+
+  for (; budget > 0 && dict->migrate_pos < old->capacity; budget--, dict->migrate_pos++)
+  {
+    if (_CD_ctrl_is_full(old->ctrl[dict->migrate_pos]))
+    {
+      _CD_table_insert(&dict->table, &old->slot[dict->migrate_pos]);
+
+      // Lookups still search old, so the moved entry must go
+      _CD_table_erase(old, dict->migrate_pos);
+    }
+  }
+
+  if (old->num_stored == 0)
+    _CD_table_release(&dict->allocator, old);
+}
+
+/*
+ * Move the dictionary's entries into a new table. In incremental mode
+ * this only allocates the new table; the entries are moved across a
+ * few slots at a time by later stores and deletes. The entries of a
+ * small dictionary are always moved at once.
+ *
+ * Parameters:
+ *   dict         The dictionary
+ *   capacity     The new capacity; a power of two with room for every entry
+ *   incremental  Whether to leave the entries to be moved later
+ *
+ * Returns: None
+ */
+static void _CD_resize(CDict dict, unsigned int capacity, bool incremental)
+{
+  // Moving entries out of a snapshotted table would save nearly all of
+  // it for the snapshot; it is cheaper to hand the whole table over
+  if (dict->table.cow != NULL)
+    incremental = false;
+
+  // Only one migration can be in flight at a time
+  if (dict->old.capacity != 0)
+    _CD_migrate(dict, dict->old.capacity);
+
+  struct _hash_table new_table;
+
+  if (!_CD_table_init(dict, &new_table, capacity))
+  {
+    // The dictionary keeps working at its current size
+    printf("Error: memory allocation failed for new dictionary slot\n");
+    return;
+  }
+
+  // A small dictionary's entries are hashed for the first time here
+  for (unsigned int i = 0; i < dict->num_small; i++)
+  {
+    dict->small[i].hash = _CD_key_hash(dict, dict->small[i].key, dict->small[i].key_len);
+    _CD_table_insert(&new_table, &dict->small[i]);
+  }
+
+  dict->num_small = 0;
+
+  if (incremental)
+  {
+    dict->old = dict->table;
+    dict->table = new_table;
+    dict->migrate_pos = 0;
+    return;
+  }
+
+  // The cached hash is all that is needed to place each entry. A
+  // compact table's entries are moved in order, leaving out the holes.
+  if (_CD_table_is_compact(&dict->table))
+  {
+    for (unsigned int i = 0; i < dict->table.num_entries; i++)
+      if (dict->table.slot[i].key != NULL)
+        _CD_table_insert(&new_table, &dict->table.slot[i]);
+  }
+  else
+    for (unsigned int i = 0; i < dict->table.capacity; i++)
+      if (_CD_ctrl_is_full(dict->table.ctrl[i]))
+        _CD_table_insert(&new_table, &dict->table.slot[i]);
+
+  _CD_table_release(&dict->allocator, &dict->table);
+  dict->table = new_table;
+}
+
+/*
+ * Rehash the dictionary once its load factor passes its maximum,
+ * doubling its capacity. If at least half the load is tombstones,
+ * the table is instead purged of them at its current capacity: in
+ * place, or by moving entries to a new table of the same size a few
+ * at a time in incremental mode.
+ *
+ * Parameters:
+ *   dict     The dictionary to rehash
+ *
+ * Returns: None
+ */
+static void _CD_rehash(CDict dict)
+{
+  if (dict == NULL)
+  {
+    printf("Error: cannot rehash NULL dictionary\n");
+    return;
+  }
+
+  bool purge = dict->old.capacity == 0 && dict->table.num_stored <= dict->table.capacity * dict->max_load / 2;
+
+  if (!purge && dict->table.capacity >= MAX_DICT_CAPACITY)
+  {
+    printf("Error: dictionary cannot grow past %u slots\n", MAX_DICT_CAPACITY);
+    return;
+  }
+
+#ifdef CDICT_STATS
+  double start = _CD_now();
+#endif
+
+  // Purging in place would write to every chunk of a snapshotted table
+  if (purge && !(dict->flags & (CD_FLAG_INCREMENTAL | CD_FLAG_COMPACT)) && dict->table.cow == NULL)
+    _CD_table_purge(&dict->table);
+  else
+    _CD_resize(dict, dict->table.capacity * (purge ? 1 : 2), dict->flags & CD_FLAG_INCREMENTAL);
+
+#ifdef CDICT_STATS
+  dict->stats.num_rehashes++;
+  dict->stats.rehash_seconds += _CD_now() - start;
+#endif
+}
+
+// Documented in .h file
+unsigned int CD_size(CDict dict)
+{
+#ifdef DEBUG
+  // iterate across slots, counting number of keys found
+  const struct _hash_table *tables[] = {&dict->table, &dict->old};
+
+  for (int t = 0; t < 2; t++)
+  {
+    int used = 0;
+    int deleted = 0;
+
+    for (int i = 0; i < tables[t]->capacity; i++)
+      if (_CD_ctrl_is_full(tables[t]->ctrl[i]))
+        used++;
+      else if (tables[t]->ctrl[i] == CTRL_DELETED)
+        deleted++;
+
+    assert(used == tables[t]->num_stored);
+    assert(deleted == tables[t]->num_deleted);
+  }
+#endif
+
+  return dict->table.num_stored + dict->old.num_stored + dict->num_small;
+}
+
+// Documented in .h file
+unsigned int CD_capacity(CDict dict)
+{
+  if (dict == NULL)
+  {
+    printf("Error: cannot get capacity of NULL dictionary\n");
+    return 0;
+  }
+
+  // A small dictionary reports the capacity of a new table, which it
+  // never fills beyond the lowest maximum load factor either
+  return _CD_is_small(dict) ? DEFAULT_DICT_CAPACITY : dict->table.capacity;
+}
+
+/*
+ * Find the slot holding a key, in either table while rehashing
+ *
+ * Parameters:
+ *   dict   The dictionary
+ *   hash   The full hash of key
+ *   key    The key
+ *   len    Length of key in bytes
+ *   table  Set to the table holding key, if found
+ *
+ * Returns: The index of the slot holding key, or SLOT_NOT_FOUND
+ */
+static unsigned int _CD_lookup(CDict dict, uint64_t hash, const void *key, size_t len, struct _hash_table **table)
+{
+  // Only read with CDICT_STATS, and otherwise optimized away
+  unsigned int groups = 0;
+  unsigned int index = _CD_find(&dict->table, hash, key, len, &groups);
+  *table = &dict->table;
+
+  if (index == SLOT_NOT_FOUND && dict->old.capacity != 0)
+  {
+    index = _CD_find(&dict->old, hash, key, len, &groups);
+    *table = &dict->old;
+  }
+
+#ifdef CDICT_STATS
+  _CD_stats_probe(dict, index != SLOT_NOT_FOUND, groups);
+#endif
+
+  return index;
+}
+
+/*
+ * Shrink the dictionary to the smallest capacity that holds a number
+ * of entries, but not below the capacity reserved by the caller or
+ * the default capacity. Does nothing if that is no smaller than the
+ * current capacity.
+ *
+ * Parameters:
+ *   dict         The dictionary, which must not be small
+ *   num_entries  The number of entries to make room for
+ *   incremental  Whether to move the entries a few at a time
+ *
+ * Returns: None
+ */
+static void _CD_shrink(CDict dict, unsigned int num_entries, bool incremental)
+{
+  unsigned int capacity = _CD_capacity_for(num_entries, dict->max_load);
+
+  if (capacity < dict->min_capacity)
+    capacity = dict->min_capacity;
+
+  if (capacity != 0 && capacity < dict->table.capacity)
+    _CD_resize(dict, capacity, incremental);
+}
+
+// Documented in .h file
+void CD_reserve(CDict dict, unsigned int num_entries)
+{
+  if (dict == NULL)
+  {
+    printf("Error: cannot reserve space in NULL dictionary\n");
+    return;
+  }
+
+  unsigned int capacity = _CD_capacity_for(num_entries, dict->max_load);
+
+  if (capacity == 0)
+  {
+    printf("Error: cannot reserve space for %u entries\n", num_entries);
+    return;
+  }
+
+  if (_CD_is_small(dict) && num_entries <= SMALL_DICT_SLOTS)
+    return;
+
+  if (capacity > dict->min_capacity)
+    dict->min_capacity = capacity;
+
+  // Growing all at once also completes any incremental rehash
+  if (capacity > dict->table.capacity)
+    _CD_resize(dict, capacity, false);
+}
+
+// Documented in .h file
+void CD_shrink_to_fit(CDict dict)
+{
+  if (dict == NULL)
+  {
+    printf("Error: cannot shrink NULL dictionary\n");
+    return;
+  }
+
+  if (_CD_is_small(dict))
+    return;
+
+  if (dict->old.capacity != 0)
+    _CD_migrate(dict, dict->old.capacity);
+
+  unsigned int capacity = dict->table.capacity;
+
+  dict->min_capacity = 0;
+  _CD_shrink(dict, dict->table.num_stored, false);
+
+  if (dict->table.capacity != capacity)
+    return;
+
+  if (_CD_table_is_compact(&dict->table))
+  {
+    if (dict->table.num_entries != dict->table.num_stored)
+      _CD_resize(dict, capacity, false);
+  }
+  else if (dict->table.num_deleted != 0)
+  {
+    // Purging in place would write to every chunk of a snapshotted table
+    if (dict->table.cow != NULL)
+      _CD_resize(dict, capacity, false);
+    else
+      _CD_table_purge(&dict->table);
+  }
+}
+
+// Documented in cdict_internal.h
+void _CD_store(CDict dict, const void *key, size_t len, uint64_t hash, CDictValueType value)
+{
+  struct _hash_slot *slot = NULL;    // the entry for key, if already stored
+  struct _hash_table *table = NULL;  // the table holding slot, unless small
+
+  if (_CD_is_small(dict))
+  {
+    unsigned int index = _CD_small_find(dict, key, len);
+
+    if (index != SLOT_NOT_FOUND)
+      slot = &dict->small[index];
+    else if (dict->num_small == SMALL_DICT_SLOTS)
+    {
+#ifdef CDICT_STATS
+      double start = _CD_now();
+#endif
+
+      _CD_resize(dict, _CD_capacity_for(SMALL_DICT_SLOTS + 1, dict->max_load), false);
+
+#ifdef CDICT_STATS
+      dict->stats.num_rehashes++;
+      dict->stats.rehash_seconds += _CD_now() - start;
+#endif
+
+      if (_CD_is_small(dict))
+        return;
+
+      // The key is new, so there is no need to look it up in the table
+      hash = _CD_key_hash(dict, key, len);
+    }
+  }
+  else
+  {
+    if (dict->old.capacity != 0)
+      _CD_migrate(dict, MIGRATE_SLOTS_PER_OP);
+
+    unsigned int index = _CD_lookup(dict, hash, key, len, &table);
+
+    if (index != SLOT_NOT_FOUND)
+      slot = _CD_slot(table, index);
+  }
+
+  if (dict->flags & CD_FLAG_OWNED)
+  {
+    // Copy the key next to the value, and only for a new entry
+    const void *key_copy = (slot == NULL) ? _CD_arena_copy(&dict->arena, key, len) : key;
+    CDictValueType value_copy = _CD_arena_copy(&dict->arena, value, strlen(value));
+
+    if (key_copy == NULL || value_copy == NULL)
+    {
+      printf("Store error: memory allocation failed for [%.*s]\n", (int)len, (const char *)key);
+      return;
+    }
+
+    key = key_copy;
+    value = value_copy;
+  }
+
+  // Found a slot with the same key, update the value
+  if (slot != NULL)
+  {
+    if (table != NULL)
+      _CD_before_write(table, &slot->value, sizeof(slot->value));
+
+    slot->value = value;
+    return;
+  }
+
+  struct _hash_slot entry = {hash, key, value, len};
+
+  if (_CD_is_small(dict))
+  {
+    dict->small[dict->num_small++] = entry;
+    return;
+  }
+
+  // A compact table that could not be rebuilt has no room left
+  if (_CD_table_is_compact(&dict->table) && dict->table.num_entries == dict->table.max_entries)
+  {
+    printf("Store error: no room for [%.*s]\n", (int)len, (const char *)key);
+    return;
+  }
+
+  // Otherwise insert in the first empty slot on the probe sequence
+  _CD_table_insert(&dict->table, &entry);
+
+  // Check if rehashing is needed after storing new key
+  if (CD_load_factor(dict) > dict->max_load)
+    _CD_rehash(dict);
+}
+
+// Documented in cdict_internal.h
+bool _CD_delete(CDict dict, const void *key, size_t len, uint64_t hash)
+{
+  if (_CD_is_small(dict))
+  {
+    unsigned int index = _CD_small_find(dict, key, len);
+
+    if (index == SLOT_NOT_FOUND)
+      return false;
+
+    // A compact dictionary keeps even its small entries in order
+    if (dict->flags & CD_FLAG_COMPACT)
+      memmove(&dict->small[index], &dict->small[index + 1], (--dict->num_small - index) * sizeof(dict->small[0]));
+    else
+      dict->small[index] = dict->small[--dict->num_small];
+
+    return true;
+  }
+
+  if (dict->old.capacity != 0)
+    _CD_migrate(dict, MIGRATE_SLOTS_PER_OP);
+
+  struct _hash_table *table;
+  unsigned int index = _CD_lookup(dict, hash, key, len, &table);
+
+  if (index == SLOT_NOT_FOUND)
+    return false;
+
+  _CD_table_erase(table, index);
+
+  if (table == &dict->old && dict->old.num_stored == 0)
+    _CD_table_release(&dict->allocator, &dict->old);
+
+  // Shrink once the table is less than a quarter as full as it may
+  // get, to a capacity at which it is about half as full
+  if (dict->old.capacity == 0 && dict->table.capacity > DEFAULT_DICT_CAPACITY &&
+      dict->table.capacity > dict->min_capacity && dict->table.num_stored < dict->table.capacity * dict->max_load / 4)
+    _CD_shrink(dict, dict->table.num_stored * 2, dict->flags & CD_FLAG_INCREMENTAL);
+
+  return true;
+}
+
+// Documented in cdict_internal.h
+CDictValueType _CD_retrieve(CDict dict, const void *key, size_t len, uint64_t hash)
+{
+  if (_CD_is_small(dict))
+  {
+    unsigned int index = _CD_small_find(dict, key, len);
+
+    return (index == SLOT_NOT_FOUND) ? INVALID_VALUE : dict->small[index].value;
+  }
+
+  struct _hash_table *table;
+  unsigned int index = _CD_lookup(dict, hash, key, len, &table);
+
+  if (index == SLOT_NOT_FOUND)
+    return INVALID_VALUE;
+
+  return _CD_slot(table, index)->value;
+}
+
+// Documented in .h file
+bool CD_contains(CDict dict, CDictKeyType key)
+{
+  if (dict == NULL || key == NULL)
+  {
+    printf("Contains error: dictionary or key is NULL for [%s]\n", key);
+    return false;
+  }
+
+  size_t len = strlen(key);
+
+  // Values are never NULL, so only a missing key retrieves INVALID_VALUE
+  return _CD_retrieve(dict, key, len, _CD_hash_if_needed(dict, key, len)) != INVALID_VALUE;
+}
+
+// Documented in .h file
+bool CD_contains_n(CDict dict, const void *key, size_t len)
+{
+  if (dict == NULL || key == NULL)
+  {
+    printf("Contains error: dictionary or key is NULL\n");
+    return false;
+  }
+
+  return _CD_retrieve(dict, key, len, _CD_hash_if_needed(dict, key, len)) != INVALID_VALUE;
+}
+
+// Documented in .h file
+void CD_store(CDict dict, CDictKeyType key, CDictValueType value)
+{
+  if (dict == NULL || key == NULL || value == NULL)
+  {
+    printf("Store error: dictionary or key or value is NULL for [%s]\n", key);
+    return;
+  }
+
+  size_t len = strlen(key);
+
+  _CD_store(dict, key, len, _CD_hash_if_needed(dict, key, len), value);
+}
+
+// Documented in .h file
+void CD_store_n(CDict dict, const void *key, size_t len, CDictValueType value)
+{
+  if (dict == NULL || key == NULL || value == NULL)
+  {
+    printf("Store error: dictionary or key or value is NULL\n");
+    return;
+  }
+
+  _CD_store(dict, key, len, _CD_hash_if_needed(dict, key, len), value);
+}
+
+// Documented in .h file
+CDictValueType CD_retrieve(CDict dict, CDictKeyType key)
+{
+  if (dict == NULL || key == NULL)
+  {
+    printf("Retrieve error: dictionary or key is NULL for [%s]\n", key);
+    return INVALID_VALUE;
+  }
+
+  size_t len = strlen(key);
+
+  return _CD_retrieve(dict, key, len, _CD_hash_if_needed(dict, key, len));
+}
+
+// Documented in .h file
+CDictValueType CD_retrieve_n(CDict dict, const void *key, size_t len)
+{
+  if (dict == NULL || key == NULL)
+  {
+    printf("Retrieve error: dictionary or key is NULL\n");
+    return INVALID_VALUE;
+  }
+
+  return _CD_retrieve(dict, key, len, _CD_hash_if_needed(dict, key, len));
+}
+
+/*
+ * Look up a batch of keys, overlapping their cache misses. Rather than
+ * probing for one key at a time, every key is hashed and the first
+ * group of control bytes for each is prefetched; those groups are then
+ * matched and the candidate slots prefetched; only then are the probes
+ * resolved, against memory that is by now mostly in cache.
+ *
+ * Parameters:
+ *   dict     The dictionary
+ *   keys     The keys; NULL keys are never found
+ *   n        Number of keys, at most LOOKUP_BATCH
+ *   found    Set to the slot holding each key, or NULL if not found
+ *
+ * Returns: None
+ */
+static void _CD_lookup_batch(CDict dict, const CDictKeyType *keys, unsigned int n, const struct _hash_slot **found)
+{
+  const struct _hash_table *table = &dict->table;
+  uint64_t hash[LOOKUP_BATCH];
+  size_t len[LOOKUP_BATCH];
+
+  if (_CD_is_small(dict))
+  {
+    for (unsigned int i = 0; i < n; i++)
+    {
+      unsigned int index = keys[i] ? _CD_small_find(dict, keys[i], strlen(keys[i])) : SLOT_NOT_FOUND;
+
+      found[i] = (index == SLOT_NOT_FOUND) ? NULL : &dict->small[index];
+    }
+
+    return;
+  }
+
+  for (unsigned int i = 0; i < n; i++)
+  {
+    if (keys[i] == NULL)
+      continue;
+
+    len[i] = strlen(keys[i]);
+    hash[i] = _CD_key_hash(dict, keys[i], len[i]);
+    __builtin_prefetch(table->ctrl + _CD_probe_start(table, hash[i]).pos);
+  }
+
+  for (unsigned int i = 0; i < n; i++)
+  {
+    if (keys[i] == NULL)
+      continue;
+
+    struct _probe_seq seq = _CD_probe_start(table, hash[i]);
+    uint32_t match = _CD_group_match(table->ctrl + seq.pos, _CD_h2(hash[i]));
+
+    if (match)
+      __builtin_prefetch(_CD_slot(table, (seq.pos + __builtin_ctz(match)) & seq.mask));
+  }
+
+  for (unsigned int i = 0; i < n; i++)
+  {
+    struct _hash_table *holder;
+    unsigned int index = keys[i] ? _CD_lookup(dict, hash[i], keys[i], len[i], &holder) : SLOT_NOT_FOUND;
+
+    found[i] = (index == SLOT_NOT_FOUND) ? NULL : _CD_slot(holder, index);
+  }
+}
+
+// Documented in .h file
+unsigned int CD_retrieve_many(CDict dict, const CDictKeyType *keys, unsigned int n, CDictValueType *values)
+{
+  if (dict == NULL || keys == NULL || values == NULL)
+  {
+    printf("Retrieve error: dictionary, keys or values is NULL\n");
+    return 0;
+  }
+
+  const struct _hash_slot *found[LOOKUP_BATCH];
+  unsigned int num_found = 0;
+
+  for (unsigned int base = 0; base < n; base += LOOKUP_BATCH)
+  {
+    unsigned int count = (n - base < LOOKUP_BATCH) ? n - base : LOOKUP_BATCH;
+
+    _CD_lookup_batch(dict, keys + base, count, found);
+
+    for (unsigned int i = 0; i < count; i++)
+    {
+      values[base + i] = found[i] ? found[i]->value : INVALID_VALUE;
+      num_found += (found[i] != NULL);
+    }
+  }
+
+  return num_found;
+}
+
+// Documented in .h file
+unsigned int CD_contains_many(CDict dict, const CDictKeyType *keys, unsigned int n, bool *contained)
+{
+  if (dict == NULL || keys == NULL || contained == NULL)
+  {
+    printf("Contains error: dictionary, keys or results is NULL\n");
+    return 0;
+  }
+
+  const struct _hash_slot *found[LOOKUP_BATCH];
+  unsigned int num_found = 0;
+
+  for (unsigned int base = 0; base < n; base += LOOKUP_BATCH)
+  {
+    unsigned int count = (n - base < LOOKUP_BATCH) ? n - base : LOOKUP_BATCH;
+
+    _CD_lookup_batch(dict, keys + base, count, found);
+
+    for (unsigned int i = 0; i < count; i++)
+    {
+      contained[base + i] = (found[i] != NULL);
+      num_found += (found[i] != NULL);
+    }
+  }
+
+  return num_found;
+}
+
+// Documented in .h file
+void CD_delete(CDict dict, CDictKeyType key)
+{
+  if (dict == NULL || key == NULL)
+  {
+    printf("Delete error: dictionary or key is NULL for [%s]\n", key);
+    return;
+  }
+
+  size_t len = strlen(key);
+
+  // Can't find the key
+  if (!_CD_delete(dict, key, len, _CD_hash_if_needed(dict, key, len)))
+    printf("Error: cannot delete key [%s] not found\n", key);
+}
+
+// Documented in .h file
+void CD_delete_n(CDict dict, const void *key, size_t len)
+{
+  if (dict == NULL || key == NULL)
+  {
+    printf("Delete error: dictionary or key is NULL\n");
+    return;
+  }
+
+  if (!_CD_delete(dict, key, len, _CD_hash_if_needed(dict, key, len)))
+    printf("Error: cannot delete key [%.*s] not found\n", (int)len, (const char *)key);
+}
+
+/*
+ * Map a file privately and writably, followed by at least one zero
+ * byte, so that every line can be NUL-terminated in place, including
+ * a last line with no newline
+ *
+ * Parameters:
+ *   path     The file
+ *   size     Set to the size of the file
+ *   mapped   Set to the size of the mapping
+ *
+ * Returns: The mapping, or NULL on failure
+ */
+static char *_CD_map_file(const char *path, size_t *size, size_t *mapped)
+{
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+
+  if (fd < 0 || fstat(fd, &st) != 0)
+  {
+    if (fd >= 0)
+      close(fd);
+
+    return NULL;
+  }
+
+  *size = (size_t)st.st_size;
+  *mapped = *size + 1;
+
+  // Reserve zero pages for the whole range, then map the file over
+  // them; the spare byte lands either in the zero-filled tail of the
+  // file's last page or in a reserved page after it
+  char *text = mmap(NULL, *mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+  if (text != MAP_FAILED && *size > 0 &&
+      mmap(text, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED)
+  {
+    munmap(text, *mapped);
+    text = MAP_FAILED;
+  }
+
+  close(fd);
+
+  return (text == MAP_FAILED) ? NULL : text;
+}
+
+// Documented in .h file
+int CD_load_tsv(CDict dict, const char *path, unsigned int flags)
+{
+  if (dict == NULL || path == NULL)
+  {
+    printf("Error: cannot load into NULL dictionary or from NULL path\n");
+    return -1;
+  }
+
+  struct _file_mapping *mapping = NULL;
+  size_t size;
+  size_t mapped;
+
+  // Unless the dictionary copies them, keys and values stay in the
+  // mapping, so it must be recorded before anything is stored
+  if (!(dict->flags & CD_FLAG_OWNED) && (mapping = malloc(sizeof(struct _file_mapping))) == NULL)
+  {
+    printf("Error: memory allocation failed for loading [%s]\n", path);
+    return -1;
+  }
+
+  char *text = _CD_map_file(path, &size, &mapped);
+
+  if (text == NULL)
+  {
+    printf("Error: cannot map [%s]\n", path);
+    free(mapping);
+    return -1;
+  }
+
+  madvise(text, mapped, MADV_SEQUENTIAL);
+
+  // Make room for every line at once, rather than rehashing on the way
+  unsigned int num_lines = 1;
+
+  for (const char *p = text; (p = memchr(p, '\n', text + size - p)) != NULL; p++)
+    num_lines++;
+
+  if (num_lines < MAX_DICT_CAPACITY * dict->max_load - CD_size(dict))
+    CD_reserve(dict, CD_size(dict) + num_lines);
+
+  char *line = text;
+  char *end = text + size;
+  int stored = 0;
+
+  for (unsigned int line_no = 1; line < end; line_no++)
+  {
+    char *eol = memchr(line, '\n', end - line);
+    char *next;
+
+    if (eol == NULL)
+      eol = end;
+
+    next = eol + 1;
+
+    if (eol > line && eol[-1] == '\r')
+      eol--;
+
+    *eol = '\0';
+
+    char *tab = memchr(line, '\t', eol - line);
+
+    if (tab == NULL && eol != line && (flags & CD_LOAD_STRICT))
+    {
+      printf("Error: no tab on line %u of [%s]\n", line_no, path);
+      stored = -1;
+      break;
+    }
+
+    if (tab != NULL)
+    {
+      size_t len = tab - line;
+      uint64_t hash = _CD_hash_if_needed(dict, line, len);
+
+      *tab = '\0';
+
+      if (!(flags & CD_LOAD_KEEP_FIRST) || _CD_retrieve(dict, line, len, hash) == INVALID_VALUE)
+      {
+        _CD_store(dict, line, len, hash, tab + 1);
+        stored++;
+      }
+    }
+
+    line = next;
+  }
+
+  if (mapping != NULL)
+  {
+    mapping->addr = text;
+    mapping->size = mapped;
+    mapping->next = dict->mappings;
+    dict->mappings = mapping;
+  }
+  else
+    munmap(text, mapped);
+
+  return stored;
+}
+
+// Documented in .h file
+double CD_load_factor(CDict dict)
+{
+  if (dict == NULL)
+  {
+    printf("Error: dictionary is NULL or has zero capacity\n");
+    return 0;
+  }
+
+  if (_CD_is_small(dict))
+    return (double)dict->num_small / DEFAULT_DICT_CAPACITY;
+
+  // Holes left among a compact table's entries take up room until it is
+  // rebuilt, just as tombstones do
+  if (_CD_table_is_compact(&dict->table))
+    return (double)dict->table.num_entries / dict->table.capacity;
+
+  // Entries still waiting in the old table will all land in the new one
+  return (double)(dict->table.num_stored + dict->table.num_deleted + dict->old.num_stored) / dict->table.capacity;
+}
+
+// Documented in .h file
+void CD_stats(CDict dict, CDictStats *stats)
+{
+  if (dict == NULL || stats == NULL)
+  {
+    printf("Error: cannot get statistics of NULL dictionary\n");
+    return;
+  }
+
+  memset(stats, 0, sizeof(*stats));
+
+  stats->size = CD_size(dict);
+  stats->capacity = CD_capacity(dict);
+  stats->num_deleted = dict->table.num_deleted + dict->old.num_deleted;
+  stats->tombstone_ratio = (double)stats->num_deleted / (stats->capacity + dict->old.capacity);
+
+#ifdef CDICT_STATS
+  stats->counting = true;
+
+  for (int i = 0; i < CD_STATS_PROBE_BUCKETS; i++)
+  {
+    stats->hit_probes[i] = __atomic_load_n(&dict->stats.hit_probes[i], __ATOMIC_RELAXED);
+    stats->miss_probes[i] = __atomic_load_n(&dict->stats.miss_probes[i], __ATOMIC_RELAXED);
+  }
+
+  stats->max_hit_probes = __atomic_load_n(&dict->stats.max_hit_probes, __ATOMIC_RELAXED);
+  stats->max_miss_probes = __atomic_load_n(&dict->stats.max_miss_probes, __ATOMIC_RELAXED);
+  stats->num_rehashes = dict->stats.num_rehashes;
+  stats->rehash_seconds = dict->stats.rehash_seconds;
+#endif
+
+  const struct _hash_table *tables[] = {&dict->table, &dict->old};
+
+  for (int t = 0; t < 2; t++)
+    if (tables[t]->capacity != 0)
+      stats->slot_bytes += _CD_table_bytes(tables[t]);
+
+  for (const struct _arena_chunk *chunk = dict->arena; chunk != NULL; chunk = chunk->next)
+    stats->owned_bytes += sizeof(struct _arena_chunk) + chunk->size;
+
+  for (const struct _file_mapping *mapping = dict->mappings; mapping != NULL; mapping = mapping->next)
+    stats->mapped_bytes += mapping->size;
+}
+
+/*
+ * Print every slot of a table, including the unused and deleted ones
+ *
+ * Parameters:
+ *   table    The table
+ *
+ * Returns: None
+ */
+static void _CD_print_table(const struct _hash_table *table)
+{
+  for (unsigned int i = 0; i < table->capacity; i++)
+  {
+    printf("%02u: ", i);
+
+    if (table->ctrl[i] == CTRL_EMPTY)
+      printf("unused\n");
+
+    else if (table->ctrl[i] == CTRL_DELETED)
+      printf("DELETED\n");
+
+    else
+    {
+      const struct _hash_slot *slot = _CD_slot(table, i);
+
+      printf("IN_USE key=%.*s hash=%u value=%s\n", (int)slot->key_len, slot->key,
+             (unsigned int)(_CD_h1(slot->hash) & (table->capacity - 1)), slot->value);
+    }
+  }
+}
+
+// Documented in .h file
+void CD_print(CDict dict)
+{
+  if (dict == NULL)
+  {
+    printf("Error: cannot print NULL dictionary\n");
+    return;
+  }
+
+  printf("\n\n");
+
+  if (_CD_is_small(dict))
+  {
+    printf("*** small: %u of %u entries\n", dict->num_small, SMALL_DICT_SLOTS);
+
+    for (unsigned int i = 0; i < dict->num_small; i++)
+      printf("%02u: key=%.*s value=%s\n", i, (int)dict->small[i].key_len, dict->small[i].key, dict->small[i].value);
+
+    return;
+  }
+
+  printf("*** capacity: %u stored: %u deleted: %u load_factor: %.2f\n",
+         dict->table.capacity, dict->table.num_stored, dict->table.num_deleted, CD_load_factor(dict));
+
+  _CD_print_table(&dict->table);
+
+  if (dict->old.capacity != 0)
+  {
+    printf("*** rehashing from capacity: %u stored: %u deleted: %u next slot: %u\n",
+           dict->old.capacity, dict->old.num_stored, dict->old.num_deleted, dict->migrate_pos);
+
+    _CD_print_table(&dict->old);
+  }
+}
+
+void CD_foreach(CDict dict, CD_foreach_callback callback, void *cb_data)
+{
+  if (dict == NULL || callback == NULL)
+    return;
+
+  const struct _hash_table *tables[] = {&dict->table, &dict->old};
+
+  for (unsigned int i = 0; i < dict->num_small; i++)
+    callback(dict->small[i].key, dict->small[i].value, cb_data);
+
+  // A compact table's entries are visited in order, skipping holes
+  if (_CD_table_is_compact(&dict->table))
+  {
+    for (unsigned int i = 0; i < dict->table.num_entries; i++)
+      if (dict->table.slot[i].key != NULL)
+        callback(dict->table.slot[i].key, dict->table.slot[i].value, cb_data);
+
+    return;
+  }
+
+  for (int t = 0; t < 2; t++)
+    for (unsigned int i = 0; i < tables[t]->capacity; i++)
+      if (_CD_ctrl_is_full(tables[t]->ctrl[i]))
+        callback(tables[t]->slot[i].key, tables[t]->slot[i].value, cb_data);
+}
+
+
+// Documented in .h file
+void CD_iter_begin(CDict dict, CDictIterator *iter)
+{
+  CD_iter_range(dict, 0, 1, iter);
+}
+
+// Documented in .h file
+void CD_iter_range(CDict dict, unsigned int part, unsigned int num_parts, CDictIterator *iter)
+{
+  if (iter == NULL)
+    return;
+
+  // An iterator that is not set up properly visits nothing
+  memset(iter, 0, sizeof(*iter));
+
+  if (dict == NULL || part >= num_parts)
+  {
+    printf("Error: cannot iterate over part %u of %u of dictionary\n", part, num_parts);
+    return;
+  }
+
+  // The old table's slots are numbered after the new table's, so a
+  // part covers the same share of each while rehashing. The entries of
+  // a small or compact dictionary are numbered in place of slots.
+  uint64_t total = (uint64_t)dict->table.capacity + dict->old.capacity;
+
+  if (_CD_is_small(dict))
+    total = dict->num_small;
+  else if (_CD_table_is_compact(&dict->table))
+    total = dict->table.num_entries;
+
+  iter->_dict = dict;
+  iter->_pos = (unsigned int)(total * part / num_parts);
+  iter->_end = (unsigned int)(total * (part + 1) / num_parts);
+}
+
+// Documented in .h file
+bool CD_iter_next(CDictIterator *iter)
+{
+  if (iter == NULL)
+    return false;
+
+  if (iter->_dict != NULL && _CD_is_small(iter->_dict))
+  {
+    if (iter->_pos >= iter->_end || iter->_pos >= iter->_dict->num_small)
+      return false;
+
+    const struct _hash_slot *slot = &iter->_dict->small[iter->_pos];
+
+    iter->_pos++;
+    iter->key = slot->key;
+    iter->key_len = slot->key_len;
+    iter->value = slot->value;
+
+    return true;
+  }
+
+  if (iter->_dict != NULL && _CD_table_is_compact(&iter->_dict->table))
+  {
+    const struct _hash_table *table = &iter->_dict->table;
+
+    while (iter->_pos < iter->_end && iter->_pos < table->num_entries)
+    {
+      const struct _hash_slot *slot = &table->slot[iter->_pos++];
+
+      if (slot->key != NULL)
+      {
+        iter->key = slot->key;
+        iter->key_len = slot->key_len;
+        iter->value = slot->value;
+
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+  while (iter->_pos < iter->_end)
+  {
+    const struct _hash_table *table = &iter->_dict->table;
+    unsigned int base = 0;
+
+    if (iter->_pos >= table->capacity)
+    {
+      base = table->capacity;
+      table = &iter->_dict->old;
+    }
 
-#include "cdict.h"
+    // Skip a group of slots at a time, stopping at the end of the
+    // range or the table, whichever comes first
+    unsigned int pos = iter->_pos - base;
+    unsigned int limit = (iter->_end - base < table->capacity) ? iter->_end - base : table->capacity;
+    unsigned int count = (limit - pos < GROUP_WIDTH) ? limit - pos : GROUP_WIDTH;
+    uint32_t full = _CD_group_full(table->ctrl + pos);
 
-#define DEBUG
+    if (count < GROUP_WIDTH)
+      full &= (1u << count) - 1;
+
+    if (full == 0)
+    {
+      iter->_pos += count;
+      continue;
+    }
 
-#define DEFAULT_DICT_CAPACITY 8
-#define REHASH_THRESHOLD 0.6
+    const struct _hash_slot *slot = &table->slot[pos + __builtin_ctz(full)];
 
-typedef enum
-{
-  SLOT_UNUSED = 0,
-  SLOT_IN_USE,
-  SLOT_DELETED
-} CDictSlotStatus;
+    iter->_pos = base + pos + __builtin_ctz(full) + 1;
+    iter->key = slot->key;
+    iter->key_len = slot->key_len;
+    iter->value = slot->value;
 
-struct _hash_slot
+    return true;
+  }
+
+  return false;
+}
+
+// One thread's share of a CD_foreach_parallel scan
+struct _parallel_scan
 {
-  CDictSlotStatus status;
-  CDictKeyType key;
-  CDictValueType value;
+  CDict dict;
+  unsigned int part;
+  unsigned int num_parts;
+  CD_foreach_callback callback;
+  void *cb_data;
+  pthread_t thread;
+  bool started;
 };
 
-struct _dictionary
+static void *_CD_scan_part(void *arg)
 {
-  unsigned int num_stored;
-  unsigned int num_deleted;
-  unsigned int capacity;
-  struct _hash_slot *slot;
-};
+  struct _parallel_scan *scan = arg;
+  CDictIterator iter;
+
+  CD_iter_range(scan->dict, scan->part, scan->num_parts, &iter);
+
+  while (CD_iter_next(&iter))
+    scan->callback(iter.key, iter.value, scan->cb_data);
+
+  return NULL;
+}
 
 // Documented in .h file
-CDict CD_new()
+void CD_foreach_parallel(CDict dict, unsigned int num_threads, CD_foreach_callback callback, void *cb_data)
 {
-  CDict dict = (CDict)malloc(sizeof(struct _dictionary));
+  if (dict == NULL || callback == NULL)
+    return;
 
-  if (dict == NULL)
+  if (num_threads == 0)
   {
-    printf("Error: memory allocation failed for dictionary\n");
-    return NULL;
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    num_threads = (online > 0) ? (unsigned int)online : 1;
   }
 
-  dict->num_stored = 0;
-  dict->num_deleted = 0;
-  dict->capacity = DEFAULT_DICT_CAPACITY;
+  unsigned int total = dict->table.capacity + dict->old.capacity;
+  unsigned int max_threads = (total + MIN_SLOTS_PER_THREAD - 1) / MIN_SLOTS_PER_THREAD;
 
-  dict->slot = (struct _hash_slot *)malloc(sizeof(struct _hash_slot) * dict->capacity);
+  if (num_threads > max_threads)
+    num_threads = max_threads;
 
-  if (dict->slot == NULL)
+  struct _parallel_scan *scan = (num_threads > 1) ? calloc(num_threads, sizeof(struct _parallel_scan)) : NULL;
+
+  if (scan == NULL)
   {
-    printf("Error: memory allocation failed for dictionary slot\n");
-    CD_free(dict);
-    return NULL;
+    CD_foreach(dict, callback, cb_data);
+    return;
   }
 
-  // Initialize the slots
-  for (unsigned int i = 0; i < dict->capacity; i++)
+  for (unsigned int i = 0; i < num_threads; i++)
   {
-    dict->slot[i].status = SLOT_UNUSED;
-    dict->slot[i].key = NULL;
-    dict->slot[i].value = NULL;
+    scan[i] = (struct _parallel_scan){dict, i, num_threads, callback, cb_data};
+
+    // Part 0 is the caller's
+    if (i > 0)
+      scan[i].started = pthread_create(&scan[i].thread, NULL, _CD_scan_part, &scan[i]) == 0;
   }
 
-  return dict;
+  _CD_scan_part(&scan[0]);
+
+  // Parts whose thread could not be started are scanned here instead
+  for (unsigned int i = 1; i < num_threads; i++)
+    if (scan[i].started)
+      pthread_join(scan[i].thread, NULL);
+    else
+      _CD_scan_part(&scan[i]);
+
+  free(scan);
 }
 
-// Documented in .h file
-void CD_free(CDict dict)
+// Documented in cdict_internal.h
+void _CD_foreach_entry(CDict dict, _CD_entry_callback callback, void *cb_data)
 {
-  if (dict)
+  const struct _hash_table *tables[] = {&dict->table, &dict->old};
+
+  for (unsigned int i = 0; i < dict->num_small; i++)
+    callback(dict->small[i].key, dict->small[i].key_len, dict->small[i].value, cb_data);
+
+  if (_CD_table_is_compact(&dict->table))
   {
-    if (dict->slot)
-      free(dict->slot);
+    for (unsigned int i = 0; i < dict->table.num_entries; i++)
+      if (dict->table.slot[i].key != NULL)
+        callback(dict->table.slot[i].key, dict->table.slot[i].key_len, dict->table.slot[i].value, cb_data);
 
-    free(dict);
+    return;
   }
+
+  for (int t = 0; t < 2; t++)
+    for (unsigned int i = 0; i < tables[t]->capacity; i++)
+      if (_CD_ctrl_is_full(tables[t]->ctrl[i]))
+        callback(tables[t]->slot[i].key, tables[t]->slot[i].key_len, tables[t]->slot[i].value, cb_data);
 }
 
 /*
- * Return a pseudorandom hash of a key with reasonable distribution
- * properties. Based on Python's implementation before Python 3.4
+ * Copy a table's block as it is, pointing the copy's arrays into the
+ * new block at the same offsets as in the old
  *
  * Parameters:
- *   str   The string to be hashed
- *   capacity  The capacity of the dictionary
+ *   dict      The dictionary whose allocator to use
+ *   copy      Set to the copy; left with zero capacity on failure
+ *   table     The table to copy
  *
- * Returns: The hash, in the range 0-(capacity-1) inclusive
+ * Returns: True on success, false if memory allocation failed
  */
-static unsigned int _CD_hash(CDictKeyType str, unsigned int capacity)
+static bool _CD_table_clone(CDict dict, struct _hash_table *copy, const struct _hash_table *table)
 {
-  unsigned int x;
-  unsigned int len = 0;
+  memset(copy, 0, sizeof(*copy));
 
-  for (const char *p = str; *p; p++)
-    len++;
+  if (table->capacity == 0)
+    return true;
 
-  if (len == 0)
-    return 0;
+  char *block = dict->allocator.alloc(_CD_table_bytes(table), dict->allocator.ctx);
+
+  if (block == NULL)
+    return false;
+
+  memcpy(block, table->slot, _CD_table_bytes(table));
 
-  const char *p = str;
-  x = (unsigned int)*p << 7;
+  *copy = *table;
+  copy->cow = NULL;
+  copy->slot = (struct _hash_slot *)block;
+  copy->ctrl = (int8_t *)(block + ((char *)table->ctrl - (char *)table->slot));
 
-  for (int i = 0; i < len; i++)
-    x = (1000003 * x) ^ (unsigned int)*p++;
+  if (table->index != NULL)
+    copy->index = block + ((char *)table->index - (char *)table->slot);
 
-  x ^= (unsigned int)len;
+  return true;
+}
+
+// Memory that a dictionary frees along with itself, and that its keys
+// and values may point into: a loaded file or a chunk of its arena
+struct _string_range
+{
+  const char *start;
+  const char *end;
+};
 
-  return x % capacity;
+static int _CD_range_compare(const void *a, const void *b)
+{
+  const char *x = ((const struct _string_range *)a)->start;
+  const char *y = ((const struct _string_range *)b)->start;
+
+  return (x > y) - (x < y);
 }
 
 /*
- * Rehash the dictionary, doubling its capacity
+ * Collect, sorted by address, the ranges of memory a dictionary frees
+ * along with itself: the files it has loaded, and its arena chunks.
+ * A dictionary that does not own its keys has an arena only if it is
+ * a clone, holding copies of strings from another dictionary's.
  *
  * Parameters:
- *   dict     The dictionary to rehash
+ *   dict        The dictionary
+ *   num_ranges  Set to the number of ranges
  *
- * Returns: None
+ * Returns: The ranges, to be freed by the caller, or NULL if there are
+ *   none or memory allocation failed
  */
-static void _CD_rehash(CDict dict)
+static struct _string_range *_CD_string_ranges(CDict dict, size_t *num_ranges)
 {
-  if (dict == NULL)
-  {
-    printf("Error: cannot rehash NULL dictionary\n");
-    return;
-  }
+  size_t n = 0;
 
-  unsigned int new_capacity = dict->capacity * 2;
-  unsigned int new_num_stored = 0;
-  struct _hash_slot *new_slot = malloc(sizeof(struct _hash_slot) * new_capacity);
+  for (const struct _file_mapping *m = dict->mappings; m != NULL; m = m->next)
+    n++;
 
-  if (new_slot == NULL)
-  {
-    printf("Error: memory allocation failed for new dictionary slot\n");
-    CD_free(dict);
-    return;
-  }
+  for (const struct _arena_chunk *c = dict->arena; c != NULL; c = c->next)
+    n++;
 
-  // Initialize the new slots
-  for (unsigned int i = 0; i < new_capacity; i++)
-    new_slot[i].status = SLOT_UNUSED;
+  struct _string_range *ranges = (n == 0) ? NULL : malloc(n * sizeof(*ranges));
 
-  for (unsigned int i = 0; i < dict->capacity; i++)
-  {
-    if (dict->slot[i].status == SLOT_IN_USE)
-    {
-      unsigned int hash = _CD_hash(dict->slot[i].key, new_capacity); // avoid same hash ON NEW CAPACITY
+  *num_ranges = 0;
 
-      while (new_slot[hash].status == SLOT_IN_USE)
-        hash = (hash + 1) % new_capacity;
+  if (ranges == NULL)
+    return NULL;
 
-      new_slot[hash].status = SLOT_IN_USE;
-      new_slot[hash].key = dict->slot[i].key;
-      new_slot[hash].value = dict->slot[i].value;
-      new_num_stored++;
-    }
-  }
+  for (const struct _file_mapping *m = dict->mappings; m != NULL; m = m->next)
+    ranges[(*num_ranges)++] = (struct _string_range){m->addr, (const char *)m->addr + m->size};
 
-  // Free the old slot array
-  free(dict->slot);
+  for (const struct _arena_chunk *c = dict->arena; c != NULL; c = c->next)
+    ranges[(*num_ranges)++] = (struct _string_range){c->data, c->data + c->used};
 
-  // Update the old slot array to the new slot array
-  dict->slot = new_slot;
-  dict->capacity = new_capacity;
-  dict->num_deleted = 0;
+  qsort(ranges, n, sizeof(*ranges), _CD_range_compare);
+
+  return ranges;
 }
 
-// Documented in .h file
-unsigned int CD_size(CDict dict)
+// Does a key or value lie in one of a set of sorted ranges?
+static bool _CD_in_ranges(const struct _string_range *ranges, size_t num_ranges, const char *str)
 {
-#ifdef DEBUG
-  // iterate across slots, counting number of keys found
-  int used = 0;
-  int deleted = 0;
+  size_t lo = 0, hi = num_ranges;
 
-  for (int i = 0; i < dict->capacity; i++)
-    if (dict->slot[i].status == SLOT_IN_USE)
-      used++;
-    else if (dict->slot[i].status == SLOT_DELETED)
-      deleted++;
+  // Find the last range starting at or before str
+  while (lo < hi)
+  {
+    size_t mid = lo + (hi - lo) / 2;
 
-  assert(used == dict->num_stored);
-  assert(deleted == dict->num_deleted);
-#endif
+    if (ranges[mid].start <= str)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
 
-  return dict->num_stored;
+  return lo > 0 && str < ranges[lo - 1].end;
 }
 
-// Documented in .h file
-unsigned int CD_capacity(CDict dict)
+/*
+ * Give a cloned entry its own copy of each string the original
+ * dictionary would free along with itself: all of them if it is
+ * owned, or else those in its loaded files or its arena
+ *
+ * Parameters:
+ *   clone       The clone, whose arena receives the copies
+ *   owned       Whether the original owns its keys and values
+ *   ranges      The original's string ranges, from _CD_string_ranges
+ *   num_ranges  The number of ranges
+ *   entry       The clone's entry
+ *
+ * Returns: True on success, false if memory allocation failed
+ */
+static bool _CD_clone_strings(CDict clone, bool owned, const struct _string_range *ranges, size_t num_ranges,
+                              struct _hash_slot *entry)
 {
-  if (dict == NULL)
+  if (owned || _CD_in_ranges(ranges, num_ranges, entry->key))
   {
-    printf("Error: cannot get capacity of NULL dictionary\n");
-    return 0;
+    if ((entry->key = _CD_arena_copy(&clone->arena, entry->key, entry->key_len)) == NULL)
+      return false;
+  }
+
+  if (owned || _CD_in_ranges(ranges, num_ranges, entry->value))
+  {
+    if ((entry->value = _CD_arena_copy(&clone->arena, entry->value, strlen(entry->value))) == NULL)
+      return false;
   }
 
-  return dict->capacity;
+  return true;
 }
 
 // Documented in .h file
-bool CD_contains(CDict dict, CDictKeyType key)
+CDict CD_clone(CDict dict)
 {
-  if (dict == NULL || key == NULL)
+  if (dict == NULL)
   {
-    printf("Contains error: dictionary or key is NULL for [%s]\n", key);
-    return false;
+    printf("Error: cannot clone NULL dictionary\n");
+    return NULL;
   }
 
-  unsigned int hash = _CD_hash(key, dict->capacity);
+  CDict clone = dict->allocator.alloc(sizeof(struct _dictionary), dict->allocator.ctx);
 
-  for (unsigned int i = 0; i < dict->capacity; i++)
+  if (clone == NULL)
   {
-    unsigned int index = (hash + i) % dict->capacity;
+    printf("Error: memory allocation failed for clone\n");
+    return NULL;
+  }
 
-    // Can't find the key
-    if (dict->slot[index].status == SLOT_UNUSED)
-      return false;
+  // The seed is kept along with everything else, so the cached hashes
+  // in the copied slots stay valid
+  *clone = *dict;
+  clone->arena = NULL;
+  clone->mappings = NULL;
+  clone->snapshot = NULL;
+#ifdef CDICT_STATS
+  memset(&clone->stats, 0, sizeof(clone->stats));
+#endif
+
+  // Until it is cloned, neither table may refer to the original's
+  // blocks, which freeing the clone on failure would free
+  memset(&clone->table, 0, sizeof(clone->table));
+  memset(&clone->old, 0, sizeof(clone->old));
+
+  bool owned = dict->flags & CD_FLAG_OWNED;
+  size_t num_ranges = 0;
+  struct _string_range *ranges = owned ? NULL : _CD_string_ranges(dict, &num_ranges);
+  bool ok = _CD_table_clone(dict, &clone->table, &dict->table) && _CD_table_clone(dict, &clone->old, &dict->old);
+
+  // Without its ranges, strings the original frees could not be told
+  // apart from the caller's
+  if (!owned && ranges == NULL && (dict->mappings != NULL || dict->arena != NULL))
+    ok = false;
+
+  if (ok && (owned || num_ranges != 0))
+  {
+    struct _hash_table *tables[] = {&clone->table, &clone->old};
+
+    for (unsigned int i = 0; ok && i < clone->num_small; i++)
+      ok = _CD_clone_strings(clone, owned, ranges, num_ranges, &clone->small[i]);
+
+    for (int t = 0; t < 2; t++)
+    {
+      struct _hash_table *table = tables[t];
+      bool compact = _CD_table_is_compact(table);
+      unsigned int n = compact ? table->num_entries : table->capacity;
 
-    // Found the key
-    else if (dict->slot[index].status == SLOT_IN_USE && strcmp(dict->slot[index].key, key) == 0)
-      return true;
+      for (unsigned int i = 0; ok && i < n; i++)
+        if (compact ? table->slot[i].key != NULL : _CD_ctrl_is_full(table->ctrl[i]))
+          ok = _CD_clone_strings(clone, owned, ranges, num_ranges, &table->slot[i]);
+    }
   }
 
-  return false;
+  free(ranges);
+
+  if (!ok)
+  {
+    printf("Error: memory allocation failed for clone\n");
+    CD_free(clone);
+    return NULL;
+  }
+
+  return clone;
 }
 
 // Documented in .h file
-void CD_store(CDict dict, CDictKeyType key, CDictValueType value)
+CDictSnapshot CD_snapshot(CDict dict)
 {
-  if (dict == NULL || key == NULL || value == NULL)
+  if (dict == NULL)
   {
-    printf("Store error: dictionary or key or value is NULL for [%s]\n", key);
-    return;
+    printf("Error: cannot snapshot NULL dictionary\n");
+    return NULL;
+  }
+
+  if (dict->snapshot != NULL)
+  {
+    printf("Error: dictionary already has a snapshot\n");
+    return NULL;
   }
 
-  // Hash the key to get an index
-  unsigned int hash = _CD_hash(key, dict->capacity);
+  // The snapshot shares a single table
+  if (dict->old.capacity != 0)
+    _CD_migrate(dict, dict->old.capacity);
 
-  // Check for collisions and deleted slots
-  while ((dict->slot[hash].status == SLOT_IN_USE && strcmp(dict->slot[hash].key, key) != 0) ||
-         dict->slot[hash].status == SLOT_DELETED)
-    hash = (hash + 1) % dict->capacity; // move to next slot
+  struct _snapshot *snap = calloc(1, sizeof(struct _snapshot));
+  size_t num_chunks = (_CD_table_bytes(&dict->table) + SNAPSHOT_CHUNK_SIZE - 1) / SNAPSHOT_CHUNK_SIZE;
 
-  // Found a slot with the same key, update the value
-  if (dict->slot[hash].status == SLOT_IN_USE && strcmp(dict->slot[hash].key, key) == 0)
+  if (snap == NULL || (snap->chunks = calloc(num_chunks, sizeof(char *))) == NULL)
   {
-    dict->slot[hash].value = value;
-    return;
+    printf("Error: memory allocation failed for snapshot\n");
+    free(snap);
+    return NULL;
   }
 
-  // Found an empty, insert here
-  else if (dict->slot[hash].status == SLOT_UNUSED)
+  snap->dict = dict;
+  snap->table = dict->table;
+  snap->block = (char *)dict->table.slot;
+  snap->size = CD_size(dict);
+  snap->num_small = dict->num_small;
+  memcpy(snap->small, dict->small, sizeof(snap->small));
+  snap->hash = dict->hash;
+  snap->seed = dict->seed;
+  snap->allocator = dict->allocator;
+
+  dict->snapshot = snap;
+
+  if (!_CD_is_small(dict))
+    dict->table.cow = snap;
+
+  return snap;
+}
+
+// Documented in .h file
+void CDSN_free(CDictSnapshot snap)
+{
+  if (snap)
   {
-    dict->slot[hash].status = SLOT_IN_USE;
-    dict->slot[hash].key = key;
-    dict->slot[hash].value = value;
-    dict->num_stored++;
+    if (snap->dict != NULL)
+    {
+      snap->dict->snapshot = NULL;
+
+      if (snap->dict->table.cow == snap)
+        snap->dict->table.cow = NULL;
+    }
 
-    // Check if rehashing is needed after storing new key
-    if (CD_load_factor(dict) > REHASH_THRESHOLD)
-      _CD_rehash(dict);
+    if (snap->owns_block)
+      snap->allocator.free(snap->block, _CD_table_bytes(&snap->table), snap->allocator.ctx);
 
-    return;
+    size_t num_chunks = (_CD_table_bytes(&snap->table) + SNAPSHOT_CHUNK_SIZE - 1) / SNAPSHOT_CHUNK_SIZE;
+
+    for (size_t c = 0; c < num_chunks; c++)
+      free(snap->chunks[c]);
+
+    free(snap->chunks);
+    _CD_arena_free(&snap->arena);
+    _CD_unmap_all(&snap->mappings);
+    free(snap);
   }
 }
 
 // Documented in .h file
-CDictValueType CD_retrieve(CDict dict, CDictKeyType key)
+unsigned int CDSN_size(CDictSnapshot snap)
 {
-  if (dict == NULL || key == NULL)
+  if (snap == NULL)
   {
-    printf("Retrieve error: dictionary or key is NULL for [%s]\n", key);
-    return INVALID_VALUE;
+    printf("Error: cannot get size of NULL snapshot\n");
+    return 0;
   }
 
-  unsigned int hash = _CD_hash(key, dict->capacity);
+  return snap->size;
+}
+
+/*
+ * Read bytes of a snapshotted table's block as they were when the
+ * snapshot was taken: from the saved copy of each chunk that has one,
+ * and otherwise from the block itself. A chunk read from the block is
+ * checked again afterwards, in case the dictionary saved and changed
+ * it meanwhile.
+ *
+ * Parameters:
+ *   snap   The snapshot
+ *   addr   The first byte to read, as an address in the block
+ *   out    Receives the bytes
+ *   len    Number of bytes to read
+ *
+ * Returns: True on success, false if a chunk was changed without
+ *   being saved
+ */
+static bool _CDSN_read(const struct _snapshot *snap, const void *addr, void *out, size_t len)
+{
+  size_t offset = (const char *)addr - snap->block;
+  char *dest = out;
 
-  for (unsigned int i = 0; i < dict->capacity; i++)
+  while (len > 0)
   {
-    unsigned int index = (hash + i) % dict->capacity;
+    size_t c = offset / SNAPSHOT_CHUNK_SIZE;
+    size_t within = offset % SNAPSHOT_CHUNK_SIZE;
+    size_t n = (len < SNAPSHOT_CHUNK_SIZE - within) ? len : SNAPSHOT_CHUNK_SIZE - within;
+    const char *saved = __atomic_load_n(&snap->chunks[c], __ATOMIC_ACQUIRE);
+
+    if (saved == NULL)
+    {
+      memcpy(dest, snap->block + offset, n);
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      saved = __atomic_load_n(&snap->chunks[c], __ATOMIC_ACQUIRE);
+
+      if (saved == NULL && __atomic_load_n(&snap->lost, __ATOMIC_ACQUIRE))
+        return false;
+    }
 
-    if (dict->slot[index].status == SLOT_UNUSED)
-      return INVALID_VALUE;
+    if (saved != NULL)
+      memcpy(dest, saved + within, n);
 
-    else if (dict->slot[index].status == SLOT_IN_USE && strcmp(dict->slot[index].key, key) == 0)
-      return dict->slot[index].value;
+    dest += n;
+    offset += n;
+    len -= n;
   }
 
-  return INVALID_VALUE;
+  return true;
 }
 
-// Documented in .h file
-void CD_delete(CDict dict, CDictKeyType key)
+// Read the entry held in a full slot of a snapshotted table, returning
+// false as _CDSN_read does
+static bool _CDSN_slot(const struct _snapshot *snap, unsigned int index, struct _hash_slot *entry)
 {
-  if (dict == NULL || key == NULL)
+  const struct _hash_table *table = &snap->table;
+  unsigned int number = index;
+
+  if (_CD_table_is_compact(table))
   {
-    printf("Delete error: dictionary or key is NULL for [%s]\n", key);
-    return;
+    uint8_t number8;
+    uint16_t number16;
+    uint32_t number32;
+    const char *addr = (const char *)table->index + (size_t)index * table->index_width;
+
+    switch (table->index_width)
+    {
+    case 1:
+      if (!_CDSN_read(snap, addr, &number8, sizeof(number8)))
+        return false;
+      number = number8;
+      break;
+    case 2:
+      if (!_CDSN_read(snap, addr, &number16, sizeof(number16)))
+        return false;
+      number = number16;
+      break;
+    default:
+      if (!_CDSN_read(snap, addr, &number32, sizeof(number32)))
+        return false;
+      number = number32;
+    }
   }
 
-  unsigned int hash = _CD_hash(key, dict->capacity);
+  return _CDSN_read(snap, &table->slot[number], entry, sizeof(*entry));
+}
+
+/*
+ * Find a key in a snapshot, probing its table as _CD_find does but
+ * reading each group of control bytes and each entry through
+ * _CDSN_read
+ *
+ * Parameters:
+ *   snap   The snapshot
+ *   key    The key
+ *   len    Length of key in bytes
+ *   entry  Receives the key's entry, if found
+ *
+ * Returns: True if the key was found, false if not or if the snapshot
+ *   is incomplete
+ */
+static bool _CDSN_find(const struct _snapshot *snap, const void *key, size_t len, struct _hash_slot *entry)
+{
+  if (__atomic_load_n(&snap->lost, __ATOMIC_ACQUIRE))
+  {
+    printf("Error: snapshot is incomplete\n");
+    return false;
+  }
 
-  for (unsigned int i = 0; i < dict->capacity; i++)
+  if (snap->table.capacity == 0)
   {
-    unsigned int index = (hash + i) % dict->capacity;
+    for (unsigned int i = 0; i < snap->num_small; i++)
+      if (snap->small[i].key_len == len && memcmp(snap->small[i].key, key, len) == 0)
+      {
+        *entry = snap->small[i];
+        return true;
+      }
 
-    // Can't find the key
-    if (dict->slot[index].status == SLOT_UNUSED)
-    {
-      printf("Error: cannot delete key [%s] not found\n", key);
-      return;
-    }
+    return false;
+  }
 
-    // Found the key
-    else if (dict->slot[index].status == SLOT_IN_USE && strcmp(dict->slot[index].key, key) == 0)
+  uint64_t hash = (snap->hash != NULL) ? snap->hash(key, len) : _CD_siphash(key, len, &snap->seed);
+  struct _probe_seq seq = _CD_probe_start(&snap->table, hash);
+  int8_t h2 = _CD_h2(hash);
+  int8_t group[GROUP_WIDTH];
+
+  for (unsigned int probed = 0; probed < snap->table.capacity; probed += GROUP_WIDTH)
+  {
+    if (!_CDSN_read(snap, snap->table.ctrl + seq.pos, group, GROUP_WIDTH))
+      goto incomplete;
+
+    for (uint32_t match = _CD_group_match(group, h2); match; match &= match - 1)
     {
-      dict->slot[index].status = SLOT_DELETED;
-      dict->num_stored--;
-      dict->num_deleted++;
-      dict->slot[index].key = NULL;
-      dict->slot[index].value = NULL;
-      return;
+      if (!_CDSN_slot(snap, (seq.pos + __builtin_ctz(match)) & seq.mask, entry))
+        goto incomplete;
+
+      if (entry->hash == hash && entry->key_len == len && memcmp(entry->key, key, len) == 0)
+        return true;
     }
+
+    if (_CD_group_match(group, CTRL_EMPTY))
+      return false;
+
+    _CD_probe_next(&seq);
   }
+
+  return false;
+
+incomplete:
+  printf("Error: snapshot is incomplete\n");
+  return false;
 }
+
 // Documented in .h file
-double CD_load_factor(CDict dict)
+bool CDSN_contains(CDictSnapshot snap, CDictKeyType key)
 {
-  if (dict == NULL || dict->capacity <= 0)
+  if (snap == NULL || key == NULL)
   {
-    printf("Error: dictionary is NULL or has zero capacity\n");
-    return 0;
+    printf("Contains error: snapshot or key is NULL for [%s]\n", key);
+    return false;
   }
 
-  return (double)(dict->num_stored + dict->num_deleted) / dict->capacity;
+  return CDSN_contains_n(snap, key, strlen(key));
 }
 
 // Documented in .h file
-void CD_print(CDict dict)
+bool CDSN_contains_n(CDictSnapshot snap, const void *key, size_t len)
 {
-  if (dict == NULL)
+  if (snap == NULL || key == NULL)
   {
-    printf("Error: cannot print NULL dictionary\n");
-    return;
+    printf("Contains error: snapshot or key is NULL\n");
+    return false;
   }
 
-  printf("\n\n");
-  printf("*** capacity: %u stored: %u deleted: %u load_factor: %.2f\n",
-         dict->capacity, dict->num_stored, dict->num_deleted, CD_load_factor(dict));
+  struct _hash_slot entry;
 
-  for (unsigned int i = 0; i < dict->capacity; i++)
-  {
-    printf("%02u: ", i);
+  return _CDSN_find(snap, key, len, &entry);
+}
 
-    if (dict->slot[i].status == SLOT_UNUSED)
-      printf("unused\n");
+// Documented in .h file
+CDictValueType CDSN_retrieve(CDictSnapshot snap, CDictKeyType key)
+{
+  if (snap == NULL || key == NULL)
+  {
+    printf("Retrieve error: snapshot or key is NULL for [%s]\n", key);
+    return INVALID_VALUE;
+  }
 
-    else if (dict->slot[i].status == SLOT_DELETED)
-      printf("DELETED\n");
+  return CDSN_retrieve_n(snap, key, strlen(key));
+}
 
-    else if (dict->slot[i].status == SLOT_IN_USE)
-      printf("IN_USE key=%s hash=%u value=%s\n", dict->slot[i].key, _CD_hash(dict->slot[i].key, dict->capacity), dict->slot[i].value);
+// Documented in .h file
+CDictValueType CDSN_retrieve_n(CDictSnapshot snap, const void *key, size_t len)
+{
+  if (snap == NULL || key == NULL)
+  {
+    printf("Retrieve error: snapshot or key is NULL\n");
+    return INVALID_VALUE;
   }
+
+  struct _hash_slot entry;
+
+  return _CDSN_find(snap, key, len, &entry) ? entry.value : INVALID_VALUE;
 }
 
-void CD_foreach(CDict dict, CD_foreach_callback callback, void *cb_data)
+// Documented in .h file
+void CDSN_foreach(CDictSnapshot snap, CD_foreach_callback callback, void *cb_data)
 {
-  if (dict == NULL || callback == NULL)
+  if (snap == NULL || callback == NULL)
+  {
+    printf("Error: cannot iterate over NULL snapshot or with NULL callback\n");
+    return;
+  }
+
+  const struct _hash_table *table = &snap->table;
+  struct _hash_slot entry;
+
+  for (unsigned int i = 0; i < snap->num_small; i++)
+    callback(snap->small[i].key, snap->small[i].value, cb_data);
+
+  if (_CD_table_is_compact(table))
+  {
+    for (unsigned int i = 0; i < table->num_entries; i++)
+    {
+      if (!_CDSN_read(snap, &table->slot[i], &entry, sizeof(entry)))
+        goto incomplete;
+
+      if (entry.key != NULL)
+        callback(entry.key, entry.value, cb_data);
+    }
+
     return;
+  }
+
+  // The control bytes are read a group at a time; the mirrored bytes
+  // after the end keep the last read in bounds
+  for (unsigned int i = 0; i < table->capacity; i += GROUP_WIDTH)
+  {
+    int8_t group[GROUP_WIDTH];
+
+    if (!_CDSN_read(snap, table->ctrl + i, group, GROUP_WIDTH))
+      goto incomplete;
+
+    for (uint32_t full = _CD_group_full(group); full; full &= full - 1)
+    {
+      unsigned int index = i + __builtin_ctz(full);
+
+      if (index >= table->capacity)
+        break;
+
+      if (!_CDSN_read(snap, &table->slot[index], &entry, sizeof(entry)))
+        goto incomplete;
+
+      callback(entry.key, entry.value, cb_data);
+    }
+  }
 
-  for (unsigned int i = 0; i < dict->capacity; i++)
-    if (dict->slot[i].status == SLOT_IN_USE)
-      callback(dict->slot[i].key, dict->slot[i].value, cb_data);
-}
\ No newline at end of file
+  return;
+
+incomplete:
+  printf("Error: snapshot is incomplete\n");
+}
@@ -11,6 +11,8 @@
 
 #include <stdbool.h>
 #include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
 
 typedef struct _dictionary *CDict;
 
@@ -19,11 +21,115 @@ typedef const char *CDictValueType;
 
 #define INVALID_VALUE NULL
 
+/*
+ * A key hash function. It must return the same value for keys with
+ * the same bytes, and should spread different keys over all 64 bits:
+ * the dictionary masks off the low bits to pick a slot.
+ */
+typedef uint64_t (*CD_hash_function)(const void *key, size_t len);
+
+/*
+ * A memory allocator for a dictionary's own structure and its slot
+ * arrays. alloc returns size bytes suitably aligned for any type, or
+ * NULL on failure; free is given the same size that was allocated.
+ * Both are passed ctx. Keys and values copied by an owned dictionary
+ * are not allocated with it.
+ */
+typedef struct
+{
+  void *(*alloc)(size_t size, void *ctx);
+  void (*free)(void *ptr, size_t size, void *ctx);
+  void *ctx;
+} CDictAllocator;
+
+/*
+ * The order in which a lookup visits groups of 16 slots after the
+ * first. Triangular probing steps 1, 2, 3, ... groups further each
+ * time; linear probing moves to the next group, which is kindest to
+ * the cache but lets runs of full groups merge as the table fills;
+ * double hashing steps a fixed, hash-dependent number of groups, so
+ * keys that start in the same group go separate ways.
+ */
+typedef enum
+{
+  CD_PROBE_TRIANGULAR = 0,
+  CD_PROBE_LINEAR,
+  CD_PROBE_DOUBLE_HASH
+} CDictProbe;
+
+// Flags for CDictOptions
+#define CD_NEW_INCREMENTAL 0x1   // as CD_new_incremental
+#define CD_NEW_OWNED 0x2         // as CD_new_owned
+#define CD_NEW_DETERMINISTIC 0x4 // seed the built-in hash with seed, not at random
+#define CD_NEW_COMPACT 0x8       // as CD_new_compact; not with CD_NEW_INCREMENTAL
+
+// Bounds on CDictOptions.max_load_factor
+#define CD_MIN_LOAD_FACTOR 0.5
+#define CD_MAX_LOAD_FACTOR 0.95
+
+/*
+ * Options for CD_new_with_options. A zero-initialized CDictOptions
+ * asks for the same dictionary as CD_new.
+ */
+typedef struct
+{
+  unsigned int capacity;       // entries to make room for, as CD_new_with_capacity
+  double max_load_factor;      // grow past this; 0 for the default of 0.6
+  CDictProbe probe;            // probe sequence
+  CD_hash_function hash;       // NULL for the built-in hash
+  unsigned int flags;          // any of the CD_NEW_ flags
+  const CDictAllocator *allocator; // NULL for malloc and free
+  uint64_t seed;               // only used with CD_NEW_DETERMINISTIC
+} CDictOptions;
+
+// Probe lengths in CDictStats are counted in groups of 16 slots, and
+// lookups probing more groups than this all share the last bucket
+#define CD_STATS_PROBE_BUCKETS 8
+
+/*
+ * Statistics reported by CD_stats. The lookup and rehash counters are
+ * only collected when the library is compiled with CDICT_STATS
+ * defined; otherwise they cost nothing and read as zero.
+ */
+typedef struct
+{
+  unsigned int size;
+  unsigned int capacity;
+  unsigned int num_deleted;     // tombstones
+  double tombstone_ratio;       // tombstones per slot
+
+  bool counting;                // whether the counters below are collected
+  uint64_t hit_probes[CD_STATS_PROBE_BUCKETS];  // successful lookups by groups probed
+  uint64_t miss_probes[CD_STATS_PROBE_BUCKETS]; // failed lookups by groups probed
+  unsigned int max_hit_probes;
+  unsigned int max_miss_probes;
+  uint64_t num_rehashes;        // calls to _CD_rehash
+  double rehash_seconds;        // total time spent in them
+
+  size_t slot_bytes;            // slot and control arrays
+  size_t owned_bytes;           // storage for owned keys and values
+  size_t mapped_bytes;          // files loaded with CD_load_tsv
+} CDictStats;
+
+// Flags for CD_load_tsv
+#define CD_LOAD_KEEP_FIRST 0x1 // a repeated key keeps its first value, not its last
+#define CD_LOAD_STRICT 0x2     // fail on a non-empty line with no tab, rather than skip it
+
 
 /*
  * Returns a newly-allocated and newly-initialized dictionary. Upon
- * return, the dictionary will have the default capacity and no
- * elements.
+ * return, the dictionary will have no elements. A new dictionary is
+ * small: it keeps its first few entries inside itself and compares
+ * keys directly, allocating and hashing into a table only once it
+ * outgrows them.
+ *
+ * Every dictionary hashes its keys with a keyed hash (SipHash-1-3)
+ * under a seed of its own, drawn at random, so which keys collide
+ * cannot be predicted from outside the process, and keys chosen to
+ * collide in one dictionary do not collide in another. As a result
+ * CD_foreach visits the same keys in a different order in different
+ * dictionaries and different runs; CD_NEW_DETERMINISTIC (see
+ * CD_new_with_options) fixes the seed where that matters, as in tests.
  *
  * Parameters: None
  * 
@@ -32,6 +138,112 @@ typedef const char *CDictValueType;
 CDict CD_new();
 
 
+/*
+ * Returns a newly-allocated and newly-initialized dictionary that
+ * hashes keys with the supplied function instead of the built-in
+ * hash. The function is not seeded, so it is up to the caller to
+ * make sure that its keys cannot be chosen to collide.
+ *
+ * Parameters:
+ *   hash     The hash function, or NULL for the built-in hash
+ * 
+ * Returns: The new CDict
+ */
+CDict CD_new_with_hash(CD_hash_function hash);
+
+
+/*
+ * Returns a newly-allocated and newly-initialized dictionary that
+ * allocates its structure and slot arrays with the supplied allocator
+ * instead of malloc, such as the pool in cdict_pool.h. The allocator
+ * is copied, but its ctx must stay valid until the dict is freed.
+ *
+ * Parameters:
+ *   allocator  The allocator, or NULL for malloc and free
+ * 
+ * Returns: The new CDict, or NULL on failure
+ */
+CDict CD_new_with_allocator(const CDictAllocator *allocator);
+
+
+/*
+ * Returns a newly-allocated and newly-initialized dictionary that
+ * grows incrementally. When it needs to grow, the old and new slot
+ * arrays are both kept, and each later store or delete moves a few
+ * entries from the old one to the new one; lookups search both until
+ * the move is complete. No single store pays for rehashing the whole
+ * table.
+ *
+ * Parameters: None
+ * 
+ * Returns: The new CDict
+ */
+CDict CD_new_incremental();
+
+
+/*
+ * Returns a newly-allocated and newly-initialized dictionary that
+ * owns its keys and values. CD_store copies them into storage
+ * allocated by the dictionary in large chunks, so the caller's strings
+ * need not outlive the call, and CD_free releases all of them at once.
+ * Space used by deleted or overwritten entries is only reclaimed by
+ * CD_free.
+ *
+ * Parameters: None
+ * 
+ * Returns: The new CDict
+ */
+CDict CD_new_owned();
+
+
+/*
+ * Returns a newly-allocated and newly-initialized dictionary that
+ * keeps its entries in a dense array, in the order their keys were
+ * first stored, while each slot of the hash table holds only the
+ * number of its entry, in 1, 2 or 4 bytes as the capacity requires.
+ * Since the array needs no room for empty slots, this takes roughly a
+ * third less memory at the default load factor, at the cost of an
+ * extra memory access per lookup. CD_foreach and the iterators visit
+ * entries in insertion order, scanning only the array. A deleted
+ * entry leaves a hole in the array until the table is next rebuilt.
+ *
+ * Parameters: None
+ * 
+ * Returns: The new CDict
+ */
+CDict CD_new_compact();
+
+
+/*
+ * Returns a newly-allocated and newly-initialized dictionary with
+ * enough capacity to hold num_entries elements without rehashing.
+ * Deletes do not shrink it below this capacity.
+ *
+ * Parameters:
+ *   num_entries   The number of elements to make room for
+ * 
+ * Returns: The new CDict, or NULL if num_entries is too large
+ */
+CDict CD_new_with_capacity(unsigned int num_entries);
+
+
+/*
+ * Returns a newly-allocated and newly-initialized dictionary built to
+ * the supplied options, which combine those of the constructors above
+ * and add a few more. A higher max_load_factor saves memory at the cost
+ * of longer probes, most of all for keys not in the dictionary; a lower
+ * one does the reverse. The probe sequence matters most near the
+ * maximum load.
+ *
+ * Parameters:
+ *   options  The options, or NULL for the defaults
+ *
+ * Returns: The new CDict, or NULL if an option is out of range or
+ *   memory allocation failed
+ */
+CDict CD_new_with_options(const CDictOptions *options);
+
+
 /*
  * Destroy all memory consumed by this dict
  *
@@ -43,6 +255,23 @@ CDict CD_new();
 void CD_free(CDict dict);
 
 
+/*
+ * Make a copy of a dictionary, with the same options, seed and
+ * entries. The copy's slots are copied a whole table at a time, with
+ * no key hashed or placed again. The keys and values of an owned
+ * dictionary, and those loaded with CD_load_tsv or copied by an
+ * earlier CD_clone, are copied into storage belonging to the copy, so
+ * either dictionary may be changed or freed first; any other keys and
+ * values are shared with the caller, just as in the original.
+ *
+ * Parameters:
+ *   dict     The dictionary
+ *
+ * Returns: The new CDict, or NULL if memory allocation failed
+ */
+CDict CD_clone(CDict dict);
+
+
 /*
  * Returns the number of elements in the dictionary; note this is
  * different from its capacity
@@ -68,6 +297,35 @@ unsigned int CD_size(CDict dict);
 unsigned int CD_capacity(CDict dict);
 
 
+/*
+ * Grow the dictionary, if necessary, so that it can hold num_entries
+ * elements in total without rehashing. Use before a bulk load of a
+ * known number of elements. Never shrinks the dictionary, and deletes
+ * do not shrink it below the reserved capacity either.
+ *
+ * Parameters:
+ *   dict          The dictionary
+ *   num_entries   The number of elements to make room for
+ * 
+ * Returns: None
+ */
+void CD_reserve(CDict dict, unsigned int num_entries);
+
+
+/*
+ * Shrink the dictionary to the smallest capacity that holds its
+ * current elements, clearing out all deleted slots, and forget any
+ * capacity reserved with CD_new_with_capacity or CD_reserve. Use once
+ * a dictionary is done changing, to return memory.
+ *
+ * Parameters:
+ *   dict          The dictionary
+ * 
+ * Returns: None
+ */
+void CD_shrink_to_fit(CDict dict);
+
+
 /*
  * Is key found in dictionary?
  *
@@ -80,9 +338,26 @@ unsigned int CD_capacity(CDict dict);
 bool CD_contains(CDict dict, CDictKeyType key);
 
 
+/*
+ * Is a key of known length found in dictionary? Like CD_contains, but
+ * the key is given as bytes and a length, so it need not be
+ * NUL-terminated and may contain NULs.
+ *
+ * Parameters:
+ *   dict     The dictionary
+ *   key      The key bytes
+ *   len      Length of key in bytes
+ * 
+ * Returns: True if key is in dict, false otherwise
+ */
+bool CD_contains_n(CDict dict, const void *key, size_t len);
+
+
 /*
  * Store the supplied key, value pair in the dictionary. If key is
- * already present, its value is overwritten.
+ * already present, its value is overwritten. Unless the dictionary
+ * was created by CD_new_owned, the key and value are not copied and
+ * must remain valid for as long as they are in the dictionary.
  *
  * Parameters:
  *   dict     The dictionary
@@ -94,6 +369,22 @@ bool CD_contains(CDict dict, CDictKeyType key);
 void CD_store(CDict dict, CDictKeyType key, CDictValueType value);
 
 
+/*
+ * Store a key of known length and its value in the dictionary, like
+ * CD_store. Keys stored this way are compared by length and bytes, so
+ * they may contain NULs; the value must still be a string.
+ *
+ * Parameters:
+ *   dict     The dictionary
+ *   key      The key bytes
+ *   len      Length of key in bytes
+ *   value    The value
+ * 
+ * Returns: None
+ */
+void CD_store_n(CDict dict, const void *key, size_t len, CDictValueType value);
+
+
 /*
  * Find the value for a given key
  *
@@ -107,7 +398,55 @@ CDictValueType CD_retrieve(CDict dict, CDictKeyType key);
 
 
 /*
- * Delete a key from the dictionary
+ * Find the value for a key of known length, like CD_retrieve
+ *
+ * Parameters:
+ *   dict     The dictionary
+ *   key      The key bytes
+ *   len      Length of key in bytes
+ * 
+ * Returns: The value, or INVALID_VALUE if key not found in dict
+ */
+CDictValueType CD_retrieve_n(CDict dict, const void *key, size_t len);
+
+
+/*
+ * Find the values for a batch of keys. Equivalent to calling
+ * CD_retrieve for each key, but the keys' memory accesses are
+ * interleaved so that their cache misses overlap, which is much faster
+ * on dictionaries larger than the CPU caches.
+ *
+ * Parameters:
+ *   dict     The dictionary
+ *   keys     The keys; a NULL key is never found
+ *   n        Number of keys
+ *   values   Receives n values, INVALID_VALUE for each key not found
+ * 
+ * Returns: The number of keys found
+ */
+unsigned int CD_retrieve_many(CDict dict, const CDictKeyType *keys, unsigned int n, CDictValueType *values);
+
+
+/*
+ * Check a batch of keys for membership, in the same way as
+ * CD_retrieve_many
+ *
+ * Parameters:
+ *   dict       The dictionary
+ *   keys       The keys; a NULL key is never found
+ *   n          Number of keys
+ *   contained  Receives n results, true for each key in dict
+ * 
+ * Returns: The number of keys found
+ */
+unsigned int CD_contains_many(CDict dict, const CDictKeyType *keys, unsigned int n, bool *contained);
+
+
+/*
+ * Delete a key from the dictionary. Once fewer than a quarter of the
+ * entries the table could hold remain, the table is shrunk to about
+ * twice their number, though never below the capacity reserved with
+ * CD_new_with_capacity or CD_reserve.
  *
  * Parameters:
  *   dict     The dictionary
@@ -118,6 +457,41 @@ CDictValueType CD_retrieve(CDict dict, CDictKeyType key);
 void CD_delete(CDict dict, CDictKeyType key);
 
 
+/*
+ * Delete a key of known length from the dictionary, like CD_delete
+ *
+ * Parameters:
+ *   dict     The dictionary
+ *   key      The key bytes
+ *   len      Length of key in bytes
+ * 
+ * Returns: None
+ */
+void CD_delete_n(CDict dict, const void *key, size_t len);
+
+
+/*
+ * Store every entry of a text file with one key<TAB>value pair per
+ * line. The value runs to the end of the line, so it may itself
+ * contain tabs; a carriage return before the newline is dropped. The
+ * dictionary is grown once to fit the number of lines, and the file
+ * is mapped into memory rather than read, so no memory is allocated
+ * per line: an owned dictionary copies entries into its arena, while
+ * any other dictionary keeps them in the mapping, which it then holds
+ * until it is freed.
+ *
+ * Parameters:
+ *   dict     The dictionary
+ *   path     The file
+ *   flags    Any of the CD_LOAD_ flags
+ *
+ * Returns: The number of lines stored, or -1 if the file could not be
+ *   read or, with CD_LOAD_STRICT, has a malformed line. Lines before a
+ *   malformed one are stored even so.
+ */
+int CD_load_tsv(CDict dict, const char *path, unsigned int flags);
+
+
 /*
  * Return the load factor for the dictionary
  *
@@ -130,6 +504,22 @@ void CD_delete(CDict dict, CDictKeyType key);
 double CD_load_factor(CDict dict);
 
 
+/*
+ * Report statistics about the dictionary: its occupancy and memory
+ * use and, if compiled with CDICT_STATS, how long lookups have had to
+ * probe and how much time rehashing has taken. Unlike CD_print, this
+ * does not walk the slots, so it is cheap enough to call on a large
+ * dictionary in production.
+ *
+ * Parameters:
+ *   dict     The dictionary
+ *   stats    Filled in with the statistics
+ *
+ * Returns: None
+ */
+void CD_stats(CDict dict, CDictStats *stats);
+
+
 /*
  * For debugging: Walk the dictionary and print all entries, including
  * the unused and deleted slots. 
@@ -152,7 +542,10 @@ typedef void (*CD_foreach_callback)(CDictKeyType key, CDictValueType value, void
  *   callback( <key>, <value>, <cb_data> )
  *
  * There is no guarantee as to the order in which the callback is
- * called.
+ * called, except in a compact dictionary (see CD_new_compact), which
+ * visits elements in the order their keys were first stored. Keys
+ * stored with CD_store_n are passed exactly as stored, so they are
+ * only NUL-terminated if the dictionary owns its keys.
  *
  * Parameters:
  *   dict       The dictionary
@@ -164,4 +557,184 @@ typedef void (*CD_foreach_callback)(CDictKeyType key, CDictValueType value, void
 void CD_foreach(CDict dict, CD_foreach_callback callback, void *cb_data);
 
 
+/*
+ * Call the user-specified callback function for each element, as with
+ * CD_foreach, but split the slots between several threads. The
+ * callback is called from all of them at once, so it must be safe to
+ * call concurrently, and the dictionary must not be modified until
+ * CD_foreach_parallel returns. Small dictionaries are scanned with
+ * fewer threads than requested.
+ *
+ * Parameters:
+ *   dict         The dictionary
+ *   num_threads  The number of threads, including the caller's; 0 for
+ *                one per online processor
+ *   callback     The function to call
+ *   cb_data      Caller data to pass to the function
+ *
+ * Returns: None
+ */
+void CD_foreach_parallel(CDict dict, unsigned int num_threads, CD_foreach_callback callback, void *cb_data);
+
+
+/*
+ * Cursor over the elements of a dictionary, for callers that want to
+ * pull elements one at a time, stop early, or interleave the scan with
+ * other work. After each successful CD_iter_next, key, key_len and
+ * value describe the current element. The remaining fields are private
+ * to the dictionary. Elements are visited in the same order as by
+ * CD_foreach, and the dictionary must not be stored to or deleted from
+ * while an iterator over it is in use.
+ */
+typedef struct
+{
+  CDictKeyType key;
+  size_t key_len;
+  CDictValueType value;
+
+  CDict _dict;
+  unsigned int _pos; // next slot, counting the old table's after the new
+  unsigned int _end; // slot at which to stop
+} CDictIterator;
+
+
+/*
+ * Start an iterator over every element of the dictionary
+ *
+ * Parameters:
+ *   dict     The dictionary
+ *   iter     The iterator to initialize
+ *
+ * Returns: None
+ */
+void CD_iter_begin(CDict dict, CDictIterator *iter);
+
+
+/*
+ * Start an iterator over one of several disjoint parts of the
+ * dictionary's slots. Iterating over parts 0 to num_parts - 1 visits
+ * every element exactly once, so the parts can be handed to separate
+ * threads.
+ *
+ * Parameters:
+ *   dict       The dictionary
+ *   part       Which part, from 0 to num_parts - 1
+ *   num_parts  The number of parts the slots are split into
+ *   iter       The iterator to initialize
+ *
+ * Returns: None
+ */
+void CD_iter_range(CDict dict, unsigned int part, unsigned int num_parts, CDictIterator *iter);
+
+
+/*
+ * Advance an iterator to the next element
+ *
+ * Parameters:
+ *   iter     The iterator
+ *
+ * Returns: True if the iterator now holds an element, false once every
+ *   element has been visited
+ */
+bool CD_iter_next(CDictIterator *iter);
+
+
+typedef struct _snapshot *CDictSnapshot;
+
+/*
+ * Take a read-only snapshot of a dictionary, which keeps returning the
+ * entries the dictionary had at this moment however it changes later.
+ * Nothing is copied up front: the snapshot shares the dictionary's
+ * table, and a store or delete first saves a copy of the 4 KiB chunk
+ * of the table it is about to change, if the snapshot does not already
+ * have one, so writers pay only for the chunks they touch. A
+ * dictionary that grows, shrinks or is freed hands its table to the
+ * snapshot rather than copying it, and a snapshot may outlive its
+ * dictionary. An incremental rehash in progress is completed first.
+ *
+ * A dictionary can have one snapshot at a time. Any number of threads
+ * may read the snapshot while another thread stores to, deletes from
+ * or frees the dictionary, with no lock between them; the dictionary
+ * itself still takes one writer at a time. CD_snapshot and CDSN_free
+ * may not run at the same time as a change to the dictionary. If
+ * memory runs out while a chunk is being saved, reads of the snapshot
+ * report an error rather than returning the changed entries. The
+ * values of a dictionary that does not own them remain the caller's,
+ * and must not be freed while the snapshot may return them.
+ *
+ * Parameters:
+ *   dict     The dictionary
+ *
+ * Returns: The new CDictSnapshot, or NULL if the dictionary already
+ *   has one or memory allocation failed
+ */
+CDictSnapshot CD_snapshot(CDict dict);
+
+
+/*
+ * Destroy a snapshot, after which the dictionary no longer saves
+ * chunks for it and may be snapshotted again. No other thread may be
+ * reading the snapshot or changing the dictionary meanwhile.
+ *
+ * Parameters:
+ *   snap     The snapshot
+ *
+ * Returns: None
+ */
+void CDSN_free(CDictSnapshot snap);
+
+
+/*
+ * Returns the number of elements in the snapshot
+ *
+ * Parameters:
+ *   snap     The snapshot
+ *
+ * Returns: the dictionary's size when the snapshot was taken
+ */
+unsigned int CDSN_size(CDictSnapshot snap);
+
+
+/*
+ * Was key in the dictionary when the snapshot was taken?
+ *
+ * Parameters:
+ *   snap     The snapshot
+ *   key      The key
+ *
+ * Returns: True if key is in the snapshot, false otherwise or if a
+ *   chunk could not be saved for it
+ */
+bool CDSN_contains(CDictSnapshot snap, CDictKeyType key);
+bool CDSN_contains_n(CDictSnapshot snap, const void *key, size_t len);
+
+
+/*
+ * Find the value a key had when the snapshot was taken
+ *
+ * Parameters:
+ *   snap     The snapshot
+ *   key      The key
+ *
+ * Returns: The value, or INVALID_VALUE if key is not in the snapshot
+ *   or a chunk could not be saved for it
+ */
+CDictValueType CDSN_retrieve(CDictSnapshot snap, CDictKeyType key);
+CDictValueType CDSN_retrieve_n(CDictSnapshot snap, const void *key, size_t len);
+
+
+/*
+ * Iterate through the snapshot, calling the user-specified callback
+ * function for each element, as with CD_foreach
+ *
+ * Parameters:
+ *   snap       The snapshot
+ *   callback   The function to call
+ *   cb_data    Caller data to pass to the function
+ *
+ * Returns: None
+ */
+void CDSN_foreach(CDictSnapshot snap, CD_foreach_callback callback, void *cb_data);
+
+
 #endif /* _CDICT_H_ */
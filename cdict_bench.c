@@ -0,0 +1,874 @@
+/*
+ * cdict_bench.c
+ *
+ * Benchmarks for the CDict library, built with optimization by make
+ * cdict_bench. Each workload is run over tables from a size that fits
+ * in L1/L2 cache up to one well past the last-level cache, with keys
+ * of several lengths, and reported as one CSV row:
+ *
+ *   workload,distribution,key_len,size,ops,seconds,ns_per_op,ops_per_sec,peak_rss_kb
+ *
+ * Workloads:
+ *   insert      store size new keys into an empty dictionary
+ *   hit         look up keys that are present
+ *   miss        look up keys that are absent
+ *   mixed       look up present keys, overwriting one in MIXED_WRITE_EVERY
+ *   churn       delete the oldest key and store a new one, repeatedly
+ *   *_u64       the same with uint64_t keys and values, in a CDictU64
+ *               (see cdict_gen.h), or in a CDict after formatting them
+ *               as decimal strings (*_u64_string)
+ *   *_compact   insert, hit and miss in a compact dictionary (see
+ *               CD_new_compact)
+ *   foreach*    visit every entry, in a plain and a compact dictionary
+ *   clone       copy the whole dictionary with CD_clone; ns_per_op is
+ *               per entry copied
+ *   snapshot    take a snapshot with CD_snapshot
+ *   overwrite*  overwrite the values of present keys, with no snapshot
+ *               and with one taken just before (*_snapshot)
+ *   *_<probe>_<load>
+ *               insert, hit and miss with each probe sequence and
+ *               maximum load factor (see CD_new_with_options), in a
+ *               table filled to that load factor
+ *   create_*    create a dictionary, fill it and free it, with malloc
+ *               or with a pool (see cdict_pool.h)
+ *   load_tsv_*  bulk load a tab-separated file (see CD_load_tsv)
+ *
+ * Lookup keys are drawn uniformly or from a Zipfian distribution, in
+ * which a few keys get most of the lookups. Each group of workloads
+ * run on the same tables (one call of a bench_ function) runs in a
+ * child process of its own, forked from a parent that holds no
+ * tables, so peak_rss_kb is the peak resident size of that group
+ * alone rather than of everything run before it.
+ *
+ * Usage: cdict_bench [max_entries]
+ *
+ * Author: Niyomwungeri Parmenide Ishimwe <parmenin@andrew.cmu.edu>
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "cdict.h"
+#include "cdict_pool.h"
+#include "cdict_gen.h"
+
+#define DEFAULT_MAX_ENTRIES (1 << 22)
+#define MIN_ENTRIES (1 << 10)
+#define SIZE_STEP 16      // each table size is this many times the last
+#define MIN_OPS (1 << 21) // operations per timed run, at least
+#define ZIPF_THETA 0.99
+#define MIXED_WRITE_EVERY 10
+#define CREATE_ENTRIES 100   // entries in each dictionary created
+#define CREATE_DICTS 100000  // dictionaries created per run
+#define TSV_MAX_ENTRIES 1000000
+#define LINE_MAX_LEN 256
+#define BENCH_REPEATS 3
+#define PROBE_SLOTS (1 << 20) // table size for comparing probe sequences, at most
+#define PROBE_KEY_LEN 24
+#define COMPACT_KEY_LEN 24
+#define SNAPSHOT_KEY_LEN 24
+
+static const int key_lengths[] = {8, 24, 64};
+static const double max_loads[] = {0.5, 0.6, 0.75, 0.85, 0.95};
+static const CDictProbe probes[] = {CD_PROBE_TRIANGULAR, CD_PROBE_LINEAR, CD_PROBE_DOUBLE_HASH};
+static const char *probe_names[] = {"triangular", "linear", "double_hash"};
+
+// Results of lookups are accumulated here so they cannot be optimized away
+volatile unsigned long sink;
+
+typedef struct
+{
+  char *bytes;
+  int key_len;
+} key_set_t;
+
+/*
+ * Returns the current time in seconds
+ */
+double now_seconds()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Returns the peak resident set size of the process so far, in KiB.
+ * Since every workload runs in a fresh child (see ISOLATED), this is
+ * the peak of the current workload.
+ */
+long peak_rss_kb()
+{
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss;
+}
+
+/*
+ * Print one CSV row of results
+ *
+ * Parameters:
+ *   workload      Name of the workload
+ *   distribution  How keys were chosen, or "-"
+ *   key_len       Length of the keys, or 0 if they vary
+ *   size          Number of entries in the dictionary
+ *   ops           Number of operations timed
+ *   seconds       Time they took
+ *
+ * Returns: None
+ */
+void report(const char *workload, const char *distribution, int key_len, unsigned int size, unsigned long ops,
+            double seconds)
+{
+  printf("%s,%s,%d,%u,%lu,%.6f,%.2f,%.0f,%ld\n", workload, distribution, key_len, size, ops, seconds,
+         seconds * 1e9 / ops, ops / seconds, peak_rss_kb());
+  fflush(stdout);
+}
+
+// Bijective mixing functions, so distinct indexes give distinct keys
+static uint64_t mix64(uint64_t x)
+{
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ull;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebull;
+  return x ^ (x >> 31);
+}
+
+static uint32_t mix32(uint32_t x)
+{
+  x ^= x >> 16;
+  x *= 0x7feb352du;
+  x ^= x >> 15;
+  x *= 0x846ca68bu;
+  return x ^ (x >> 16);
+}
+
+/*
+ * Generate count distinct keys of key_len characters. The first 8 or
+ * 16 characters encode the key's index, so keys do not share prefixes;
+ * longer keys are padded with further pseudorandom characters.
+ *
+ * Parameters:
+ *   keys     The key set to fill in
+ *   count    Number of keys
+ *   key_len  Length of each key, at least 8
+ *
+ * Returns: True on success, false if memory allocation failed
+ */
+bool make_keys(key_set_t *keys, unsigned int count, int key_len)
+{
+  static const char digits[] = "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ";
+
+  keys->key_len = key_len;
+  keys->bytes = malloc((size_t)count * (key_len + 1));
+
+  if (keys->bytes == NULL)
+    return false;
+
+  for (unsigned int i = 0; i < count; i++)
+  {
+    char *key = keys->bytes + (size_t)i * (key_len + 1);
+    int unique = (key_len >= 16) ? 16 : 8;
+    uint64_t bits = (key_len >= 16) ? mix64(i) : mix32(i);
+
+    for (int c = 0; c < unique; c++)
+      key[c] = digits[(bits >> (4 * c)) & 0xf];
+
+    for (int c = unique; c < key_len; c++)
+    {
+      if ((c - unique) % 10 == 0)
+        bits = mix64(bits + c);
+
+      key[c] = digits[(bits >> (6 * ((c - unique) % 10))) % 62];
+    }
+
+    key[key_len] = '\0';
+  }
+
+  return true;
+}
+
+static inline const char *key_at(const key_set_t *keys, unsigned int i)
+{
+  return keys->bytes + (size_t)i * (keys->key_len + 1);
+}
+
+// xorshift64* generator
+static inline uint64_t next_random(uint64_t *state)
+{
+  *state ^= *state >> 12;
+  *state ^= *state << 25;
+  *state ^= *state >> 27;
+  return *state * 0x2545f4914f6cdd1dull;
+}
+
+/*
+ * Generate indexes into a table of n keys, either uniformly or with a
+ * Zipfian distribution using the method of Gray et al. ("Quickly
+ * generating billion-record synthetic databases"). Popular ranks are
+ * scattered over the table rather than being its first keys.
+ *
+ * Parameters:
+ *   count    Number of indexes
+ *   n        Number of keys
+ *   zipf     Whether to use the Zipfian distribution
+ *
+ * Returns: The indexes, or NULL if memory allocation failed
+ */
+uint32_t *make_indexes(unsigned int count, unsigned int n, bool zipf)
+{
+  uint32_t *index = malloc(sizeof(uint32_t) * count);
+  uint64_t state = 0x9e3779b97f4a7c15ull;
+
+  if (index == NULL)
+    return NULL;
+
+  if (!zipf)
+  {
+    for (unsigned int i = 0; i < count; i++)
+      index[i] = next_random(&state) % n;
+
+    return index;
+  }
+
+  double zeta_n = 0;
+
+  for (unsigned int i = 1; i <= n; i++)
+    zeta_n += 1 / pow(i, ZIPF_THETA);
+
+  double zeta_2 = 1 + 1 / pow(2, ZIPF_THETA);
+  double alpha = 1 / (1 - ZIPF_THETA);
+  double eta = (1 - pow(2.0 / n, 1 - ZIPF_THETA)) / (1 - zeta_2 / zeta_n);
+
+  for (unsigned int i = 0; i < count; i++)
+  {
+    double u = (next_random(&state) >> 11) * (1.0 / 9007199254740992.0);
+    double uz = u * zeta_n;
+    uint64_t rank;
+
+    if (uz < 1)
+      rank = 0;
+    else if (uz < zeta_2)
+      rank = 1;
+    else
+      rank = (uint64_t)(n * pow(eta * u - eta + 1, alpha));
+
+    index[i] = mix64(rank < n ? rank : n - 1) % n;
+  }
+
+  return index;
+}
+
+/*
+ * Run every table workload on a dictionary of one size, with keys of
+ * one length
+ *
+ * Parameters:
+ *   size     Number of entries in the dictionary
+ *   key_len  Length of the keys
+ *
+ * Returns: None
+ */
+void bench_table(unsigned int size, int key_len)
+{
+  unsigned int ops = (size > MIN_OPS) ? size : MIN_OPS;
+  const char *dist_names[] = {"uniform", "zipf"};
+  uint32_t *indexes[2] = {make_indexes(ops, size, false), make_indexes(ops, size, true)};
+  key_set_t keys = {NULL, 0};
+
+  // Keys from size on are never stored before the miss and churn runs
+  if (indexes[0] == NULL || indexes[1] == NULL || !make_keys(&keys, size + ops, key_len))
+  {
+    printf("Error: cannot allocate keys for %u entries\n", size);
+    goto done;
+  }
+
+  CDict dict = CD_new();
+  double start = now_seconds();
+
+  for (unsigned int i = 0; i < size; i++)
+    CD_store(dict, key_at(&keys, i), key_at(&keys, i));
+
+  report("insert", "-", key_len, size, size, now_seconds() - start);
+
+  for (int d = 0; d < 2; d++)
+  {
+    unsigned long found = 0;
+
+    start = now_seconds();
+
+    for (unsigned int i = 0; i < ops; i++)
+      found += CD_retrieve(dict, key_at(&keys, indexes[d][i])) != NULL;
+
+    report("hit", dist_names[d], key_len, size, ops, now_seconds() - start);
+    sink += found;
+  }
+
+  unsigned long found = 0;
+  start = now_seconds();
+
+  for (unsigned int i = 0; i < ops; i++)
+    found += CD_retrieve(dict, key_at(&keys, size + i)) != NULL;
+
+  report("miss", "uniform", key_len, size, ops, now_seconds() - start);
+  sink += found;
+
+  for (int d = 0; d < 2; d++)
+  {
+    found = 0;
+    start = now_seconds();
+
+    for (unsigned int i = 0; i < ops; i++)
+    {
+      const char *key = key_at(&keys, indexes[d][i]);
+
+      if (i % MIXED_WRITE_EVERY == 0)
+        CD_store(dict, key, key);
+      else
+        found += CD_retrieve(dict, key) != NULL;
+    }
+
+    report("mixed", dist_names[d], key_len, size, ops, now_seconds() - start);
+    sink += found;
+  }
+
+  // A sliding window of size keys: each step deletes the oldest
+  start = now_seconds();
+
+  for (unsigned int i = 0; i < ops; i++)
+  {
+    CD_delete(dict, key_at(&keys, i));
+    CD_store(dict, key_at(&keys, size + i), key_at(&keys, size + i));
+  }
+
+  report("churn", "-", key_len, size, 2ul * ops, now_seconds() - start);
+
+  CD_free(dict);
+
+done:
+  free(keys.bytes);
+  free(indexes[0]);
+  free(indexes[1]);
+}
+
+/*
+ * Time storing and looking up integer keys, in a dictionary generated
+ * for them and in a CDict, to which each key must first be formatted
+ * as a string
+ *
+ * Parameters:
+ *   size     Number of entries in the dictionary
+ *
+ * Returns: None
+ */
+void bench_int_keys(unsigned int size)
+{
+  unsigned int ops = (size > MIN_OPS) ? size : MIN_OPS;
+  uint32_t *index = make_indexes(ops, size, false);
+  char(*strings)[24] = malloc(sizeof(*strings) * size);
+  char key[24];
+  unsigned long found = 0;
+
+  if (index == NULL || strings == NULL)
+  {
+    printf("Error: cannot allocate keys for %u entries\n", size);
+    goto done;
+  }
+
+  CDictU64 ints = CDictU64_new();
+  double start = now_seconds();
+
+  for (unsigned int i = 0; i < size; i++)
+    CDictU64_store(ints, mix64(i), i);
+
+  report("insert_u64", "-", 8, size, size, now_seconds() - start);
+  start = now_seconds();
+
+  for (unsigned int i = 0; i < ops; i++)
+  {
+    uint64_t value;
+    found += CDictU64_retrieve(ints, mix64(index[i]), &value);
+  }
+
+  report("hit_u64", "uniform", 8, size, ops, now_seconds() - start);
+  CDictU64_free(ints);
+
+  // The CDict keeps pointers to its keys, so they need storage of their own
+  CDict dict = CD_new();
+  start = now_seconds();
+
+  for (unsigned int i = 0; i < size; i++)
+  {
+    snprintf(strings[i], sizeof(strings[i]), "%" PRIu64, mix64(i));
+    CD_store(dict, strings[i], strings[i]);
+  }
+
+  report("insert_u64_string", "-", 0, size, size, now_seconds() - start);
+  start = now_seconds();
+
+  for (unsigned int i = 0; i < ops; i++)
+  {
+    snprintf(key, sizeof(key), "%" PRIu64, mix64(index[i]));
+    found += CD_retrieve(dict, key) != NULL;
+  }
+
+  report("hit_u64_string", "uniform", 0, size, ops, now_seconds() - start);
+  CD_free(dict);
+  sink += found;
+
+done:
+  free(index);
+  free(strings);
+}
+
+// Counts the entries visited by CD_foreach
+void count_callback(CDictKeyType key, CDictValueType value, void *cb_data)
+{
+  (*(unsigned long *)cb_data)++;
+}
+
+/*
+ * Time a compact dictionary against a plain one: inserting, hitting
+ * and missing keys in the compact one, and visiting every entry of
+ * each
+ *
+ * Parameters:
+ *   size     Number of entries in the dictionary
+ *
+ * Returns: None
+ */
+void bench_compact(unsigned int size)
+{
+  unsigned int ops = (size > MIN_OPS) ? size : MIN_OPS;
+  uint32_t *index = make_indexes(ops, size, false);
+  key_set_t keys = {NULL, 0};
+  CDict dicts[2] = {NULL, NULL};
+  const char *foreach_names[] = {"foreach", "foreach_compact"};
+
+  // Keys from size on are never stored
+  if (index == NULL || !make_keys(&keys, size + ops, COMPACT_KEY_LEN))
+  {
+    printf("Error: cannot allocate keys for %u entries\n", size);
+    goto done;
+  }
+
+  dicts[0] = CD_new();
+  dicts[1] = CD_new_compact();
+
+  for (unsigned int i = 0; i < size; i++)
+    CD_store(dicts[0], key_at(&keys, i), key_at(&keys, i));
+
+  CDict dict = dicts[1];
+  unsigned long found = 0;
+  double start = now_seconds();
+
+  for (unsigned int i = 0; i < size; i++)
+    CD_store(dict, key_at(&keys, i), key_at(&keys, i));
+
+  report("insert_compact", "-", COMPACT_KEY_LEN, size, size, now_seconds() - start);
+  start = now_seconds();
+
+  for (unsigned int i = 0; i < ops; i++)
+    found += CD_retrieve(dict, key_at(&keys, index[i])) != NULL;
+
+  report("hit_compact", "uniform", COMPACT_KEY_LEN, size, ops, now_seconds() - start);
+  start = now_seconds();
+
+  for (unsigned int i = 0; i < ops; i++)
+    found += CD_retrieve(dict, key_at(&keys, size + i)) != NULL;
+
+  report("miss_compact", "uniform", COMPACT_KEY_LEN, size, ops, now_seconds() - start);
+
+  // Enough passes to visit about ops entries
+  for (int d = 0; d < 2; d++)
+  {
+    unsigned int passes = (ops + size - 1) / size;
+
+    start = now_seconds();
+
+    for (unsigned int i = 0; i < passes; i++)
+      CD_foreach(dicts[d], count_callback, &found);
+
+    report(foreach_names[d], "-", COMPACT_KEY_LEN, size, (unsigned long)passes * size, now_seconds() - start);
+  }
+
+  sink += found;
+
+done:
+  CD_free(dicts[0]);
+  CD_free(dicts[1]);
+  free(keys.bytes);
+  free(index);
+}
+
+/*
+ * Time cloning a dictionary against taking a snapshot of it, and what
+ * a snapshot costs the writes that follow it
+ *
+ * Parameters:
+ *   size     Number of entries in the dictionary
+ *
+ * Returns: None
+ */
+void bench_snapshot(unsigned int size)
+{
+  unsigned int ops = (size > MIN_OPS) ? size : MIN_OPS;
+  uint32_t *index = make_indexes(ops, size, false);
+  key_set_t keys = {NULL, 0};
+  CDict dict = NULL, clone = NULL;
+  CDictSnapshot snap = NULL;
+  const char *overwrite_names[] = {"overwrite", "overwrite_snapshot"};
+
+  if (index == NULL || !make_keys(&keys, size, SNAPSHOT_KEY_LEN))
+  {
+    printf("Error: cannot allocate keys for %u entries\n", size);
+    goto done;
+  }
+
+  dict = CD_new();
+
+  for (unsigned int i = 0; i < size; i++)
+    CD_store(dict, key_at(&keys, i), key_at(&keys, i));
+
+  double start = now_seconds();
+  clone = CD_clone(dict);
+  report("clone", "-", SNAPSHOT_KEY_LEN, size, size, now_seconds() - start);
+
+  start = now_seconds();
+  snap = CD_snapshot(dict);
+  report("snapshot", "-", SNAPSHOT_KEY_LEN, size, 1, now_seconds() - start);
+  CDSN_free(snap);
+  snap = NULL;
+
+  for (int s = 0; s < 2; s++)
+  {
+    if (s == 1)
+      snap = CD_snapshot(dict);
+
+    start = now_seconds();
+
+    for (unsigned int i = 0; i < ops; i++)
+      CD_store(dict, key_at(&keys, index[i]), key_at(&keys, index[(i + 1) % ops]));
+
+    report(overwrite_names[s], "uniform", SNAPSHOT_KEY_LEN, size, ops, now_seconds() - start);
+  }
+
+  sink += CDSN_size(snap) + CD_size(clone);
+
+done:
+  CDSN_free(snap);
+  CD_free(clone);
+  CD_free(dict);
+  free(keys.bytes);
+  free(index);
+}
+
+/*
+ * Time inserting, hitting and missing keys in a table of a fixed
+ * number of slots filled up to a maximum load factor, for each probe
+ * sequence and load factor
+ *
+ * Parameters:
+ *   slots    Number of slots; a power of two
+ *
+ * Returns: None
+ */
+void bench_probes(unsigned int slots)
+{
+  unsigned int ops = (slots > MIN_OPS) ? slots : MIN_OPS;
+  uint32_t *index = make_indexes(ops, slots / 2, false);
+  key_set_t keys = {NULL, 0};
+  char name[64];
+
+  // Keys from slots on are never stored
+  if (index == NULL || !make_keys(&keys, slots + ops, PROBE_KEY_LEN))
+  {
+    printf("Error: cannot allocate keys for %u slots\n", slots);
+    goto done;
+  }
+
+  for (int p = 0; p < sizeof(probes) / sizeof(probes[0]); p++)
+    for (int l = 0; l < sizeof(max_loads) / sizeof(max_loads[0]); l++)
+    {
+      unsigned int size = (unsigned int)(slots * max_loads[l]);
+      CDictOptions options = {.capacity = size, .max_load_factor = max_loads[l], .probe = probes[p]};
+      CDict dict = CD_new_with_options(&options);
+      unsigned long found = 0;
+      double start = now_seconds();
+
+      for (unsigned int i = 0; i < size; i++)
+        CD_store(dict, key_at(&keys, i), key_at(&keys, i));
+
+      snprintf(name, sizeof(name), "insert_%s_%.2f", probe_names[p], max_loads[l]);
+      report(name, "-", PROBE_KEY_LEN, size, size, now_seconds() - start);
+
+      // Every load factor holds at least the first slots / 2 keys
+      start = now_seconds();
+
+      for (unsigned int i = 0; i < ops; i++)
+        found += CD_retrieve(dict, key_at(&keys, index[i])) != NULL;
+
+      snprintf(name, sizeof(name), "hit_%s_%.2f", probe_names[p], max_loads[l]);
+      report(name, "uniform", PROBE_KEY_LEN, size, ops, now_seconds() - start);
+      start = now_seconds();
+
+      for (unsigned int i = 0; i < ops; i++)
+        found += CD_retrieve(dict, key_at(&keys, slots + i)) != NULL;
+
+      snprintf(name, sizeof(name), "miss_%s_%.2f", probe_names[p], max_loads[l]);
+      report(name, "uniform", PROBE_KEY_LEN, size, ops, now_seconds() - start);
+
+      sink += found;
+      CD_free(dict);
+    }
+
+done:
+  free(keys.bytes);
+  free(index);
+}
+
+/*
+ * Time creating many dictionaries of CREATE_ENTRIES entries, each
+ * freed before the next is created
+ *
+ * Parameters:
+ *   name       Name of the workload
+ *   allocator  Allocator for the dictionaries, or NULL for malloc
+ *
+ * Returns: None
+ */
+void bench_create(const char *name, const CDictAllocator *allocator)
+{
+  key_set_t keys;
+
+  if (!make_keys(&keys, CREATE_ENTRIES, key_lengths[0]))
+  {
+    printf("Error: cannot allocate keys\n");
+    return;
+  }
+
+  double start = now_seconds();
+
+  for (int i = 0; i < CREATE_DICTS; i++)
+  {
+    CDict dict = CD_new_with_allocator(allocator);
+
+    for (unsigned int j = 0; j < CREATE_ENTRIES; j++)
+      CD_store(dict, key_at(&keys, j), key_at(&keys, j));
+
+    sink += CD_size(dict);
+    CD_free(dict);
+  }
+
+  report(name, "-", keys.key_len, CREATE_ENTRIES, CREATE_DICTS, now_seconds() - start);
+  free(keys.bytes);
+}
+
+// CD_foreach callback freeing keys and values allocated by the caller
+void free_callback(CDictKeyType key, CDictValueType value, void *cb_data)
+{
+  free((char *)key);
+  free((char *)value);
+}
+
+/*
+ * Write a file of num_entries key<TAB>value lines
+ *
+ * Parameters:
+ *   path         Template for mkstemp, replaced by the file's name
+ *   num_entries  Number of lines
+ *
+ * Returns: True on success
+ */
+bool write_tsv(char *path, int num_entries)
+{
+  int fd = mkstemp(path);
+  FILE *file = (fd < 0) ? NULL : fdopen(fd, "w");
+
+  if (file == NULL)
+    return false;
+
+  for (int i = 0; i < num_entries; i++)
+    fprintf(file, "user:%08d\tname-%d,group-%d,shell-/bin/sh\n", i * 7919, i, i % 97);
+
+  return fclose(file) == 0;
+}
+
+/*
+ * Load a TSV file the way callers did before CD_load_tsv: one line at
+ * a time with fgets, copying each key and value with strdup
+ *
+ * Parameters:
+ *   dict     The dictionary
+ *   path     The file
+ *
+ * Returns: The number of entries stored
+ */
+int load_naive(CDict dict, const char *path)
+{
+  FILE *file = fopen(path, "r");
+  char line[LINE_MAX_LEN];
+  int stored = 0;
+
+  if (file == NULL)
+    return -1;
+
+  while (fgets(line, sizeof(line), file) != NULL)
+  {
+    char *tab = strchr(line, '\t');
+
+    if (tab == NULL)
+      continue;
+
+    *tab = '\0';
+    tab[strcspn(tab + 1, "\r\n") + 1] = '\0';
+
+    CD_store(dict, strdup(line), strdup(tab + 1));
+    stored++;
+  }
+
+  fclose(file);
+  return stored;
+}
+
+/*
+ * Time one way of loading a file, taking the best of BENCH_REPEATS runs
+ * so that one-off costs such as first faults on the file's pages are
+ * not charged to whichever method happens to run first
+ *
+ * Parameters:
+ *   name     Name of the workload, for the report
+ *   method   0 for the naive loop, 1 for CD_load_tsv, 2 for CD_load_tsv
+ *            into an owned dictionary
+ *   path     The file
+ *
+ * Returns: None
+ */
+void time_load(const char *name, int method, const char *path)
+{
+  double best = 0;
+  int stored = 0;
+
+  for (int run = 0; run < BENCH_REPEATS; run++)
+  {
+    CDict dict = (method == 2) ? CD_new_owned() : CD_new();
+    double start = now_seconds();
+    stored = (method == 0) ? load_naive(dict, path) : CD_load_tsv(dict, path, 0);
+    double elapsed = now_seconds() - start;
+
+    if (run == 0 || elapsed < best)
+      best = elapsed;
+
+    if (method == 0)
+      CD_foreach(dict, free_callback, NULL);
+
+    CD_free(dict);
+  }
+
+  report(name, "-", 0, stored, stored, best);
+}
+
+/*
+ * Time loading the same file with the naive loop and with CD_load_tsv,
+ * into plain and owned dictionaries
+ *
+ * Parameters:
+ *   num_entries  Number of lines in the file
+ *
+ * Returns: None
+ */
+void bench_load_tsv(int num_entries)
+{
+  char path[] = "/tmp/cdict_bench_XXXXXX";
+
+  if (!write_tsv(path, num_entries))
+  {
+    printf("Error: cannot write benchmark file\n");
+    return;
+  }
+
+  time_load("load_tsv_naive", 0, path);
+  time_load("load_tsv", 1, path);
+  time_load("load_tsv_owned", 2, path);
+
+  remove(path);
+}
+
+// The create workload with a pool, created in the same process
+void bench_create_pooled()
+{
+  CDictPool pool = CDP_new(0);
+  CDictAllocator pooled = CDP_allocator(pool);
+
+  bench_create("create_pool", &pooled);
+  CDP_free(pool);
+}
+
+/*
+ * Run a benchmark call in a child process and wait for it, so that the
+ * memory it touches does not count towards the peak resident size of
+ * later ones. If the child cannot be forked, the call runs here.
+ */
+#define ISOLATED(call)          \
+  do                            \
+  {                             \
+    fflush(stdout);             \
+    pid_t pid = fork();         \
+                                \
+    if (pid == 0)               \
+    {                           \
+      call;                     \
+      fflush(stdout);           \
+      _exit(0);                 \
+    }                           \
+                                \
+    if (pid < 0)                \
+      call;                     \
+    else                        \
+      waitpid(pid, NULL, 0);    \
+  } while (0)
+
+int main(int argc, char *argv[])
+{
+  long max_entries = (argc > 1) ? atol(argv[1]) : DEFAULT_MAX_ENTRIES;
+
+  if (max_entries < MIN_ENTRIES || max_entries > (1l << 30))
+  {
+    printf("Usage: %s [max_entries], with max_entries from %d to %ld\n", argv[0], MIN_ENTRIES, 1l << 30);
+    return 1;
+  }
+
+  printf("workload,distribution,key_len,size,ops,seconds,ns_per_op,ops_per_sec,peak_rss_kb\n");
+
+  for (long size = MIN_ENTRIES; size <= max_entries; size *= SIZE_STEP)
+  {
+    for (int k = 0; k < sizeof(key_lengths) / sizeof(key_lengths[0]); k++)
+      ISOLATED(bench_table((unsigned int)size, key_lengths[k]));
+
+    ISOLATED(bench_int_keys((unsigned int)size));
+    ISOLATED(bench_compact((unsigned int)size));
+    ISOLATED(bench_snapshot((unsigned int)size));
+  }
+
+  unsigned int slots = PROBE_SLOTS;
+
+  while (slots > max_entries)
+    slots /= 2;
+
+  ISOLATED(bench_probes(slots));
+  ISOLATED(bench_create("create_malloc", NULL));
+
+  ISOLATED(bench_create_pooled());
+
+  ISOLATED(bench_load_tsv(max_entries < TSV_MAX_ENTRIES ? max_entries : TSV_MAX_ENTRIES));
+
+  return 0;
+}
@@ -0,0 +1,629 @@
+/*
+ * cdict_concurrent.c
+ *
+ * Dictionary with lock-free lookups, for tables read by many threads
+ * and written rarely.
+ *
+ * Author: Niyomwungeri Parmenide Ishimwe <parmenin@andrew.cmu.edu>
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "cdict_concurrent.h"
+#include "cdict_internal.h"
+
+#define DEFAULT_DICT_CAPACITY 8 // must be a power of two
+#define MAX_DICT_CAPACITY (1u << 31)
+#define REHASH_THRESHOLD 0.6
+
+#define CACHE_LINE_SIZE 64
+
+// Threads that can read without any atomic read-modify-write. Further
+// threads still read correctly, but announce themselves with a shared
+// counter instead.
+#define MAX_READERS 256
+
+// Marks a slot whose key was deleted. Probes continue past it, and it
+// is not reused until the table is rebuilt.
+static const char _CDC_tombstone[1];
+#define TOMBSTONE ((CDictKeyType)_CDC_tombstone)
+
+/*
+ * A slot is published by storing its key last: a reader that sees a
+ * key other than NULL or TOMBSTONE is guaranteed to see the hash,
+ * length and value written before it. The hash and length of a slot
+ * never change once its key is set.
+ */
+struct _cdc_slot
+{
+  _Atomic(CDictKeyType) key; // NULL if never used
+  _Atomic(CDictValueType) value;
+  uint64_t hash;
+  size_t key_len;
+};
+
+struct _cdc_table
+{
+  unsigned int capacity;      // always a power of two
+  unsigned int num_used;      // slots with a key or tombstone
+  uint64_t retire_epoch;      // global epoch when replaced
+  struct _cdc_table *next;    // next table waiting to be freed
+  struct _cdc_slot slot[];
+};
+
+struct _concurrent_dictionary
+{
+  _Atomic(struct _cdc_table *) table;
+  atomic_uint num_stored;
+  atomic_uint fallback_readers;  // readers without a reader record
+  pthread_mutex_t write_lock;    // held by stores and deletes
+  struct _cdc_table *retired;    // replaced tables, newest first
+  struct _arena_chunk *arena;    // copies of keys and values
+  struct _hash_seed seed;        // for hashing keys, as in a CDict
+};
+
+/*
+ * Epoch-based reclamation. Each reading thread has a record, on its
+ * own cache line, holding the global epoch it saw when its current
+ * read began, or EPOCH_QUIESCENT between reads. A writer advances the
+ * global epoch only when every reader in a read has seen the current
+ * one. A table replaced during epoch e can then be freed once the
+ * global epoch reaches e + 2: any reader that could have loaded the
+ * table pointer before it was replaced has finished by then.
+ */
+#define EPOCH_QUIESCENT 0
+
+struct _reader
+{
+  atomic_ullong epoch;
+  atomic_bool in_use;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+static struct _reader _CDC_readers[MAX_READERS];
+static atomic_uint _CDC_num_readers;  // records ever handed out
+static atomic_ullong _CDC_global_epoch = 1;
+
+static pthread_key_t _CDC_reader_key;
+static pthread_once_t _CDC_reader_once = PTHREAD_ONCE_INIT;
+
+static _Thread_local struct _reader *_CDC_self;
+static _Thread_local bool _CDC_no_record;      // all records were taken
+static _Thread_local unsigned int _CDC_depth;  // nested reads in progress
+
+/*
+ * Give a thread's reader record back when the thread exits
+ */
+static void _CDC_reader_release(void *record)
+{
+  struct _reader *reader = record;
+
+  atomic_store_explicit(&reader->epoch, EPOCH_QUIESCENT, memory_order_relaxed);
+  atomic_store_explicit(&reader->in_use, false, memory_order_release);
+}
+
+static void _CDC_reader_key_init()
+{
+  pthread_key_create(&_CDC_reader_key, _CDC_reader_release);
+}
+
+/*
+ * Return the calling thread's reader record, claiming a free one the
+ * first time the thread reads
+ *
+ * Returns: The record, or NULL if every record is in use
+ */
+static inline struct _reader *_CDC_reader()
+{
+  if (_CDC_self != NULL || _CDC_no_record)
+    return _CDC_self;
+
+  pthread_once(&_CDC_reader_once, _CDC_reader_key_init);
+
+  for (unsigned int i = 0; i < MAX_READERS; i++)
+  {
+    bool expected = false;
+
+    if (atomic_compare_exchange_strong(&_CDC_readers[i].in_use, &expected, true))
+    {
+      unsigned int num_readers = atomic_load(&_CDC_num_readers);
+
+      while (num_readers <= i && !atomic_compare_exchange_weak(&_CDC_num_readers, &num_readers, i + 1))
+        ;
+
+      pthread_setspecific(_CDC_reader_key, &_CDC_readers[i]);
+      _CDC_self = &_CDC_readers[i];
+      return _CDC_self;
+    }
+  }
+
+  _CDC_no_record = true;
+  return NULL;
+}
+
+/*
+ * Enter a read, after which tables seen by the caller are not freed
+ * until the matching _CDC_read_end. Reads may be nested.
+ *
+ * Parameters:
+ *   dict     The dictionary about to be read
+ *
+ * Returns: True if the thread has a reader record, to be passed to
+ *   _CDC_read_end
+ */
+static inline bool _CDC_read_begin(CDictConcurrent dict)
+{
+  struct _reader *self = _CDC_reader();
+
+  if (self == NULL)
+  {
+    atomic_fetch_add(&dict->fallback_readers, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+    return false;
+  }
+
+  if (_CDC_depth++ == 0)
+  {
+    atomic_store_explicit(&self->epoch, atomic_load_explicit(&_CDC_global_epoch, memory_order_relaxed),
+                          memory_order_relaxed);
+
+    // The epoch must be visible to writers before the table pointer is
+    // loaded. This orders only the thread's own cache line.
+    atomic_thread_fence(memory_order_seq_cst);
+  }
+
+  return true;
+}
+
+static inline void _CDC_read_end(CDictConcurrent dict, bool has_record)
+{
+  if (!has_record)
+    atomic_fetch_sub(&dict->fallback_readers, 1);
+
+  else if (--_CDC_depth == 0)
+    atomic_store_explicit(&_CDC_self->epoch, EPOCH_QUIESCENT, memory_order_release);
+}
+
+/*
+ * Free the replaced tables that no reader can still be using,
+ * advancing the global epoch if every reader has caught up with it.
+ * Called with the write lock held.
+ *
+ * Parameters:
+ *   dict     The dictionary
+ *
+ * Returns: None
+ */
+static void _CDC_reclaim(CDictConcurrent dict)
+{
+  if (dict->retired == NULL)
+    return;
+
+  unsigned long long epoch = atomic_load(&_CDC_global_epoch);
+  unsigned int num_readers = atomic_load(&_CDC_num_readers);
+  bool caught_up = true;
+
+  for (unsigned int i = 0; i < num_readers && caught_up; i++)
+  {
+    unsigned long long seen = atomic_load(&_CDC_readers[i].epoch);
+    caught_up = (seen == EPOCH_QUIESCENT || seen == epoch);
+  }
+
+  // Another dictionary's writer may have advanced it already
+  if (caught_up && !atomic_compare_exchange_strong(&_CDC_global_epoch, &epoch, epoch + 1))
+    caught_up = false;
+
+  if (caught_up)
+    epoch++;
+
+  // Readers without a record are not covered by the epoch
+  if (atomic_load(&dict->fallback_readers) != 0)
+    return;
+
+  for (struct _cdc_table **link = &dict->retired; *link != NULL;)
+  {
+    struct _cdc_table *table = *link;
+
+    if (table->retire_epoch + 2 <= epoch)
+    {
+      *link = table->next;
+      free(table);
+    }
+    else
+      link = &table->next;
+  }
+}
+
+/*
+ * Allocate a table with every slot unused
+ *
+ * Parameters:
+ *   capacity  Number of slots; must be a power of two
+ *
+ * Returns: The table, or NULL if memory allocation failed
+ */
+static struct _cdc_table *_CDC_table_new(unsigned int capacity)
+{
+  struct _cdc_table *table = calloc(1, sizeof(struct _cdc_table) + sizeof(struct _cdc_slot) * capacity);
+
+  if (table == NULL)
+    return NULL;
+
+  table->capacity = capacity;
+
+  return table;
+}
+
+// Documented in .h file
+CDictConcurrent CDC_new()
+{
+  CDictConcurrent dict = (CDictConcurrent)calloc(1, sizeof(struct _concurrent_dictionary));
+
+  if (dict == NULL)
+  {
+    printf("Error: memory allocation failed for dictionary\n");
+    return NULL;
+  }
+
+  struct _cdc_table *table = _CDC_table_new(DEFAULT_DICT_CAPACITY);
+
+  if (table == NULL)
+  {
+    printf("Error: memory allocation failed for dictionary slot\n");
+    free(dict);
+    return NULL;
+  }
+
+  atomic_init(&dict->table, table);
+  _CD_random_seed(&dict->seed);
+  pthread_mutex_init(&dict->write_lock, NULL);
+
+  return dict;
+}
+
+// Documented in .h file
+void CDC_free(CDictConcurrent dict)
+{
+  if (dict)
+  {
+    free(atomic_load(&dict->table));
+
+    while (dict->retired != NULL)
+    {
+      struct _cdc_table *next = dict->retired->next;
+      free(dict->retired);
+      dict->retired = next;
+    }
+
+    _CD_arena_free(&dict->arena);
+    pthread_mutex_destroy(&dict->write_lock);
+
+    free(dict);
+  }
+}
+
+/*
+ * Find the slot holding a key. Probing is linear, one slot at a time,
+ * and ends at the first slot that has never been used.
+ *
+ * Parameters:
+ *   table  The table to search
+ *   hash   The full hash of key
+ *   key    The key
+ *   len    Length of key in bytes
+ *
+ * Returns: The slot holding key, or NULL if not found
+ */
+static struct _cdc_slot *_CDC_find(struct _cdc_table *table, uint64_t hash, const void *key, size_t len)
+{
+  unsigned int mask = table->capacity - 1;
+  unsigned int index = hash & mask;
+
+  for (unsigned int probed = 0; probed < table->capacity; probed++, index = (index + 1) & mask)
+  {
+    struct _cdc_slot *slot = &table->slot[index];
+    CDictKeyType slot_key = atomic_load_explicit(&slot->key, memory_order_acquire);
+
+    if (slot_key == NULL)
+      return NULL;
+
+    if (slot_key != TOMBSTONE && slot->hash == hash && slot->key_len == len && memcmp(slot_key, key, len) == 0)
+      return slot;
+  }
+
+  return NULL;
+}
+
+/*
+ * Fill the first never-used slot on a key's probe sequence, publishing
+ * it with the store of its key. Called with the write lock held, on a
+ * table with at least one unused slot.
+ *
+ * Parameters:
+ *   table  The table
+ *   hash   The full hash of key
+ *   key    The key
+ *   len    Length of key in bytes
+ *   value  The value
+ *
+ * Returns: None
+ */
+static void _CDC_table_insert(struct _cdc_table *table, uint64_t hash, CDictKeyType key, size_t len,
+                              CDictValueType value)
+{
+  unsigned int mask = table->capacity - 1;
+  unsigned int index = hash & mask;
+
+  while (atomic_load_explicit(&table->slot[index].key, memory_order_relaxed) != NULL)
+    index = (index + 1) & mask;
+
+  struct _cdc_slot *slot = &table->slot[index];
+
+  slot->hash = hash;
+  slot->key_len = len;
+  atomic_store_explicit(&slot->value, value, memory_order_relaxed);
+  atomic_store_explicit(&slot->key, key, memory_order_release);
+  table->num_used++;
+}
+
+/*
+ * Copy the live entries into a new table sized for twice their number,
+ * dropping tombstones, and make it the dictionary's table. The old
+ * table is retired rather than freed, since readers may still be
+ * probing it. Called with the write lock held.
+ *
+ * Parameters:
+ *   dict     The dictionary
+ *
+ * Returns: None
+ */
+static void _CDC_rehash(CDictConcurrent dict)
+{
+  struct _cdc_table *old = atomic_load_explicit(&dict->table, memory_order_relaxed);
+  unsigned int live = atomic_load_explicit(&dict->num_stored, memory_order_relaxed);
+  unsigned int capacity = DEFAULT_DICT_CAPACITY;
+
+  while (live * 2 > capacity * REHASH_THRESHOLD && capacity < MAX_DICT_CAPACITY)
+    capacity *= 2;
+
+  struct _cdc_table *table = _CDC_table_new(capacity);
+
+  if (table == NULL)
+  {
+    // The dictionary keeps working at its current size
+    printf("Error: memory allocation failed for new dictionary slot\n");
+    return;
+  }
+
+  for (unsigned int i = 0; i < old->capacity; i++)
+  {
+    CDictKeyType key = atomic_load_explicit(&old->slot[i].key, memory_order_relaxed);
+
+    if (key != NULL && key != TOMBSTONE)
+      _CDC_table_insert(table, old->slot[i].hash, key, old->slot[i].key_len,
+                        atomic_load_explicit(&old->slot[i].value, memory_order_relaxed));
+  }
+
+  atomic_store(&dict->table, table);
+
+  // Read after the swap, so readers that saw the old table are
+  // accounted for in this epoch or an earlier one
+  old->retire_epoch = atomic_load(&_CDC_global_epoch);
+  old->next = dict->retired;
+  dict->retired = old;
+}
+
+// Documented in .h file
+unsigned int CDC_size(CDictConcurrent dict)
+{
+  if (dict == NULL)
+  {
+    printf("Error: cannot get size of NULL dictionary\n");
+    return 0;
+  }
+
+  return atomic_load_explicit(&dict->num_stored, memory_order_relaxed);
+}
+
+// Documented in .h file
+unsigned int CDC_capacity(CDictConcurrent dict)
+{
+  if (dict == NULL)
+  {
+    printf("Error: cannot get capacity of NULL dictionary\n");
+    return 0;
+  }
+
+  bool has_record = _CDC_read_begin(dict);
+  unsigned int capacity = atomic_load_explicit(&dict->table, memory_order_acquire)->capacity;
+  _CDC_read_end(dict, has_record);
+
+  return capacity;
+}
+
+// Documented in .h file
+bool CDC_contains(CDictConcurrent dict, CDictKeyType key)
+{
+  if (dict == NULL || key == NULL)
+  {
+    printf("Contains error: dictionary or key is NULL for [%s]\n", key);
+    return false;
+  }
+
+  return CDC_retrieve_n(dict, key, strlen(key)) != INVALID_VALUE;
+}
+
+// Documented in .h file
+bool CDC_contains_n(CDictConcurrent dict, const void *key, size_t len)
+{
+  if (dict == NULL || key == NULL)
+  {
+    printf("Contains error: dictionary or key is NULL\n");
+    return false;
+  }
+
+  return CDC_retrieve_n(dict, key, len) != INVALID_VALUE;
+}
+
+// Documented in .h file
+void CDC_store(CDictConcurrent dict, CDictKeyType key, CDictValueType value)
+{
+  if (dict == NULL || key == NULL || value == NULL)
+  {
+    printf("Store error: dictionary or key or value is NULL for [%s]\n", key);
+    return;
+  }
+
+  CDC_store_n(dict, key, strlen(key), value);
+}
+
+// Documented in .h file
+void CDC_store_n(CDictConcurrent dict, const void *key, size_t len, CDictValueType value)
+{
+  if (dict == NULL || key == NULL || value == NULL)
+  {
+    printf("Store error: dictionary or key or value is NULL\n");
+    return;
+  }
+
+  uint64_t hash = _CD_siphash(key, len, &dict->seed);
+
+  pthread_mutex_lock(&dict->write_lock);
+
+  struct _cdc_table *table = atomic_load_explicit(&dict->table, memory_order_relaxed);
+  struct _cdc_slot *slot = _CDC_find(table, hash, key, len);
+
+  // Tombstones count as used, so that a table churned by deletes is
+  // rebuilt rather than left with no unused slot to end probes
+  if (slot == NULL && table->num_used + 1 > table->capacity * REHASH_THRESHOLD)
+  {
+    _CDC_rehash(dict);
+    table = atomic_load_explicit(&dict->table, memory_order_relaxed);
+  }
+
+  // A table that could not grow must keep an unused slot. This is
+  // checked before copying anything into the arena, which never gives
+  // space back.
+  if (slot == NULL && table->num_used + 1 >= table->capacity)
+    printf("Store error: dictionary full, cannot store [%.*s]\n", (int)len, (const char *)key);
+  else
+  {
+    CDictValueType value_copy = _CD_arena_copy(&dict->arena, value, strlen(value));
+    CDictKeyType key_copy = (slot == NULL && value_copy != NULL) ? _CD_arena_copy(&dict->arena, key, len) : NULL;
+
+    if (value_copy == NULL || (slot == NULL && key_copy == NULL))
+      printf("Store error: memory allocation failed for [%.*s]\n", (int)len, (const char *)key);
+
+    // Found a slot with the same key, update the value
+    else if (slot != NULL)
+      atomic_store_explicit(&slot->value, value_copy, memory_order_release);
+
+    else
+    {
+      _CDC_table_insert(table, hash, key_copy, len, value_copy);
+      atomic_store_explicit(&dict->num_stored, atomic_load_explicit(&dict->num_stored, memory_order_relaxed) + 1,
+                            memory_order_relaxed);
+    }
+  }
+
+  _CDC_reclaim(dict);
+  pthread_mutex_unlock(&dict->write_lock);
+}
+
+// Documented in .h file
+CDictValueType CDC_retrieve(CDictConcurrent dict, CDictKeyType key)
+{
+  if (dict == NULL || key == NULL)
+  {
+    printf("Retrieve error: dictionary or key is NULL for [%s]\n", key);
+    return INVALID_VALUE;
+  }
+
+  return CDC_retrieve_n(dict, key, strlen(key));
+}
+
+// Documented in .h file
+CDictValueType CDC_retrieve_n(CDictConcurrent dict, const void *key, size_t len)
+{
+  if (dict == NULL || key == NULL)
+  {
+    printf("Retrieve error: dictionary or key is NULL\n");
+    return INVALID_VALUE;
+  }
+
+  uint64_t hash = _CD_siphash(key, len, &dict->seed);
+  CDictValueType value = INVALID_VALUE;
+
+  bool has_record = _CDC_read_begin(dict);
+  struct _cdc_slot *slot = _CDC_find(atomic_load_explicit(&dict->table, memory_order_acquire), hash, key, len);
+
+  if (slot != NULL)
+    value = atomic_load_explicit(&slot->value, memory_order_acquire);
+
+  _CDC_read_end(dict, has_record);
+
+  return value;
+}
+
+// Documented in .h file
+void CDC_delete(CDictConcurrent dict, CDictKeyType key)
+{
+  if (dict == NULL || key == NULL)
+  {
+    printf("Delete error: dictionary or key is NULL for [%s]\n", key);
+    return;
+  }
+
+  CDC_delete_n(dict, key, strlen(key));
+}
+
+// Documented in .h file
+void CDC_delete_n(CDictConcurrent dict, const void *key, size_t len)
+{
+  if (dict == NULL || key == NULL)
+  {
+    printf("Delete error: dictionary or key is NULL\n");
+    return;
+  }
+
+  uint64_t hash = _CD_siphash(key, len, &dict->seed);
+
+  pthread_mutex_lock(&dict->write_lock);
+
+  struct _cdc_slot *slot = _CDC_find(atomic_load_explicit(&dict->table, memory_order_relaxed), hash, key, len);
+
+  if (slot != NULL)
+  {
+    atomic_store_explicit(&slot->key, TOMBSTONE, memory_order_release);
+    atomic_store_explicit(&dict->num_stored, atomic_load_explicit(&dict->num_stored, memory_order_relaxed) - 1,
+                          memory_order_relaxed);
+  }
+
+  _CDC_reclaim(dict);
+  pthread_mutex_unlock(&dict->write_lock);
+
+  if (slot == NULL)
+    printf("Error: cannot delete key [%.*s] not found\n", (int)len, (const char *)key);
+}
+
+// Documented in .h file
+void CDC_foreach(CDictConcurrent dict, CD_foreach_callback callback, void *cb_data)
+{
+  if (dict == NULL || callback == NULL)
+    return;
+
+  bool has_record = _CDC_read_begin(dict);
+  struct _cdc_table *table = atomic_load_explicit(&dict->table, memory_order_acquire);
+
+  for (unsigned int i = 0; i < table->capacity; i++)
+  {
+    CDictKeyType key = atomic_load_explicit(&table->slot[i].key, memory_order_acquire);
+
+    if (key != NULL && key != TOMBSTONE)
+      callback(key, atomic_load_explicit(&table->slot[i].value, memory_order_acquire), cb_data);
+  }
+
+  _CDC_read_end(dict, has_record);
+}
@@ -0,0 +1,148 @@
+/*
+ * cdict_concurrent.h
+ *
+ * Dictionary for read-mostly workloads shared between threads. Lookups
+ * take no locks and perform no atomic read-modify-write operations, so
+ * any number of threads can read at once without writing to a shared
+ * cache line. Stores and deletes are serialized by a lock and publish
+ * their changes with atomic stores. When the table grows, the new slot
+ * array replaces the old one in a single pointer store, and the old
+ * array is freed only once no reader can still be using it (epoch-based
+ * reclamation).
+ *
+ * The dictionary always owns its keys and values: they are copied on
+ * store and stay in place until the dictionary is freed, so a value
+ * returned to one thread stays valid while another overwrites or
+ * deletes its key.
+ *
+ * The functions mirror those in cdict.h, and may be called from any
+ * number of threads at once.
+ *
+ * Author: Niyomwungeri Parmenide Ishimwe <parmenin@andrew.cmu.edu>
+ */
+#ifndef _CDICT_CONCURRENT_H_
+#define _CDICT_CONCURRENT_H_
+
+#include "cdict.h"
+
+typedef struct _concurrent_dictionary *CDictConcurrent;
+
+
+/*
+ * Returns a newly-allocated and newly-initialized concurrent
+ * dictionary with no elements.
+ *
+ * Parameters: None
+ *
+ * Returns: The new CDictConcurrent, or NULL on failure
+ */
+CDictConcurrent CDC_new();
+
+
+/*
+ * Destroy all memory consumed by this dict, including its keys and
+ * values. No other thread may be using it.
+ *
+ * Parameters:
+ *   dict     The dictionary
+ *
+ * Returns: None
+ */
+void CDC_free(CDictConcurrent dict);
+
+
+/*
+ * Returns the number of elements in the dictionary
+ *
+ * Parameters:
+ *   dict     The dictionary
+ *
+ * Returns: the dictionary's size
+ */
+unsigned int CDC_size(CDictConcurrent dict);
+
+
+/*
+ * Returns the current capacity of the dictionary
+ *
+ * Parameters:
+ *   dict     The dictionary
+ *
+ * Returns: the dictionary's capacity
+ */
+unsigned int CDC_capacity(CDictConcurrent dict);
+
+
+/*
+ * Is key found in dictionary?
+ *
+ * Parameters:
+ *   dict     The dictionary
+ *   key      The key
+ *
+ * Returns: True if key is in dict, false otherwise
+ */
+bool CDC_contains(CDictConcurrent dict, CDictKeyType key);
+bool CDC_contains_n(CDictConcurrent dict, const void *key, size_t len);
+
+
+/*
+ * Store the supplied key, value pair in the dictionary, copying both.
+ * If key is already present, its value is overwritten; readers see
+ * either the old value or the new one.
+ *
+ * Parameters:
+ *   dict     The dictionary
+ *   key      The key
+ *   value    The value
+ *
+ * Returns: None
+ */
+void CDC_store(CDictConcurrent dict, CDictKeyType key, CDictValueType value);
+void CDC_store_n(CDictConcurrent dict, const void *key, size_t len, CDictValueType value);
+
+
+/*
+ * Find the value for a given key, without taking any lock. The value
+ * remains valid until the dict is freed.
+ *
+ * Parameters:
+ *   dict     The dictionary
+ *   key      The key
+ *
+ * Returns: The value, or INVALID_VALUE if key not found in dict
+ */
+CDictValueType CDC_retrieve(CDictConcurrent dict, CDictKeyType key);
+CDictValueType CDC_retrieve_n(CDictConcurrent dict, const void *key, size_t len);
+
+
+/*
+ * Delete a key from the dictionary
+ *
+ * Parameters:
+ *   dict     The dictionary
+ *   key      The key
+ *
+ * Returns: None
+ */
+void CDC_delete(CDictConcurrent dict, CDictKeyType key);
+void CDC_delete_n(CDictConcurrent dict, const void *key, size_t len);
+
+
+/*
+ * Iterate through the dictionary, calling the user-specified callback
+ * function for each element. Elements stored or deleted by other
+ * threads during the iteration, or by the callback itself, may or may
+ * not be visited.
+ *
+ * Parameters:
+ *   dict       The dictionary
+ *   callback   The function to call
+ *   cb_data    Caller data to pass to the function
+ *
+ * Returns: None
+ */
+void CDC_foreach(CDictConcurrent dict, CD_foreach_callback callback, void *cb_data);
+
+
+#endif /* _CDICT_CONCURRENT_H_ */
@@ -0,0 +1,720 @@
+/*
+ * cdict_frozen.c
+ *
+ * Read-only dictionary indexed by a minimal perfect hash, built with
+ * the hash-and-displace (CHD) method.
+ *
+ * Author: Niyomwungeri Parmenide Ishimwe <parmenin@andrew.cmu.edu>
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "cdict_frozen.h"
+#include "cdict_internal.h"
+
+/*
+ * Keys are first hashed into buckets of about KEYS_PER_BUCKET keys.
+ * Each bucket then gets a displacement: the first value for which a
+ * second hash sends every key of the bucket to a slot not yet taken.
+ * Buckets are placed largest first, while the table is still mostly
+ * free. Single-key buckets go last, straight into whatever slots
+ * remain, and record the slot itself with DIRECT_SLOT set.
+ */
+#define KEYS_PER_BUCKET 4
+#define MAX_DISPLACEMENT (1u << 20)
+#define DIRECT_SLOT 0x80000000u
+#define MAX_FROZEN_ENTRIES DIRECT_SLOT
+
+// Seeds tried in turn, in case some bucket cannot be placed
+#define FROZEN_SEED 0x243f6a8885a308d3ull
+#define MAX_SEED_ATTEMPTS 8
+
+// Records start on multiples of this, so 32-bit offsets reach 32 GiB
+#define RECORD_ALIGN 8
+
+/*
+ * A frozen dictionary is a single block with no pointers in it:
+ *
+ *   header
+ *   uint32_t displacement[num_buckets]
+ *   uint32_t offset[num_entries]   record of each slot, in RECORD_ALIGN units
+ *   records, from the first RECORD_ALIGN boundary
+ */
+struct _frozen_header
+{
+  uint64_t seed;
+  uint32_t num_entries;
+  uint32_t num_buckets;
+  uint64_t blob_size;
+};
+
+struct _frozen_record
+{
+  uint32_t key_len;
+  uint32_t value_len;
+  char data[]; // key, NUL, value, NUL
+};
+
+/*
+ * Files written by CD_save are this header followed by the block. The
+ * version changes whenever the layout of the block does, and the byte
+ * order mark tells whether the file came from a machine with the same
+ * endianness.
+ */
+#define FROZEN_FILE_MAGIC "CDICTFRZ"
+#define FROZEN_FILE_VERSION 1
+#define FROZEN_BYTE_ORDER 0x01020304u
+
+struct _frozen_file_header
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  uint64_t block_size; // bytes following this header
+};
+
+struct _frozen_dictionary
+{
+  const struct _frozen_header *header;
+  const uint32_t *displacement;
+  const uint32_t *offset;
+  const char *blob;
+  void *buffer;       // the block, freed with the dictionary; NULL if mapped
+  void *mapping;      // the whole file, if opened with CD_open_mmap
+  size_t mapping_size;
+};
+
+// An entry of the dictionary being frozen
+struct _freeze_entry
+{
+  const void *key;
+  size_t len;
+  CDictValueType value;
+  uint64_t hash;
+  uint32_t slot;
+};
+
+struct _freeze_state
+{
+  struct _freeze_entry *entry;
+  unsigned int count;
+  size_t blob_size;
+};
+
+// Map a 32-bit value onto [0, n) without a division
+static inline uint32_t _CDF_fastrange(uint32_t x, uint32_t n)
+{
+  return (uint32_t)(((uint64_t)x * n) >> 32);
+}
+
+static inline uint32_t _CDF_bucket(uint64_t hash, uint32_t num_buckets)
+{
+  return _CDF_fastrange((uint32_t)(hash >> 32), num_buckets);
+}
+
+/*
+ * Return the slot of a key under a displacement. The hash is remixed
+ * for each displacement, so that keys sharing a bucket move
+ * independently of each other from one displacement to the next.
+ */
+static inline uint32_t _CDF_slot(uint64_t hash, uint32_t displacement, uint32_t num_entries)
+{
+  uint64_t x = hash ^ ((uint64_t)displacement * 0x9e3779b97f4a7c15ull);
+
+  x ^= x >> 32;
+  x *= 0xd6e8feb86659fd93ull;
+  x ^= x >> 32;
+
+  return _CDF_fastrange((uint32_t)x, num_entries);
+}
+
+static inline size_t _CDF_record_size(size_t key_len, size_t value_len)
+{
+  size_t size = sizeof(struct _frozen_record) + key_len + 1 + value_len + 1;
+  return (size + RECORD_ALIGN - 1) & ~(size_t)(RECORD_ALIGN - 1);
+}
+
+// Offset of the first record from the start of the block
+static inline size_t _CDF_blob_start(uint32_t num_buckets, uint32_t num_entries)
+{
+  size_t start = sizeof(struct _frozen_header) + sizeof(uint32_t) * ((size_t)num_buckets + num_entries);
+  return (start + RECORD_ALIGN - 1) & ~(size_t)(RECORD_ALIGN - 1);
+}
+
+static inline size_t _CDF_block_size(const struct _frozen_header *header)
+{
+  return _CDF_blob_start(header->num_buckets, header->num_entries) + header->blob_size;
+}
+
+/*
+ * Point a frozen dictionary's arrays into its block
+ *
+ * Parameters:
+ *   dict     The frozen dictionary
+ *   block    The block, starting with its header
+ *
+ * Returns: None
+ */
+static void _CDF_attach(CDictFrozen dict, const void *block)
+{
+  dict->header = block;
+  dict->displacement = (const uint32_t *)(dict->header + 1);
+  dict->offset = dict->displacement + dict->header->num_buckets;
+  dict->blob = (const char *)block + _CDF_blob_start(dict->header->num_buckets, dict->header->num_entries);
+}
+
+// _CD_entry_callback adding each entry of the dictionary being frozen
+static void _CDF_collect(const void *key, size_t len, CDictValueType value, void *cb_data)
+{
+  struct _freeze_state *state = cb_data;
+
+  state->entry[state->count].key = key;
+  state->entry[state->count].len = len;
+  state->entry[state->count].value = value;
+  state->count++;
+
+  state->blob_size += _CDF_record_size(len, strlen(value));
+}
+
+/*
+ * Find a displacement that puts every key of a bucket in a free slot,
+ * and take those slots
+ *
+ * Parameters:
+ *   entry        All entries
+ *   members      Indexes of the bucket's entries
+ *   size         Number of entries in the bucket
+ *   taken        One flag per slot, set for slots already taken
+ *   num_entries  Number of slots
+ *
+ * Returns: The displacement, or MAX_DISPLACEMENT if there is none
+ */
+static uint32_t _CDF_place_bucket(struct _freeze_entry *entry, const uint32_t *members, uint32_t size,
+                                  uint8_t *taken, uint32_t num_entries)
+{
+  for (uint32_t d = 0; d < MAX_DISPLACEMENT; d++)
+  {
+    uint32_t placed;
+
+    for (placed = 0; placed < size; placed++)
+    {
+      struct _freeze_entry *e = &entry[members[placed]];
+
+      e->slot = _CDF_slot(e->hash, d, num_entries);
+
+      if (taken[e->slot])
+        break;
+
+      taken[e->slot] = 1;
+    }
+
+    if (placed == size)
+      return d;
+
+    while (placed-- > 0)
+      taken[entry[members[placed]].slot] = 0;
+  }
+
+  return MAX_DISPLACEMENT;
+}
+
+/*
+ * Assign every entry a slot of its own, and fill in the displacement
+ * of every bucket
+ *
+ * Parameters:
+ *   entry         The entries
+ *   num_entries   Number of entries, and of slots
+ *   num_buckets   Number of buckets
+ *   seed          Seed for hashing the keys
+ *   displacement  Receives the displacement of each bucket
+ *
+ * Returns: True on success, false if some bucket could not be placed
+ *   with this seed or memory allocation failed
+ */
+static bool _CDF_place(struct _freeze_entry *entry, uint32_t num_entries, uint32_t num_buckets, uint64_t seed,
+                       uint32_t *displacement)
+{
+  uint32_t *start = calloc((size_t)num_buckets + 1, sizeof(uint32_t));
+  uint32_t *members = malloc(sizeof(uint32_t) * (num_entries + 1));
+  uint8_t *taken = calloc(num_entries + 1, 1);
+  bool placed = false;
+
+  if (start == NULL || members == NULL || taken == NULL)
+    goto done;
+
+  // Group the entries by bucket with a counting sort
+  for (uint32_t i = 0; i < num_entries; i++)
+  {
+    entry[i].hash = _CD_hash_seeded(entry[i].key, entry[i].len, seed);
+    start[_CDF_bucket(entry[i].hash, num_buckets) + 1]++;
+  }
+
+  uint32_t max_size = 0;
+
+  for (uint32_t b = 0; b < num_buckets; b++)
+  {
+    if (start[b + 1] > max_size)
+      max_size = start[b + 1];
+
+    start[b + 1] += start[b];
+  }
+
+  // The displacements serve as fill positions until they are assigned
+  memcpy(displacement, start, sizeof(uint32_t) * num_buckets);
+
+  for (uint32_t i = 0; i < num_entries; i++)
+    members[displacement[_CDF_bucket(entry[i].hash, num_buckets)]++] = i;
+
+  // Largest buckets first
+  for (uint32_t size = max_size; size >= 2; size--)
+    for (uint32_t b = 0; b < num_buckets; b++)
+      if (start[b + 1] - start[b] == size)
+      {
+        displacement[b] = _CDF_place_bucket(entry, members + start[b], size, taken, num_entries);
+
+        if (displacement[b] == MAX_DISPLACEMENT)
+          goto done;
+      }
+
+  // Single keys take the remaining slots in order
+  uint32_t free_slot = 0;
+
+  for (uint32_t b = 0; b < num_buckets; b++)
+  {
+    uint32_t size = start[b + 1] - start[b];
+
+    if (size == 1)
+    {
+      while (taken[free_slot])
+        free_slot++;
+
+      entry[members[start[b]]].slot = free_slot;
+      taken[free_slot] = 1;
+      displacement[b] = DIRECT_SLOT | free_slot;
+    }
+    else if (size == 0)
+      displacement[b] = 0;
+  }
+
+  placed = true;
+
+done:
+  free(start);
+  free(members);
+  free(taken);
+  return placed;
+}
+
+// Documented in .h file
+CDictFrozen CD_freeze(CDict dict)
+{
+  if (dict == NULL)
+  {
+    printf("Error: cannot freeze NULL dictionary\n");
+    return NULL;
+  }
+
+  unsigned int num_entries = CD_size(dict);
+
+  if (num_entries >= MAX_FROZEN_ENTRIES)
+  {
+    printf("Error: cannot freeze a dictionary of %u entries\n", num_entries);
+    return NULL;
+  }
+
+  uint32_t num_buckets = (num_entries + KEYS_PER_BUCKET - 1) / KEYS_PER_BUCKET;
+
+  if (num_buckets == 0)
+    num_buckets = 1;
+
+  struct _freeze_state state = {malloc(sizeof(struct _freeze_entry) * (num_entries + 1)), 0, 0};
+  CDictFrozen frozen = calloc(1, sizeof(struct _frozen_dictionary));
+  uint32_t *displacement = malloc(sizeof(uint32_t) * num_buckets);
+
+  if (state.entry == NULL || frozen == NULL || displacement == NULL)
+  {
+    printf("Error: memory allocation failed for frozen dictionary\n");
+    goto error;
+  }
+
+  _CD_foreach_entry(dict, _CDF_collect, &state);
+
+  if (state.blob_size / RECORD_ALIGN > UINT32_MAX)
+  {
+    printf("Error: keys and values too large to freeze\n");
+    goto error;
+  }
+
+  uint64_t seed = FROZEN_SEED;
+  int attempt = 0;
+
+  while (!_CDF_place(state.entry, num_entries, num_buckets, seed, displacement))
+  {
+    if (++attempt == MAX_SEED_ATTEMPTS)
+    {
+      printf("Error: cannot build a perfect hash for the dictionary\n");
+      goto error;
+    }
+
+    seed += FROZEN_SEED;
+  }
+
+  size_t blob_start = _CDF_blob_start(num_buckets, num_entries);
+  char *block = calloc(1, blob_start + state.blob_size);
+
+  if (block == NULL)
+  {
+    printf("Error: memory allocation failed for frozen dictionary\n");
+    goto error;
+  }
+
+  struct _frozen_header *header = (struct _frozen_header *)block;
+  uint32_t *offset = (uint32_t *)(header + 1) + num_buckets;
+  size_t used = 0;
+
+  header->seed = seed;
+  header->num_entries = num_entries;
+  header->num_buckets = num_buckets;
+  header->blob_size = state.blob_size;
+  memcpy(header + 1, displacement, sizeof(uint32_t) * num_buckets);
+
+  for (uint32_t i = 0; i < num_entries; i++)
+  {
+    const struct _freeze_entry *e = &state.entry[i];
+    struct _frozen_record *record = (struct _frozen_record *)(block + blob_start + used);
+
+    record->key_len = (uint32_t)e->len;
+    record->value_len = (uint32_t)strlen(e->value);
+    memcpy(record->data, e->key, e->len);
+    memcpy(record->data + e->len + 1, e->value, record->value_len);
+
+    offset[e->slot] = (uint32_t)(used / RECORD_ALIGN);
+    used += _CDF_record_size(record->key_len, record->value_len);
+  }
+
+  frozen->buffer = block;
+  _CDF_attach(frozen, block);
+
+  free(state.entry);
+  free(displacement);
+  return frozen;
+
+error:
+  free(state.entry);
+  free(displacement);
+  free(frozen);
+  return NULL;
+}
+
+// Documented in .h file
+bool CD_save(CDict dict, const char *path)
+{
+  if (dict == NULL || path == NULL)
+  {
+    printf("Error: cannot save NULL dictionary or to NULL path\n");
+    return false;
+  }
+
+  CDictFrozen frozen = CD_freeze(dict);
+
+  if (frozen == NULL)
+    return false;
+
+  struct _frozen_file_header file_header = {FROZEN_FILE_MAGIC, FROZEN_FILE_VERSION, FROZEN_BYTE_ORDER,
+                                            _CDF_block_size(frozen->header)};
+  size_t tmp_len = strlen(path) + sizeof(".tmp");
+  char *tmp_path = malloc(tmp_len);
+  bool saved = false;
+
+  if (tmp_path == NULL)
+  {
+    printf("Error: memory allocation failed for saving dictionary\n");
+    CDF_free(frozen);
+    return false;
+  }
+
+  snprintf(tmp_path, tmp_len, "%s.tmp", path);
+
+  FILE *file = fopen(tmp_path, "wb");
+
+  if (file == NULL)
+    printf("Error: cannot open [%s] for writing\n", tmp_path);
+  else
+  {
+    saved = fwrite(&file_header, sizeof(file_header), 1, file) == 1 &&
+            fwrite(frozen->buffer, file_header.block_size, 1, file) == 1;
+    saved = (fclose(file) == 0) && saved;
+
+    if (saved && rename(tmp_path, path) != 0)
+      saved = false;
+
+    if (!saved)
+    {
+      printf("Error: cannot write dictionary to [%s]\n", path);
+      remove(tmp_path);
+    }
+  }
+
+  free(tmp_path);
+  CDF_free(frozen);
+  return saved;
+}
+
+/*
+ * Check that a mapped file holds a frozen dictionary this code can
+ * read, without looking at more than the headers
+ *
+ * Parameters:
+ *   mapping  The file contents
+ *   size     The file size
+ *
+ * Returns: An error message, or NULL if the file is usable
+ */
+static const char *_CDF_check_file(const char *mapping, size_t size)
+{
+  const struct _frozen_file_header *file_header = (const struct _frozen_file_header *)mapping;
+
+  if (size < sizeof(*file_header) + sizeof(struct _frozen_header))
+    return "file too short";
+
+  if (memcmp(file_header->magic, FROZEN_FILE_MAGIC, sizeof(file_header->magic)) != 0)
+    return "not a frozen dictionary";
+
+  if (file_header->version != FROZEN_FILE_VERSION)
+    return "unsupported version";
+
+  if (file_header->byte_order != FROZEN_BYTE_ORDER)
+    return "written with a different byte order";
+
+  const struct _frozen_header *header = (const struct _frozen_header *)(file_header + 1);
+  size_t block_size = size - sizeof(*file_header);
+
+  if (header->num_entries >= MAX_FROZEN_ENTRIES || header->num_buckets == 0)
+    return "corrupt header";
+
+  // The sizes in the headers are not trusted until each is known to fit
+  // in what is left of the file, so that no sum of them can wrap
+  size_t blob_start = _CDF_blob_start(header->num_buckets, header->num_entries);
+
+  if (file_header->block_size != block_size || blob_start > block_size ||
+      header->blob_size != block_size - blob_start)
+    return "file size does not match its contents";
+
+  return NULL;
+}
+
+// Documented in .h file
+CDictFrozen CD_open_mmap(const char *path)
+{
+  if (path == NULL)
+  {
+    printf("Error: cannot open NULL path\n");
+    return NULL;
+  }
+
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+
+  if (fd < 0 || fstat(fd, &st) != 0)
+  {
+    printf("Error: cannot open [%s]\n", path);
+
+    if (fd >= 0)
+      close(fd);
+
+    return NULL;
+  }
+
+  size_t size = (size_t)st.st_size;
+  void *mapping = size > 0 ? mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+
+  // The mapping stays valid after the file is closed
+  close(fd);
+
+  const char *error = (mapping == MAP_FAILED) ? "cannot map file" : _CDF_check_file(mapping, size);
+  CDictFrozen dict = NULL;
+
+  if (error == NULL)
+  {
+    dict = calloc(1, sizeof(struct _frozen_dictionary));
+    error = (dict == NULL) ? "memory allocation failed" : NULL;
+  }
+
+  if (error != NULL)
+  {
+    printf("Error: cannot open [%s]: %s\n", path, error);
+
+    if (mapping != MAP_FAILED)
+      munmap(mapping, size);
+
+    return NULL;
+  }
+
+  dict->mapping = mapping;
+  dict->mapping_size = size;
+  _CDF_attach(dict, (const char *)mapping + sizeof(struct _frozen_file_header));
+
+  return dict;
+}
+
+// Documented in .h file
+void CDF_free(CDictFrozen dict)
+{
+  if (dict)
+  {
+    if (dict->mapping != NULL)
+      munmap(dict->mapping, dict->mapping_size);
+
+    free(dict->buffer);
+    free(dict);
+  }
+}
+
+// Documented in .h file
+unsigned int CDF_size(CDictFrozen dict)
+{
+  if (dict == NULL)
+  {
+    printf("Error: cannot get size of NULL dictionary\n");
+    return 0;
+  }
+
+  return dict->header->num_entries;
+}
+
+/*
+ * Return the record in a slot, checking that it lies within the block
+ * and that its key and value are NUL-terminated, since a mapped file
+ * may have been damaged
+ *
+ * Parameters:
+ *   dict   The frozen dictionary
+ *   slot   The slot, less than the number of entries
+ *
+ * Returns: The record, or NULL if it is out of bounds
+ */
+static inline const struct _frozen_record *_CDF_record(CDictFrozen dict, uint32_t slot)
+{
+  size_t offset = (size_t)dict->offset[slot] * RECORD_ALIGN;
+  const struct _frozen_record *record = (const struct _frozen_record *)(dict->blob + offset);
+
+  if (offset + sizeof(struct _frozen_record) > dict->header->blob_size ||
+      _CDF_record_size(record->key_len, record->value_len) > dict->header->blob_size - offset)
+    return NULL;
+
+  // Callers hand the key and value out as C strings
+  if (record->data[record->key_len] != '\0' || record->data[(size_t)record->key_len + 1 + record->value_len] != '\0')
+    return NULL;
+
+  return record;
+}
+
+/*
+ * Find the record of a key: one hash, one slot, one key comparison
+ *
+ * Parameters:
+ *   dict   The frozen dictionary
+ *   key    The key
+ *   len    Length of key in bytes
+ *
+ * Returns: The record holding key, or NULL if not found
+ */
+static const struct _frozen_record *_CDF_find(CDictFrozen dict, const void *key, size_t len)
+{
+  const struct _frozen_header *header = dict->header;
+
+  if (header->num_entries == 0)
+    return NULL;
+
+  uint64_t hash = _CD_hash_seeded(key, len, header->seed);
+  uint32_t d = dict->displacement[_CDF_bucket(hash, header->num_buckets)];
+  uint32_t slot = (d & DIRECT_SLOT) ? d & ~DIRECT_SLOT : _CDF_slot(hash, d, header->num_entries);
+
+  if (slot >= header->num_entries)
+    return NULL;
+
+  const struct _frozen_record *record = _CDF_record(dict, slot);
+
+  if (record == NULL)
+    return NULL;
+
+  // A key that is not in the dictionary lands on some other key's slot
+  if (record->key_len != len || memcmp(record->data, key, len) != 0)
+    return NULL;
+
+  return record;
+}
+
+// Documented in .h file
+bool CDF_contains(CDictFrozen dict, CDictKeyType key)
+{
+  if (dict == NULL || key == NULL)
+  {
+    printf("Contains error: dictionary or key is NULL for [%s]\n", key);
+    return false;
+  }
+
+  return _CDF_find(dict, key, strlen(key)) != NULL;
+}
+
+// Documented in .h file
+bool CDF_contains_n(CDictFrozen dict, const void *key, size_t len)
+{
+  if (dict == NULL || key == NULL)
+  {
+    printf("Contains error: dictionary or key is NULL\n");
+    return false;
+  }
+
+  return _CDF_find(dict, key, len) != NULL;
+}
+
+// Documented in .h file
+CDictValueType CDF_retrieve(CDictFrozen dict, CDictKeyType key)
+{
+  if (dict == NULL || key == NULL)
+  {
+    printf("Retrieve error: dictionary or key is NULL for [%s]\n", key);
+    return INVALID_VALUE;
+  }
+
+  return CDF_retrieve_n(dict, key, strlen(key));
+}
+
+// Documented in .h file
+CDictValueType CDF_retrieve_n(CDictFrozen dict, const void *key, size_t len)
+{
+  if (dict == NULL || key == NULL)
+  {
+    printf("Retrieve error: dictionary or key is NULL\n");
+    return INVALID_VALUE;
+  }
+
+  const struct _frozen_record *record = _CDF_find(dict, key, len);
+
+  if (record == NULL)
+    return INVALID_VALUE;
+
+  return record->data + record->key_len + 1;
+}
+
+// Documented in .h file
+void CDF_foreach(CDictFrozen dict, CD_foreach_callback callback, void *cb_data)
+{
+  if (dict == NULL || callback == NULL)
+    return;
+
+  for (uint32_t i = 0; i < dict->header->num_entries; i++)
+  {
+    const struct _frozen_record *record = _CDF_record(dict, i);
+
+    if (record != NULL)
+      callback(record->data, record->data + record->key_len + 1, cb_data);
+  }
+}
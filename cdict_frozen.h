@@ -0,0 +1,132 @@
+/*
+ * cdict_frozen.h
+ *
+ * Read-only dictionary built from a CDict once all of its entries are
+ * known. Keys are placed with a minimal perfect hash: every key has a
+ * slot of its own and there are exactly as many slots as keys, so a
+ * lookup hashes the key, reads one slot and compares one key, and
+ * never probes. The index takes about 5 bytes per entry, and keys and
+ * values are copied into a single packed block, so a frozen dictionary
+ * usually needs well under half the memory of the CDict it came from.
+ *
+ * A frozen dictionary can also be saved to a file and mapped back into
+ * memory, in which case lookups are served straight from the page
+ * cache and processes mapping the same file share one copy of it.
+ *
+ * Author: Niyomwungeri Parmenide Ishimwe <parmenin@andrew.cmu.edu>
+ */
+#ifndef _CDICT_FROZEN_H_
+#define _CDICT_FROZEN_H_
+
+#include "cdict.h"
+
+typedef struct _frozen_dictionary *CDictFrozen;
+
+
+/*
+ * Build a frozen copy of a dictionary. The copy holds its own keys and
+ * values, so the dictionary may be changed or freed afterwards.
+ *
+ * Parameters:
+ *   dict     The dictionary
+ *
+ * Returns: The new CDictFrozen, or NULL on failure
+ */
+CDictFrozen CD_freeze(CDict dict);
+
+
+/*
+ * Save a frozen copy of a dictionary to a file, for CD_open_mmap. The
+ * file is written under a temporary name and then renamed, so that
+ * processes that have the old file mapped keep a consistent view.
+ *
+ * Parameters:
+ *   dict     The dictionary
+ *   path     The file to write
+ *
+ * Returns: True on success, false on failure
+ */
+bool CD_save(CDict dict, const char *path);
+
+
+/*
+ * Open a file written by CD_save as a frozen dictionary, mapping it
+ * read-only rather than reading it. This takes the same time however
+ * large the file is; entries are paged in as they are looked up.
+ * Files written on a machine with a different byte order or by an
+ * incompatible version are rejected.
+ *
+ * Parameters:
+ *   path     The file
+ *
+ * Returns: The CDictFrozen, or NULL on failure
+ */
+CDictFrozen CD_open_mmap(const char *path);
+
+
+/*
+ * Destroy all memory consumed by this frozen dict, or unmap it if it
+ * was opened with CD_open_mmap
+ *
+ * Parameters:
+ *   dict     The frozen dictionary
+ *
+ * Returns: None
+ */
+void CDF_free(CDictFrozen dict);
+
+
+/*
+ * Returns the number of elements in the frozen dictionary
+ *
+ * Parameters:
+ *   dict     The frozen dictionary
+ *
+ * Returns: the dictionary's size
+ */
+unsigned int CDF_size(CDictFrozen dict);
+
+
+/*
+ * Is key found in frozen dictionary?
+ *
+ * Parameters:
+ *   dict     The frozen dictionary
+ *   key      The key
+ *
+ * Returns: True if key is in dict, false otherwise
+ */
+bool CDF_contains(CDictFrozen dict, CDictKeyType key);
+bool CDF_contains_n(CDictFrozen dict, const void *key, size_t len);
+
+
+/*
+ * Find the value for a given key. The value is NUL-terminated and
+ * remains valid until the frozen dict is freed.
+ *
+ * Parameters:
+ *   dict     The frozen dictionary
+ *   key      The key
+ *
+ * Returns: The value, or INVALID_VALUE if key not found in dict
+ */
+CDictValueType CDF_retrieve(CDictFrozen dict, CDictKeyType key);
+CDictValueType CDF_retrieve_n(CDictFrozen dict, const void *key, size_t len);
+
+
+/*
+ * Iterate through the frozen dictionary, calling the user-specified
+ * callback function for each element, as with CD_foreach. Keys are
+ * always NUL-terminated.
+ *
+ * Parameters:
+ *   dict       The frozen dictionary
+ *   callback   The function to call
+ *   cb_data    Caller data to pass to the function
+ *
+ * Returns: None
+ */
+void CDF_foreach(CDictFrozen dict, CD_foreach_callback callback, void *cb_data);
+
+
+#endif /* _CDICT_FROZEN_H_ */
@@ -0,0 +1,381 @@
+/*
+ * cdict_gen.h
+ *
+ * Dictionaries specialized for one key type and one value type,
+ * generated by a macro, for keys that are not strings. Integer keys
+ * are then stored and compared as integers, and hashed with a few
+ * multiplications rather than formatted as strings and hashed byte by
+ * byte. The tables work as in cdict.c: one control byte per slot,
+ * holding 7 bits of the key's hash, probed a group of 16 at a time,
+ * with deleted slots freed again when no probe can have passed over
+ * them and the table doubled when its load factor exceeds 0.6.
+ *
+ *   CDICT_DEFINE(name, K, V, hash_fn, eq_fn)
+ *
+ * defines the dictionary type name, a pointer like CDict, and the
+ * functions below, all static inline so that the compiler can inline
+ * hash_fn and eq_fn:
+ *
+ *   name name_new()                            NULL on failure
+ *   void name_free(name dict)
+ *   unsigned int name_size(name dict)
+ *   unsigned int name_capacity(name dict)
+ *   bool name_store(name dict, K key, V value) false on failure
+ *   bool name_retrieve(name dict, K key, V *value)
+ *   bool name_contains(name dict, K key)
+ *   bool name_delete(name dict, K key)
+ *   void name_foreach(name dict, void (*callback)(K key, V value, void *cb_data), void *cb_data)
+ *
+ * hash_fn(key) must return a uint64_t whose bits all depend on the
+ * key, and eq_fn(a, b) must be true exactly when two keys are equal.
+ * CDictU64 (uint64_t to uint64_t) and CDictU32Ptr (uint32_t to
+ * void *) are defined at the end of this file.
+ *
+ * Author: Niyomwungeri Parmenide Ishimwe <parmenin@andrew.cmu.edu>
+ */
+#ifndef _CDICT_GEN_H_
+#define _CDICT_GEN_H_
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define CDG_DEFAULT_CAPACITY 8 // must be a power of two
+#define CDG_MAX_CAPACITY (1u << 31)
+#define CDG_REHASH_THRESHOLD 0.6
+#define CDG_GROUP_WIDTH 16
+#define CDG_CTRL_EMPTY ((int8_t)-128)
+#define CDG_CTRL_DELETED ((int8_t)-2)
+#define CDG_NOT_FOUND ((unsigned int)-1)
+
+/*
+ * Hash an integer key. This is the finalizer of MurmurHash3, which
+ * makes every bit of the result depend on every bit of the key.
+ */
+static inline uint64_t CD_hash_u64(uint64_t key)
+{
+  key ^= key >> 33;
+  key *= 0xff51afd7ed558ccdull;
+  key ^= key >> 33;
+  key *= 0xc4ceb9fe1a85ec53ull;
+  return key ^ (key >> 33);
+}
+
+static inline uint64_t CD_hash_u32(uint32_t key)
+{
+  return CD_hash_u64(key);
+}
+
+// Key comparison for integer and pointer keys
+#define CD_eq_int(a, b) ((a) == (b))
+
+/*
+ * Compare each of the CDG_GROUP_WIDTH control bytes starting at group
+ * against value
+ *
+ * Returns: A bitmask with bit i set if group[i] == value
+ */
+static inline uint32_t _CDG_group_match(const int8_t *group, int8_t value)
+{
+#ifdef __SSE2__
+  __m128i ctrl = _mm_loadu_si128((const __m128i *)group);
+  return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8(value)));
+#else
+  uint32_t match = 0;
+
+  for (unsigned int i = 0; i < CDG_GROUP_WIDTH; i++)
+    if (group[i] == value)
+      match |= 1u << i;
+
+  return match;
+#endif
+}
+
+/*
+ * Set the control byte of a slot, and its mirror after the end of the
+ * control array
+ */
+static inline void _CDG_set_ctrl(int8_t *ctrl, unsigned int capacity, unsigned int index, int8_t value)
+{
+  ctrl[index] = value;
+
+  for (unsigned int i = index + capacity; i < capacity + CDG_GROUP_WIDTH; i += capacity)
+    ctrl[i] = value;
+}
+
+/*
+ * Can a slot being deleted be marked empty rather than deleted? Only
+ * if the run of non-empty slots around it is shorter than a group, as
+ * in _CD_can_erase_to_empty.
+ */
+static inline bool _CDG_can_erase_to_empty(const int8_t *ctrl, unsigned int capacity, unsigned int index)
+{
+  if (capacity <= CDG_GROUP_WIDTH)
+    return true;
+
+  unsigned int before = (index - CDG_GROUP_WIDTH) & (capacity - 1);
+  uint32_t empty_before = _CDG_group_match(ctrl + before, CDG_CTRL_EMPTY);
+  uint32_t empty_after = _CDG_group_match(ctrl + index, CDG_CTRL_EMPTY);
+
+  if (empty_before == 0 || empty_after == 0)
+    return false;
+
+  unsigned int run = __builtin_ctz(empty_after) + (__builtin_clz(empty_before) - (32 - CDG_GROUP_WIDTH));
+
+  return run < CDG_GROUP_WIDTH;
+}
+
+/*
+ * Find the first empty slot on the probe sequence of a hash
+ */
+static inline unsigned int _CDG_find_empty(const int8_t *ctrl, unsigned int capacity, uint64_t hash)
+{
+  unsigned int mask = capacity - 1;
+  unsigned int pos = (unsigned int)(hash >> 7) & mask;
+
+  for (unsigned int step = CDG_GROUP_WIDTH;; step += CDG_GROUP_WIDTH)
+  {
+    uint32_t empty = _CDG_group_match(ctrl + pos, CDG_CTRL_EMPTY);
+
+    if (empty)
+      return (pos + __builtin_ctz(empty)) & mask;
+
+    pos = (pos + step) & mask;
+  }
+}
+
+#define CDICT_DEFINE(name, K, V, hash_fn, eq_fn)                                                          \
+  struct _##name##_slot                                                                                   \
+  {                                                                                                       \
+    K key;                                                                                                \
+    V value;                                                                                              \
+  };                                                                                                      \
+                                                                                                          \
+  typedef struct _##name                                                                                  \
+  {                                                                                                       \
+    unsigned int num_stored;                                                                              \
+    unsigned int num_deleted;                                                                             \
+    unsigned int capacity;                                                                                \
+    int8_t *ctrl;                /* capacity + CDG_GROUP_WIDTH control bytes */                           \
+    struct _##name##_slot *slot; /* one block shared with ctrl */                                         \
+  } *name;                                                                                                \
+                                                                                                          \
+  static inline bool _##name##_alloc(name dict, unsigned int capacity)                                    \
+  {                                                                                                       \
+    size_t slot_bytes = sizeof(struct _##name##_slot) * capacity;                                         \
+    struct _##name##_slot *slot = malloc(slot_bytes + capacity + CDG_GROUP_WIDTH);                        \
+                                                                                                          \
+    if (slot == NULL)                                                                                     \
+      return false;                                                                                       \
+                                                                                                          \
+    dict->num_stored = 0;                                                                                 \
+    dict->num_deleted = 0;                                                                                \
+    dict->capacity = capacity;                                                                            \
+    dict->slot = slot;                                                                                    \
+    dict->ctrl = (int8_t *)slot + slot_bytes;                                                             \
+    memset(dict->ctrl, CDG_CTRL_EMPTY, capacity + CDG_GROUP_WIDTH);                                       \
+                                                                                                          \
+    return true;                                                                                          \
+  }                                                                                                       \
+                                                                                                          \
+  static inline name name##_new()                                                                         \
+  {                                                                                                       \
+    name dict = malloc(sizeof(struct _##name));                                                           \
+                                                                                                          \
+    if (dict == NULL || !_##name##_alloc(dict, CDG_DEFAULT_CAPACITY))                                     \
+    {                                                                                                     \
+      printf("Error: memory allocation failed for dictionary\n");                                         \
+      free(dict);                                                                                         \
+      return NULL;                                                                                        \
+    }                                                                                                     \
+                                                                                                          \
+    return dict;                                                                                          \
+  }                                                                                                       \
+                                                                                                          \
+  static inline void name##_free(name dict)                                                               \
+  {                                                                                                       \
+    if (dict)                                                                                             \
+    {                                                                                                     \
+      free(dict->slot);                                                                                   \
+      free(dict);                                                                                         \
+    }                                                                                                     \
+  }                                                                                                       \
+                                                                                                          \
+  static inline unsigned int name##_size(name dict) { return dict ? dict->num_stored : 0; }               \
+                                                                                                          \
+  static inline unsigned int name##_capacity(name dict)                                                   \
+  {                                                                                                       \
+    if (dict == NULL)                                                                                     \
+    {                                                                                                     \
+      printf("Error: cannot get capacity of NULL dictionary\n");                                          \
+      return 0;                                                                                           \
+    }                                                                                                     \
+                                                                                                          \
+    return dict->capacity;                                                                                \
+  }                                                                                                       \
+                                                                                                          \
+  /* Returns the index of the slot holding key, or CDG_NOT_FOUND */                                       \
+  static inline unsigned int _##name##_find(name dict, K key, uint64_t hash)                              \
+  {                                                                                                       \
+    unsigned int mask = dict->capacity - 1;                                                               \
+    unsigned int pos = (unsigned int)(hash >> 7) & mask;                                                  \
+    unsigned int step = 0;                                                                                \
+                                                                                                          \
+    for (unsigned int probed = 0; probed < dict->capacity; probed += CDG_GROUP_WIDTH)                     \
+    {                                                                                                     \
+      const int8_t *group = dict->ctrl + pos;                                                             \
+                                                                                                          \
+      for (uint32_t match = _CDG_group_match(group, (int8_t)(hash & 0x7f)); match; match &= match - 1)    \
+      {                                                                                                   \
+        unsigned int index = (pos + __builtin_ctz(match)) & mask;                                         \
+                                                                                                          \
+        if (eq_fn(dict->slot[index].key, key))                                                            \
+          return index;                                                                                   \
+      }                                                                                                   \
+                                                                                                          \
+      if (_CDG_group_match(group, CDG_CTRL_EMPTY))                                                        \
+        return CDG_NOT_FOUND;                                                                             \
+                                                                                                          \
+      step += CDG_GROUP_WIDTH;                                                                            \
+      pos = (pos + step) & mask;                                                                          \
+    }                                                                                                     \
+                                                                                                          \
+    return CDG_NOT_FOUND;                                                                                 \
+  }                                                                                                       \
+                                                                                                          \
+  static inline void _##name##_insert(name dict, K key, V value, uint64_t hash)                           \
+  {                                                                                                       \
+    unsigned int index = _CDG_find_empty(dict->ctrl, dict->capacity, hash);                               \
+                                                                                                          \
+    _CDG_set_ctrl(dict->ctrl, dict->capacity, index, (int8_t)(hash & 0x7f));                              \
+    dict->slot[index].key = key;                                                                          \
+    dict->slot[index].value = value;                                                                      \
+    dict->num_stored++;                                                                                   \
+  }                                                                                                       \
+                                                                                                          \
+  /* Drop tombstones, doubling unless at most half the threshold is live; on failure keep going */        \
+  static inline void _##name##_rehash(name dict)                                                          \
+  {                                                                                                       \
+    struct _##name old = *dict;                                                                           \
+    bool purge = old.num_stored <= old.capacity * CDG_REHASH_THRESHOLD / 2;                               \
+    unsigned int capacity = purge ? old.capacity : old.capacity * 2;                                      \
+                                                                                                          \
+    if ((!purge && old.capacity >= CDG_MAX_CAPACITY) || !_##name##_alloc(dict, capacity))                 \
+    {                                                                                                     \
+      printf("Error: memory allocation failed for new dictionary slot\n");                                \
+      *dict = old;                                                                                        \
+      return;                                                                                             \
+    }                                                                                                     \
+                                                                                                          \
+    for (unsigned int i = 0; i < old.capacity; i++)                                                       \
+      if (old.ctrl[i] >= 0)                                                                               \
+        _##name##_insert(dict, old.slot[i].key, old.slot[i].value, hash_fn(old.slot[i].key));             \
+                                                                                                          \
+    free(old.slot);                                                                                       \
+  }                                                                                                       \
+                                                                                                          \
+  static inline bool name##_store(name dict, K key, V value)                                              \
+  {                                                                                                       \
+    if (dict == NULL)                                                                                     \
+    {                                                                                                     \
+      printf("Store error: dictionary is NULL\n");                                                        \
+      return false;                                                                                       \
+    }                                                                                                     \
+                                                                                                          \
+    uint64_t hash = hash_fn(key);                                                                         \
+    unsigned int index = _##name##_find(dict, key, hash);                                                 \
+                                                                                                          \
+    if (index != CDG_NOT_FOUND)                                                                           \
+    {                                                                                                     \
+      dict->slot[index].value = value;                                                                    \
+      return true;                                                                                        \
+    }                                                                                                     \
+                                                                                                          \
+    if (dict->num_stored + dict->num_deleted + 1 > dict->capacity * CDG_REHASH_THRESHOLD)                 \
+      _##name##_rehash(dict);                                                                             \
+                                                                                                          \
+    /* A failed rehash leaves the table fuller, but one slot must stay empty */                           \
+    if (dict->num_stored + dict->num_deleted + 1 >= dict->capacity)                                       \
+      return false;                                                                                       \
+                                                                                                          \
+    _##name##_insert(dict, key, value, hash);                                                             \
+    return true;                                                                                          \
+  }                                                                                                       \
+                                                                                                          \
+  static inline bool name##_retrieve(name dict, K key, V *value)                                          \
+  {                                                                                                       \
+    if (dict == NULL)                                                                                     \
+    {                                                                                                     \
+      printf("Retrieve error: dictionary is NULL\n");                                                     \
+      return false;                                                                                       \
+    }                                                                                                     \
+                                                                                                          \
+    unsigned int index = _##name##_find(dict, key, hash_fn(key));                                         \
+                                                                                                          \
+    if (index == CDG_NOT_FOUND)                                                                           \
+      return false;                                                                                       \
+                                                                                                          \
+    if (value != NULL)                                                                                    \
+      *value = dict->slot[index].value;                                                                   \
+                                                                                                          \
+    return true;                                                                                          \
+  }                                                                                                       \
+                                                                                                          \
+  static inline bool name##_contains(name dict, K key)                                                    \
+  {                                                                                                       \
+    if (dict == NULL)                                                                                     \
+    {                                                                                                     \
+      printf("Contains error: dictionary is NULL\n");                                                     \
+      return false;                                                                                       \
+    }                                                                                                     \
+                                                                                                          \
+    return _##name##_find(dict, key, hash_fn(key)) != CDG_NOT_FOUND;                                      \
+  }                                                                                                       \
+                                                                                                          \
+  static inline bool name##_delete(name dict, K key)                                                      \
+  {                                                                                                       \
+    if (dict == NULL)                                                                                     \
+    {                                                                                                     \
+      printf("Delete error: dictionary is NULL\n");                                                       \
+      return false;                                                                                       \
+    }                                                                                                     \
+                                                                                                          \
+    unsigned int index = _##name##_find(dict, key, hash_fn(key));                                         \
+                                                                                                          \
+    if (index == CDG_NOT_FOUND)                                                                           \
+      return false;                                                                                       \
+                                                                                                          \
+    dict->num_stored--;                                                                                   \
+                                                                                                          \
+    if (_CDG_can_erase_to_empty(dict->ctrl, dict->capacity, index))                                       \
+      _CDG_set_ctrl(dict->ctrl, dict->capacity, index, CDG_CTRL_EMPTY);                                   \
+    else                                                                                                  \
+    {                                                                                                     \
+      _CDG_set_ctrl(dict->ctrl, dict->capacity, index, CDG_CTRL_DELETED);                                 \
+      dict->num_deleted++;                                                                                \
+    }                                                                                                     \
+                                                                                                          \
+    return true;                                                                                          \
+  }                                                                                                       \
+                                                                                                          \
+  static inline void name##_foreach(name dict, void (*callback)(K key, V value, void *cb_data),           \
+                                    void *cb_data)                                                        \
+  {                                                                                                       \
+    if (dict == NULL || callback == NULL)                                                                 \
+      return;                                                                                             \
+                                                                                                          \
+    for (unsigned int i = 0; i < dict->capacity; i++)                                                     \
+      if (dict->ctrl[i] >= 0)                                                                             \
+        callback(dict->slot[i].key, dict->slot[i].value, cb_data);                                        \
+  }
+
+CDICT_DEFINE(CDictU64, uint64_t, uint64_t, CD_hash_u64, CD_eq_int)
+CDICT_DEFINE(CDictU32Ptr, uint32_t, void *, CD_hash_u32, CD_eq_int)
+
+#endif /* _CDICT_GEN_H_ */
@@ -0,0 +1,196 @@
+/*
+ * cdict_internal.h
+ *
+ * Functions shared by the CDict modules that are not part of the
+ * public interface. They skip the argument checks done by the public
+ * functions, and take keys that have already been hashed, so a caller
+ * that needs the hash for its own purposes only computes it once.
+ * While a dictionary is small (see CD_new) the hash is not used, and
+ * may be anything.
+ *
+ * Author: Niyomwungeri Parmenide Ishimwe <parmenin@andrew.cmu.edu>
+ */
+#ifndef _CDICT_INTERNAL_H_
+#define _CDICT_INTERNAL_H_
+
+#include "cdict.h"
+
+// Storage for owned keys and values; see cdict.c
+struct _arena_chunk;
+
+/*
+ * Return a pseudorandom hash of a key with good distribution
+ * properties. This is wyhash (final version 4, public domain): the
+ * key is consumed 8 or 16 bytes at a time and mixed with 64-bit
+ * multiplies, so short keys cost a handful of instructions.
+ *
+ * Parameters:
+ *   key   The bytes to be hashed
+ *   len   Number of bytes in key
+ *
+ * Returns: The full 64-bit hash; mask it with capacity-1 to get a slot
+ */
+uint64_t _CD_hash(const void *key, size_t len);
+
+
+/*
+ * Hash a key as _CD_hash does, but starting from a seed, so that
+ * different seeds give independent hashes of the same key.
+ * _CD_hash(key, len) is _CD_hash_seeded(key, len, 0).
+ *
+ * Parameters:
+ *   key   The bytes to be hashed
+ *   len   Number of bytes in key
+ *   seed  Any value
+ *
+ * Returns: The full 64-bit hash
+ */
+uint64_t _CD_hash_seeded(const void *key, size_t len, uint64_t seed);
+
+
+// A seed for the built-in hash: the 128-bit SipHash key
+struct _hash_seed
+{
+  uint64_t k0;
+  uint64_t k1;
+};
+
+
+/*
+ * Return a keyed hash of a key. This is SipHash-1-3: slower than
+ * _CD_hash, but without the seed nobody can find keys whose hashes
+ * collide, however many hashes of other keys they see.
+ *
+ * Parameters:
+ *   key   The bytes to be hashed
+ *   len   Number of bytes in key
+ *   seed  The key for the hash
+ *
+ * Returns: The full 64-bit hash
+ */
+uint64_t _CD_siphash(const void *key, size_t len, const struct _hash_seed *seed);
+
+
+/*
+ * Draw a random seed for _CD_siphash, different for every call
+ *
+ * Parameters:
+ *   seed  Set to the new seed
+ *
+ * Returns: None
+ */
+void _CD_random_seed(struct _hash_seed *seed);
+
+
+/*
+ * Allocate a dictionary built to a set of options, which must be in
+ * range, as CD_new_with_options does
+ *
+ * Parameters:
+ *   options  The options
+ *   seed     Seed for the built-in hash, or NULL to take it from
+ *            options, so that dictionaries can share one
+ *
+ * Returns: The new CDict, or NULL on failure
+ */
+CDict _CD_new(const CDictOptions *options, const struct _hash_seed *seed);
+
+
+/*
+ * Hash a key with the dictionary's hash function
+ *
+ * Parameters:
+ *   dict  The dictionary
+ *   key   The key
+ *   len   Length of key in bytes
+ *
+ * Returns: The full hash of key
+ */
+uint64_t _CD_key_hash(CDict dict, const void *key, size_t len);
+
+
+/*
+ * Store a key, value pair whose key has already been hashed
+ *
+ * Parameters:
+ *   dict     The dictionary
+ *   key      The key
+ *   len      Length of key in bytes
+ *   hash     The full hash of key
+ *   value    The value
+ *
+ * Returns: None
+ */
+void _CD_store(CDict dict, const void *key, size_t len, uint64_t hash, CDictValueType value);
+
+
+/*
+ * Find the value for a key that has already been hashed
+ *
+ * Parameters:
+ *   dict     The dictionary
+ *   key      The key
+ *   len      Length of key in bytes
+ *   hash     The full hash of key
+ *
+ * Returns: The value, or INVALID_VALUE if key not found in dict
+ */
+CDictValueType _CD_retrieve(CDict dict, const void *key, size_t len, uint64_t hash);
+
+
+/*
+ * Delete a key that has already been hashed
+ *
+ * Parameters:
+ *   dict     The dictionary
+ *   key      The key
+ *   len      Length of key in bytes
+ *   hash     The full hash of key
+ *
+ * Returns: True if key was found and deleted, false otherwise
+ */
+bool _CD_delete(CDict dict, const void *key, size_t len, uint64_t hash);
+
+
+typedef void (*_CD_entry_callback)(const void *key, size_t len, CDictValueType value, void *cb_data);
+
+/*
+ * Call a function for every entry in the dictionary, as CD_foreach
+ * does, also passing the length of each key
+ *
+ * Parameters:
+ *   dict       The dictionary
+ *   callback   The function to call
+ *   cb_data    Caller data to pass to the function
+ *
+ * Returns: None
+ */
+void _CD_foreach_entry(CDict dict, _CD_entry_callback callback, void *cb_data);
+
+
+/*
+ * Copy a string into an arena, preceded by its length. The copy stays
+ * where it is until the whole arena is freed.
+ *
+ * Parameters:
+ *   arena    The arena's first chunk; NULL for an empty arena
+ *   str      The string, which may contain NULs
+ *   len      Length of str in bytes, not counting any terminating NUL
+ *
+ * Returns: The NUL-terminated copy, or NULL if memory allocation failed
+ */
+const char *_CD_arena_copy(struct _arena_chunk **arena, const void *str, size_t len);
+
+
+/*
+ * Free every chunk of an arena, leaving it empty
+ *
+ * Parameters:
+ *   arena    The arena's first chunk
+ *
+ * Returns: None
+ */
+void _CD_arena_free(struct _arena_chunk **arena);
+
+
+#endif /* _CDICT_INTERNAL_H_ */
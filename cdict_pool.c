@@ -0,0 +1,247 @@
+/*
+ * cdict_pool.c
+ *
+ * Pool allocator recycling freed blocks by size class.
+ *
+ * Author: Niyomwungeri Parmenide Ishimwe <parmenin@andrew.cmu.edu>
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "cdict_pool.h"
+
+#define DEFAULT_MAX_CACHED (64 * 1024 * 1024)
+
+/*
+ * Size classes. Class 0 holds blocks of up to MIN_BLOCK_SHIFT bytes;
+ * above that, the sizes between two powers of two are split into
+ * SUBCLASSES classes, so a block is never more than 1/SUBCLASSES
+ * larger than the size asked for. Every class size is a multiple of
+ * 16 bytes. Blocks over 1 << MAX_BLOCK_SHIFT bytes are not pooled.
+ */
+#define MIN_BLOCK_SHIFT 7
+#define MAX_BLOCK_SHIFT 26
+#define SUBCLASSES 8
+#define NUM_CLASSES (1 + (MAX_BLOCK_SHIFT - MIN_BLOCK_SHIFT) * SUBCLASSES)
+
+// Blocks up to SLAB_MAX_BLOCK bytes are carved from slabs of SLAB_SIZE
+#define SLAB_SIZE (64 * 1024)
+#define SLAB_MAX_BLOCK 4096
+#define SLAB_HEADER_SIZE 16 // keeps the blocks after it 16-byte aligned
+
+struct _free_block
+{
+  struct _free_block *next;
+};
+
+struct _slab
+{
+  struct _slab *next;
+};
+
+struct _pool
+{
+  pthread_mutex_t lock;
+  size_t max_cached;   // most bytes of large blocks to keep
+  size_t cached;       // bytes of large blocks on the free lists
+  char *slab_pos;      // unused part of the newest slab
+  char *slab_end;
+  struct _slab *slabs;
+  struct _free_block *free_list[NUM_CLASSES];
+};
+
+/*
+ * Find the size class of an allocation
+ *
+ * Parameters:
+ *   size     Bytes requested
+ *   block    Set to the size of the class's blocks
+ *
+ * Returns: The class, or -1 if blocks of this size are not pooled
+ */
+static int _CDP_size_class(size_t size, size_t *block)
+{
+  if (size <= (1u << MIN_BLOCK_SHIFT))
+  {
+    *block = 1u << MIN_BLOCK_SHIFT;
+    return 0;
+  }
+
+  if (size > (1u << MAX_BLOCK_SHIFT))
+    return -1;
+
+  // 2^shift < size <= 2^(shift + 1), in steps of 2^shift / SUBCLASSES
+  int shift = 63 - __builtin_clzll(size - 1);
+  size_t step = ((size_t)1 << shift) / SUBCLASSES;
+
+  *block = (size + step - 1) & ~(step - 1);
+
+  return (shift - MIN_BLOCK_SHIFT) * SUBCLASSES + (int)(*block / step) - SUBCLASSES;
+}
+
+// Returns the size of the blocks of a class
+static size_t _CDP_class_size(int size_class)
+{
+  if (size_class == 0)
+    return 1u << MIN_BLOCK_SHIFT;
+
+  int shift = MIN_BLOCK_SHIFT + (size_class - 1) / SUBCLASSES;
+  size_t step = ((size_t)1 << shift) / SUBCLASSES;
+
+  return step * (SUBCLASSES + 1 + (size_class - 1) % SUBCLASSES);
+}
+
+/*
+ * Carve a block out of the newest slab, starting a new one if it is
+ * full. Whatever is left of a full slab goes unused. The pool must be
+ * locked.
+ *
+ * Parameters:
+ *   pool     The pool
+ *   block    Size of the block, at most SLAB_MAX_BLOCK
+ *
+ * Returns: The block, or NULL if memory allocation failed
+ */
+static void *_CDP_carve(CDictPool pool, size_t block)
+{
+  if ((size_t)(pool->slab_end - pool->slab_pos) < block)
+  {
+    struct _slab *slab = malloc(SLAB_SIZE);
+
+    if (slab == NULL)
+      return NULL;
+
+    slab->next = pool->slabs;
+    pool->slabs = slab;
+    pool->slab_pos = (char *)slab + SLAB_HEADER_SIZE;
+    pool->slab_end = (char *)slab + SLAB_SIZE;
+  }
+
+  void *ptr = pool->slab_pos;
+  pool->slab_pos += block;
+
+  return ptr;
+}
+
+static void *_CDP_alloc(size_t size, void *ctx)
+{
+  CDictPool pool = ctx;
+  size_t block;
+  int size_class = _CDP_size_class(size, &block);
+
+  if (size_class < 0)
+    return malloc(size);
+
+  pthread_mutex_lock(&pool->lock);
+
+  struct _free_block *ptr = pool->free_list[size_class];
+
+  if (ptr != NULL)
+  {
+    pool->free_list[size_class] = ptr->next;
+
+    if (block > SLAB_MAX_BLOCK)
+      pool->cached -= block;
+  }
+  else if (block <= SLAB_MAX_BLOCK)
+    ptr = _CDP_carve(pool, block);
+
+  pthread_mutex_unlock(&pool->lock);
+
+  // Large blocks are allocated outside the lock
+  if (ptr == NULL && block > SLAB_MAX_BLOCK)
+    ptr = malloc(block);
+
+  return ptr;
+}
+
+static void _CDP_free(void *ptr, size_t size, void *ctx)
+{
+  CDictPool pool = ctx;
+  size_t block;
+  int size_class = _CDP_size_class(size, &block);
+
+  if (ptr == NULL)
+    return;
+
+  if (size_class < 0)
+  {
+    free(ptr);
+    return;
+  }
+
+  pthread_mutex_lock(&pool->lock);
+
+  // Blocks from slabs always go back on their free list
+  bool keep = block <= SLAB_MAX_BLOCK || pool->cached + block <= pool->max_cached;
+
+  if (keep)
+  {
+    struct _free_block *freed = ptr;
+
+    freed->next = pool->free_list[size_class];
+    pool->free_list[size_class] = freed;
+
+    if (block > SLAB_MAX_BLOCK)
+      pool->cached += block;
+  }
+
+  pthread_mutex_unlock(&pool->lock);
+
+  if (!keep)
+    free(ptr);
+}
+
+// Documented in .h file
+CDictPool CDP_new(size_t max_cached)
+{
+  CDictPool pool = calloc(1, sizeof(struct _pool));
+
+  if (pool == NULL)
+  {
+    printf("Error: memory allocation failed for pool\n");
+    return NULL;
+  }
+
+  pthread_mutex_init(&pool->lock, NULL);
+  pool->max_cached = max_cached ? max_cached : DEFAULT_MAX_CACHED;
+
+  return pool;
+}
+
+// Documented in .h file
+void CDP_free(CDictPool pool)
+{
+  if (pool)
+  {
+    // Small blocks live in the slabs; large ones were malloced singly
+    for (int i = 0; i < NUM_CLASSES; i++)
+      if (_CDP_class_size(i) > SLAB_MAX_BLOCK)
+        while (pool->free_list[i] != NULL)
+        {
+          struct _free_block *next = pool->free_list[i]->next;
+          free(pool->free_list[i]);
+          pool->free_list[i] = next;
+        }
+
+    while (pool->slabs != NULL)
+    {
+      struct _slab *next = pool->slabs->next;
+      free(pool->slabs);
+      pool->slabs = next;
+    }
+
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+  }
+}
+
+// Documented in .h file
+CDictAllocator CDP_allocator(CDictPool pool)
+{
+  CDictAllocator allocator = {_CDP_alloc, _CDP_free, pool};
+
+  return allocator;
+}
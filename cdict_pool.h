@@ -0,0 +1,62 @@
+/*
+ * cdict_pool.h
+ *
+ * Pool allocator for dictionaries that are created and freed often.
+ * Blocks are grouped into size classes, eight to each power of two,
+ * and a freed block is kept on its class's free list to be handed out
+ * again rather than returned to malloc. Small blocks, such as the
+ * dictionary structures themselves and the slot arrays of small
+ * tables, are carved out of larger slabs; bigger slot arrays are
+ * allocated one by one, and kept for reuse up to a limit.
+ *
+ * A pool may be shared by dictionaries used from different threads,
+ * as it has a lock of its own; to avoid contending for that lock,
+ * give each thread a pool of its own.
+ *
+ * Author: Niyomwungeri Parmenide Ishimwe <parmenin@andrew.cmu.edu>
+ */
+#ifndef _CDICT_POOL_H_
+#define _CDICT_POOL_H_
+
+#include "cdict.h"
+
+typedef struct _pool *CDictPool;
+
+
+/*
+ * Returns a new, empty pool
+ *
+ * Parameters:
+ *   max_cached   Most bytes of large freed blocks to keep for reuse;
+ *                0 for the default. Small blocks are always kept.
+ *
+ * Returns: The new CDictPool, or NULL on failure
+ */
+CDictPool CDP_new(size_t max_cached);
+
+
+/*
+ * Destroy the pool and all memory it holds. Every dictionary
+ * allocated from it must have been freed first.
+ *
+ * Parameters:
+ *   pool     The pool
+ *
+ * Returns: None
+ */
+void CDP_free(CDictPool pool);
+
+
+/*
+ * Returns an allocator drawing from the pool, for
+ * CD_new_with_allocator
+ *
+ * Parameters:
+ *   pool     The pool
+ *
+ * Returns: The allocator
+ */
+CDictAllocator CDP_allocator(CDictPool pool);
+
+
+#endif /* _CDICT_POOL_H_ */
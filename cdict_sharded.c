@@ -0,0 +1,361 @@
+/*
+ * cdict_sharded.c
+ *
+ * Thread-safe dictionary built from independent CDict shards, each
+ * with its own reader/writer lock.
+ *
+ * Author: Niyomwungeri Parmenide Ishimwe <parmenin@andrew.cmu.edu>
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "cdict_sharded.h"
+#include "cdict_internal.h"
+
+#define DEFAULT_NUM_SHARDS 64
+#define MAX_NUM_SHARDS 65536
+
+#define CACHE_LINE_SIZE 64
+
+// Each shard sits on its own cache line(s), so that taking one lock
+// does not disturb threads working on neighbouring shards
+struct _shard
+{
+  pthread_rwlock_t lock;
+  CDict dict;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+struct _sharded_dictionary
+{
+  unsigned int num_shards;  // always a power of two
+  unsigned int shard_shift; // top hash bits select the shard
+  struct _shard *shard;
+};
+
+/*
+ * Allocate a sharded dictionary
+ *
+ * Parameters:
+ *   num_shards  Requested number of shards; 0 for the default
+ *   flags       Any of the CD_NEW_ flags, for every shard
+ *
+ * Returns: The new CDictSharded, or NULL on failure
+ */
+static CDictSharded _CDS_new(unsigned int num_shards, unsigned int flags)
+{
+  if (num_shards == 0)
+    num_shards = DEFAULT_NUM_SHARDS;
+
+  if (num_shards > MAX_NUM_SHARDS)
+  {
+    printf("Error: cannot create a dictionary with %u shards\n", num_shards);
+    return NULL;
+  }
+
+  CDictSharded dict = (CDictSharded)malloc(sizeof(struct _sharded_dictionary));
+
+  if (dict == NULL)
+  {
+    printf("Error: memory allocation failed for dictionary\n");
+    return NULL;
+  }
+
+  dict->num_shards = 1;
+  dict->shard_shift = 64;
+
+  while (dict->num_shards < num_shards)
+  {
+    dict->num_shards *= 2;
+    dict->shard_shift--;
+  }
+
+  dict->shard = aligned_alloc(CACHE_LINE_SIZE, sizeof(struct _shard) * dict->num_shards);
+
+  if (dict->shard == NULL)
+  {
+    printf("Error: memory allocation failed for dictionary shards\n");
+    free(dict);
+    return NULL;
+  }
+
+  // Keys are hashed once to pick a shard, so every shard needs the
+  // same seed
+  CDictOptions options = {.flags = flags};
+  struct _hash_seed seed;
+
+  _CD_random_seed(&seed);
+
+  for (unsigned int i = 0; i < dict->num_shards; i++)
+  {
+    dict->shard[i].dict = _CD_new(&options, &seed);
+
+    if (dict->shard[i].dict == NULL)
+    {
+      dict->num_shards = i;
+      CDS_free(dict);
+      return NULL;
+    }
+
+    pthread_rwlock_init(&dict->shard[i].lock, NULL);
+  }
+
+  return dict;
+}
+
+// Documented in .h file
+CDictSharded CDS_new(unsigned int num_shards)
+{
+  return _CDS_new(num_shards, 0);
+}
+
+// Documented in .h file
+CDictSharded CDS_new_owned(unsigned int num_shards)
+{
+  return _CDS_new(num_shards, CD_NEW_OWNED);
+}
+
+// Documented in .h file
+void CDS_free(CDictSharded dict)
+{
+  if (dict)
+  {
+    for (unsigned int i = 0; i < dict->num_shards; i++)
+    {
+      pthread_rwlock_destroy(&dict->shard[i].lock);
+      CD_free(dict->shard[i].dict);
+    }
+
+    free(dict->shard);
+    free(dict);
+  }
+}
+
+/*
+ * Hash a key and find the shard it belongs to. Every shard hashes with
+ * the same function and seed, so the hash is passed on to the shard
+ * rather than computed again. The shard is chosen by the top bits of
+ * the hash, while tables index by the low bits, so keys stay evenly
+ * spread within each shard.
+ *
+ * Parameters:
+ *   dict     The dictionary
+ *   key      The key
+ *   len      Length of key in bytes
+ *   hash     Set to the full hash of key
+ *
+ * Returns: The shard
+ */
+static struct _shard *_CDS_shard_for(CDictSharded dict, const void *key, size_t len, uint64_t *hash)
+{
+  *hash = _CD_key_hash(dict->shard[0].dict, key, len);
+
+  // Shifting a 64-bit value by 64 is undefined, hence the special case
+  if (dict->num_shards == 1)
+    return &dict->shard[0];
+
+  return &dict->shard[*hash >> dict->shard_shift];
+}
+
+// Documented in .h file
+unsigned int CDS_size(CDictSharded dict)
+{
+  if (dict == NULL)
+  {
+    printf("Error: cannot get size of NULL dictionary\n");
+    return 0;
+  }
+
+  unsigned int size = 0;
+
+  for (unsigned int i = 0; i < dict->num_shards; i++)
+  {
+    pthread_rwlock_rdlock(&dict->shard[i].lock);
+    size += CD_size(dict->shard[i].dict);
+    pthread_rwlock_unlock(&dict->shard[i].lock);
+  }
+
+  return size;
+}
+
+// Documented in .h file
+unsigned int CDS_capacity(CDictSharded dict)
+{
+  if (dict == NULL)
+  {
+    printf("Error: cannot get capacity of NULL dictionary\n");
+    return 0;
+  }
+
+  unsigned int capacity = 0;
+
+  for (unsigned int i = 0; i < dict->num_shards; i++)
+  {
+    pthread_rwlock_rdlock(&dict->shard[i].lock);
+    capacity += CD_capacity(dict->shard[i].dict);
+    pthread_rwlock_unlock(&dict->shard[i].lock);
+  }
+
+  return capacity;
+}
+
+// Documented in .h file
+bool CDS_contains(CDictSharded dict, CDictKeyType key)
+{
+  if (dict == NULL || key == NULL)
+  {
+    printf("Contains error: dictionary or key is NULL for [%s]\n", key);
+    return false;
+  }
+
+  return CDS_contains_n(dict, key, strlen(key));
+}
+
+// Documented in .h file
+bool CDS_contains_n(CDictSharded dict, const void *key, size_t len)
+{
+  if (dict == NULL || key == NULL)
+  {
+    printf("Contains error: dictionary or key is NULL\n");
+    return false;
+  }
+
+  uint64_t hash;
+  struct _shard *shard = _CDS_shard_for(dict, key, len, &hash);
+
+  pthread_rwlock_rdlock(&shard->lock);
+  bool found = _CD_retrieve(shard->dict, key, len, hash) != INVALID_VALUE;
+  pthread_rwlock_unlock(&shard->lock);
+
+  return found;
+}
+
+// Documented in .h file
+void CDS_store(CDictSharded dict, CDictKeyType key, CDictValueType value)
+{
+  if (dict == NULL || key == NULL || value == NULL)
+  {
+    printf("Store error: dictionary or key or value is NULL for [%s]\n", key);
+    return;
+  }
+
+  CDS_store_n(dict, key, strlen(key), value);
+}
+
+// Documented in .h file
+void CDS_store_n(CDictSharded dict, const void *key, size_t len, CDictValueType value)
+{
+  if (dict == NULL || key == NULL || value == NULL)
+  {
+    printf("Store error: dictionary or key or value is NULL\n");
+    return;
+  }
+
+  uint64_t hash;
+  struct _shard *shard = _CDS_shard_for(dict, key, len, &hash);
+
+  pthread_rwlock_wrlock(&shard->lock);
+  _CD_store(shard->dict, key, len, hash, value);
+  pthread_rwlock_unlock(&shard->lock);
+}
+
+// Documented in .h file
+CDictValueType CDS_retrieve(CDictSharded dict, CDictKeyType key)
+{
+  if (dict == NULL || key == NULL)
+  {
+    printf("Retrieve error: dictionary or key is NULL for [%s]\n", key);
+    return INVALID_VALUE;
+  }
+
+  return CDS_retrieve_n(dict, key, strlen(key));
+}
+
+// Documented in .h file
+CDictValueType CDS_retrieve_n(CDictSharded dict, const void *key, size_t len)
+{
+  if (dict == NULL || key == NULL)
+  {
+    printf("Retrieve error: dictionary or key is NULL\n");
+    return INVALID_VALUE;
+  }
+
+  uint64_t hash;
+  struct _shard *shard = _CDS_shard_for(dict, key, len, &hash);
+
+  pthread_rwlock_rdlock(&shard->lock);
+  CDictValueType value = _CD_retrieve(shard->dict, key, len, hash);
+  pthread_rwlock_unlock(&shard->lock);
+
+  return value;
+}
+
+// Documented in .h file
+void CDS_delete(CDictSharded dict, CDictKeyType key)
+{
+  if (dict == NULL || key == NULL)
+  {
+    printf("Delete error: dictionary or key is NULL for [%s]\n", key);
+    return;
+  }
+
+  CDS_delete_n(dict, key, strlen(key));
+}
+
+// Documented in .h file
+void CDS_delete_n(CDictSharded dict, const void *key, size_t len)
+{
+  if (dict == NULL || key == NULL)
+  {
+    printf("Delete error: dictionary or key is NULL\n");
+    return;
+  }
+
+  uint64_t hash;
+  struct _shard *shard = _CDS_shard_for(dict, key, len, &hash);
+
+  pthread_rwlock_wrlock(&shard->lock);
+  bool deleted = _CD_delete(shard->dict, key, len, hash);
+  pthread_rwlock_unlock(&shard->lock);
+
+  if (!deleted)
+    printf("Error: cannot delete key [%.*s] not found\n", (int)len, (const char *)key);
+}
+
+// Documented in .h file
+double CDS_load_factor(CDictSharded dict)
+{
+  if (dict == NULL)
+  {
+    printf("Error: dictionary is NULL or has zero capacity\n");
+    return 0;
+  }
+
+  double used = 0;
+  unsigned int capacity = 0;
+
+  for (unsigned int i = 0; i < dict->num_shards; i++)
+  {
+    pthread_rwlock_rdlock(&dict->shard[i].lock);
+    used += CD_load_factor(dict->shard[i].dict) * CD_capacity(dict->shard[i].dict);
+    capacity += CD_capacity(dict->shard[i].dict);
+    pthread_rwlock_unlock(&dict->shard[i].lock);
+  }
+
+  return used / capacity;
+}
+
+// Documented in .h file
+void CDS_foreach(CDictSharded dict, CD_foreach_callback callback, void *cb_data)
+{
+  if (dict == NULL || callback == NULL)
+    return;
+
+  for (unsigned int i = 0; i < dict->num_shards; i++)
+  {
+    pthread_rwlock_rdlock(&dict->shard[i].lock);
+    CD_foreach(dict->shard[i].dict, callback, cb_data);
+    pthread_rwlock_unlock(&dict->shard[i].lock);
+  }
+}
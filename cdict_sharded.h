@@ -0,0 +1,169 @@
+/*
+ * cdict_sharded.h
+ *
+ * Thread-safe dictionary that partitions its keys across a number of
+ * independent CDicts (shards) by hash, each protected by its own
+ * reader/writer lock. Threads working on keys in different shards
+ * never contend, and each shard grows on its own.
+ *
+ * The functions mirror those in cdict.h, and may be called from any
+ * number of threads at once.
+ *
+ * Author: Niyomwungeri Parmenide Ishimwe <parmenin@andrew.cmu.edu>
+ */
+#ifndef _CDICT_SHARDED_H_
+#define _CDICT_SHARDED_H_
+
+#include "cdict.h"
+
+typedef struct _sharded_dictionary *CDictSharded;
+
+
+/*
+ * Returns a newly-allocated and newly-initialized sharded dictionary
+ * with no elements.
+ *
+ * Parameters:
+ *   num_shards  The number of shards, rounded up to a power of two; 0
+ *               selects a default suitable for a few dozen threads
+ *
+ * Returns: The new CDictSharded, or NULL on failure
+ */
+CDictSharded CDS_new(unsigned int num_shards);
+
+
+/*
+ * Returns a newly-allocated sharded dictionary whose shards own their
+ * keys and values, as with CD_new_owned. This is usually what threads
+ * sharing a dictionary want, since no thread then has to keep its
+ * strings alive for the others.
+ *
+ * Parameters:
+ *   num_shards  The number of shards, as for CDS_new
+ *
+ * Returns: The new CDictSharded, or NULL on failure
+ */
+CDictSharded CDS_new_owned(unsigned int num_shards);
+
+
+/*
+ * Destroy all memory consumed by this dict. No other thread may be
+ * using it.
+ *
+ * Parameters:
+ *   dict     The dictionary
+ *
+ * Returns: None
+ */
+void CDS_free(CDictSharded dict);
+
+
+/*
+ * Returns the number of elements in the dictionary. Shards are counted
+ * one at a time, so concurrent stores and deletes may or may not be
+ * reflected.
+ *
+ * Parameters:
+ *   dict     The dictionary
+ *
+ * Returns: the dictionary's size
+ */
+unsigned int CDS_size(CDictSharded dict);
+
+
+/*
+ * Returns the total capacity of all the shards
+ *
+ * Parameters:
+ *   dict     The dictionary
+ *
+ * Returns: the dictionary's capacity
+ */
+unsigned int CDS_capacity(CDictSharded dict);
+
+
+/*
+ * Is key found in dictionary?
+ *
+ * Parameters:
+ *   dict     The dictionary
+ *   key      The key
+ *
+ * Returns: True if key is in dict, false otherwise
+ */
+bool CDS_contains(CDictSharded dict, CDictKeyType key);
+bool CDS_contains_n(CDictSharded dict, const void *key, size_t len);
+
+
+/*
+ * Store the supplied key, value pair in the dictionary. If key is
+ * already present, its value is overwritten.
+ *
+ * Parameters:
+ *   dict     The dictionary
+ *   key      The key
+ *   value    The value
+ *
+ * Returns: None
+ */
+void CDS_store(CDictSharded dict, CDictKeyType key, CDictValueType value);
+void CDS_store_n(CDictSharded dict, const void *key, size_t len, CDictValueType value);
+
+
+/*
+ * Find the value for a given key. The value remains valid after the
+ * call returns for as long as CD_retrieve's would: until the dict is
+ * freed if it owns its values, or for as long as the caller keeps the
+ * stored value alive otherwise.
+ *
+ * Parameters:
+ *   dict     The dictionary
+ *   key      The key
+ *
+ * Returns: The value, or INVALID_VALUE if key not found in dict
+ */
+CDictValueType CDS_retrieve(CDictSharded dict, CDictKeyType key);
+CDictValueType CDS_retrieve_n(CDictSharded dict, const void *key, size_t len);
+
+
+/*
+ * Delete a key from the dictionary
+ *
+ * Parameters:
+ *   dict     The dictionary
+ *   key      The key
+ *
+ * Returns: None
+ */
+void CDS_delete(CDictSharded dict, CDictKeyType key);
+void CDS_delete_n(CDictSharded dict, const void *key, size_t len);
+
+
+/*
+ * Return the load factor for the dictionary as a whole
+ *
+ * Parameters:
+ *   dict     The dictionary
+ *
+ * Returns: The combined load factor of the shards
+ */
+double CDS_load_factor(CDictSharded dict);
+
+
+/*
+ * Iterate through the dictionary, calling the user-specified callback
+ * function for each element, as with CD_foreach. Each shard is locked
+ * for reading while its elements are visited, so the callback must not
+ * modify the dictionary.
+ *
+ * Parameters:
+ *   dict       The dictionary
+ *   callback   The function to call
+ *   cb_data    Caller data to pass to the function
+ *
+ * Returns: None
+ */
+void CDS_foreach(CDictSharded dict, CD_foreach_callback callback, void *cb_data);
+
+
+#endif /* _CDICT_SHARDED_H_ */
@@ -11,8 +11,16 @@
 #include <inttypes.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "cdict.h"
+#include "cdict_sharded.h"
+#include "cdict_concurrent.h"
+#include "cdict_frozen.h"
+#include "cdict_pool.h"
+#include "cdict_gen.h"
 
 // Checks that value is true; if not, prints a failure message and
 // returns 0 from this function
@@ -438,53 +446,2412 @@ test_error:
 
 int test_capacity_limits()
 {
+  CDict dict = CD_new_owned();
+
+  for (int i = 0; i < 100 + 10; i++)
+  {
+    char key[15];
+    sprintf(key, "key%d", i);
+    CD_store(dict, key, "value");
+  }
+
+  test_assert(CD_capacity(dict) >= 100);
+  CD_free(dict);
+  return 1;
+test_error:
+  CD_free(dict);
+  return 0;
+}
+
+int test_null_values()
+{
+  CDict dict = CD_new();
+  CD_store(dict, "key1", NULL);
+  test_assert(CD_retrieve(dict, "key1") == NULL);
+  CD_free(dict);
+  return 1;
+test_error:
+  CD_free(dict);
+  return 0;
+}
+
+int test_handle_collisions()
+{
+  CDict dict = CD_new();
+  char *key1 = "key1";
+  char *key2 = "key2";
+
+  // Assuming these two keys hash to the same slot
+  CD_store(dict, key1, "value1");
+  CD_store(dict, key2, "value2");
+
+  test_assert(strcmp(CD_retrieve(dict, key1), "value1") == 0);
+  test_assert(strcmp(CD_retrieve(dict, key2), "value2") == 0);
+
+  CD_free(dict);
+  return 1;
+
+test_error:
+  CD_free(dict);
+  return 0;
+}
+
+/*
+ * A deliberately poor hash function: every key of the same length
+ * collides
+ */
+uint64_t length_hash(const void *key, size_t len)
+{
+  return len;
+}
+
+/*
+ * Tests a dictionary using a caller-supplied hash function, where
+ * colliding keys must still be told apart
+ *
+ * Returns: 1 if all tests pass, 0 otherwise
+ */
+int test_custom_hash()
+{
+  CDict dict = CD_new_with_hash(length_hash);
+
+  for (int i = 0; i < team_data_len; i++)
+    CD_store(dict, team_data[i].city, team_data[i].team);
+
+  test_assert(CD_size(dict) == team_data_len);
+
+  for (int i = 0; i < team_data_len; i++)
+  {
+    const char *tm = CD_retrieve(dict, team_data[i].city);
+    test_assert(tm != NULL);
+    test_assert(strcmp(tm, team_data[i].team) == 0);
+  }
+
+  test_assert(CD_retrieve(dict, "Seattle") == NULL);
+
+  for (int i = 0; i < team_data_len; i += 2)
+    CD_delete(dict, team_data[i].city);
+
+  for (int i = 0; i < team_data_len; i++)
+    test_assert(CD_contains(dict, team_data[i].city) == (i % 2 == 1));
+
+  // capacities stay powers of two as the table grows
+  test_assert((CD_capacity(dict) & (CD_capacity(dict) - 1)) == 0);
+
+  CD_free(dict);
+  return 1;
+
+test_error:
+  CD_free(dict);
+  return 0;
+}
+
+// The keys visited by CD_foreach, in order
+struct key_order
+{
+  CDictKeyType keys[32];
+  int n;
+};
+
+void order_callback(CDictKeyType key, CDictValueType value, void *cb_data)
+{
+  struct key_order *order = cb_data;
+
+  if (order->n < 32)
+    order->keys[order->n++] = key;
+}
+
+/*
+ * Tests that every dictionary seeds the built-in hash at random, so
+ * that the same keys land in different slots, unless the seed is
+ * fixed with CD_NEW_DETERMINISTIC
+ *
+ * Returns: 1 if all tests pass, 0 otherwise
+ */
+int test_seeded_hash()
+{
+  char keys[32][16];
+  CDictOptions seeded = {.flags = CD_NEW_DETERMINISTIC, .seed = 42};
+  CDictOptions reseeded = {.flags = CD_NEW_DETERMINISTIC, .seed = 43};
+  CDict dicts[5] = {CD_new(), CD_new(), CD_new_with_options(&seeded), CD_new_with_options(&seeded),
+                    CD_new_with_options(&reseeded)};
+  struct key_order order[5] = {{{0}}};
+
+  for (int i = 0; i < 32; i++)
+  {
+    snprintf(keys[i], sizeof(keys[i]), "key%d", i);
+
+    for (int d = 0; d < 5; d++)
+      CD_store(dicts[d], keys[i], keys[i]);
+  }
+
+  for (int d = 0; d < 5; d++)
+  {
+    CD_foreach(dicts[d], order_callback, &order[d]);
+    test_assert(order[d].n == 32);
+
+    for (int i = 0; i < 32; i++)
+      test_assert(CD_retrieve(dicts[d], keys[i]) == keys[i]);
+  }
+
+  // With 32 keys in 64 slots, two seeds giving the same order is
+  // vanishingly unlikely
+  test_assert(memcmp(order[0].keys, order[1].keys, sizeof(order[0].keys)) != 0);
+  test_assert(memcmp(order[2].keys, order[3].keys, sizeof(order[2].keys)) == 0);
+  test_assert(memcmp(order[2].keys, order[4].keys, sizeof(order[2].keys)) != 0);
+
+  for (int d = 0; d < 5; d++)
+    CD_free(dicts[d]);
+
+  return 1;
+
+test_error:
+  for (int d = 0; d < 5; d++)
+    CD_free(dicts[d]);
+
+  return 0;
+}
+
+/*
+ * Tests probing across many groups of slots: every key has the same
+ * length, so with length_hash they all start probing at the same slot
+ *
+ * Returns: 1 if all tests pass, 0 otherwise
+ */
+int test_long_probe_sequences()
+{
+  const int num_items = 1000;
+  char keys[1000][8];
+  CDict dict = CD_new_with_hash(length_hash);
+
+  for (int i = 0; i < num_items; i++)
+  {
+    snprintf(keys[i], sizeof(keys[i]), "Key%04d", i);
+    CD_store(dict, keys[i], keys[i]);
+  }
+
+  test_assert(CD_size(dict) == num_items);
+
+  for (int i = 0; i < num_items; i += 3)
+    CD_delete(dict, keys[i]);
+
+  for (int i = 0; i < num_items; i++)
+  {
+    const char *expected = (i % 3 == 0) ? NULL : keys[i];
+    test_assert(CD_retrieve(dict, keys[i]) == expected);
+  }
+
+  test_assert(!CD_contains(dict, "Key9999"));
+
+  CD_free(dict);
+  return 1;
+
+test_error:
+  CD_free(dict);
+  return 0;
+}
+
+/*
+ * Tests that constant insert/delete churn on a small live set does not
+ * make the table grow: deleted slots must not pile up as tombstones
+ *
+ * Returns: 1 if all tests pass, 0 otherwise
+ */
+int test_delete_churn()
+{
+  const int num_items = 20000;
+  const int live = 50;
+  char(*keys)[16] = malloc(num_items * sizeof(*keys));
+  CDict dict = CD_new();
+
+  for (int i = 0; i < num_items; i++)
+  {
+    snprintf(keys[i], sizeof(keys[i]), "session%d", i);
+    CD_store(dict, keys[i], "active");
+
+    if (i >= live)
+      CD_delete(dict, keys[i - live]);
+  }
+
+  test_assert(CD_size(dict) == live);
+  test_assert(CD_capacity(dict) <= 1024);
+
+  for (int i = num_items - live; i < num_items; i++)
+    test_assert(CD_contains(dict, keys[i]));
+
+  CD_free(dict);
+  free(keys);
+  return 1;
+
+test_error:
+  CD_free(dict);
+  free(keys);
+  return 0;
+}
+
+/*
+ * Callback for foreach that counts the elements it is called for
+ */
+void count_callback(CDictKeyType key, CDictValueType value, void *cb_data)
+{
+  (*(int *)cb_data)++;
+}
+
+// CD_foreach_parallel callback counting entries from several threads
+void atomic_count_callback(CDictKeyType key, CDictValueType value, void *cb_data)
+{
+  __atomic_fetch_add((int *)cb_data, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Tests iterators, range-split iterators and the parallel foreach,
+ * including on a dictionary part way through an incremental rehash
+ *
+ * Returns: 1 if all tests pass, 0 otherwise
+ */
+int test_iterators()
+{
+  CDict dict = CD_new_owned();
+  CDict seen = CD_new_owned();
+  CDictIterator iter;
+  char key[32];
+  int count = 0;
+
+  CD_iter_begin(dict, &iter);
+  test_assert(!CD_iter_next(&iter));
+
+  for (int i = 0; i < 100000; i++)
+  {
+    snprintf(key, sizeof(key), "key%d", i);
+    CD_store(dict, key, key);
+  }
+
+  CD_iter_begin(dict, &iter);
+
+  while (CD_iter_next(&iter))
+  {
+    test_assert(iter.key_len == strlen(iter.key));
+    test_assert(strcmp(iter.key, iter.value) == 0);
+    count++;
+  }
+
+  test_assert(count == 100000);
+
+  // Stopping early
+  count = 0;
+  CD_iter_begin(dict, &iter);
+
+  while (count < 10 && CD_iter_next(&iter))
+    count++;
+
+  test_assert(count == 10);
+
+  // The parts of a split cover every entry once
+  for (unsigned int part = 0; part < 7; part++)
+  {
+    CD_iter_range(dict, part, 7, &iter);
+
+    while (CD_iter_next(&iter))
+    {
+      test_assert(!CD_contains(seen, iter.key));
+      CD_store(seen, iter.key, iter.value);
+    }
+  }
+
+  test_assert(CD_size(seen) == 100000);
+
+  count = 0;
+  CD_foreach_parallel(dict, 4, atomic_count_callback, &count);
+  test_assert(count == 100000);
+
+  count = 0;
+  CD_foreach_parallel(dict, 0, atomic_count_callback, &count);
+  test_assert(count == 100000);
+
+  CD_iter_range(dict, 3, 3, &iter);
+  test_assert(!CD_iter_next(&iter));
+  CD_free(dict);
+
+  // The tenth store starts an incremental rehash, leaving every entry
+  // in the old table until the next store or delete
+  dict = CD_new_incremental();
+  const char *keys[] = {"a", "b", "c", "d", "e", "f", "g", "h", "i", "j"};
+
+  for (int i = 0; i < 10; i++)
+    CD_store(dict, keys[i], keys[i]);
+
+  test_assert(CD_capacity(dict) == 32);
+
+  count = 0;
+  CD_iter_begin(dict, &iter);
+
+  while (CD_iter_next(&iter))
+    count++;
+
+  test_assert(count == 10);
+
+  count = 0;
+
+  for (unsigned int part = 0; part < 3; part++)
+    for (CD_iter_range(dict, part, 3, &iter); CD_iter_next(&iter);)
+      count++;
+
+  test_assert(count == 10);
+
+  count = 0;
+  CD_foreach_parallel(dict, 3, atomic_count_callback, &count);
+  test_assert(count == 10);
+
+  CD_free(dict);
+  CD_free(seen);
+  return 1;
+
+test_error:
+  CD_free(dict);
+  CD_free(seen);
+  return 0;
+}
+
+/*
+ * Tests a dictionary small enough to keep its entries without a table,
+ * and its move to a table once it outgrows them
+ *
+ * Returns: 1 if all tests pass, 0 otherwise
+ */
+int test_small_dict()
+{
+  CDict dict = CD_new();
+  CDictStats stats;
+  CDictIterator iter;
+  int count = 0;
+
+  test_assert(CD_capacity(dict) == 8);
+
+  for (int i = 0; i < 4; i++)
+    CD_store(dict, team_data[i].city, team_data[i].team);
+
+  CD_store(dict, team_data[0].city, team_data[1].team);
+  test_assert(CD_size(dict) == 4);
+  test_assert(CD_capacity(dict) == 8);
+  test_assert(CD_retrieve(dict, team_data[0].city) == team_data[1].team);
+  test_assert(CD_contains(dict, team_data[3].city));
+  test_assert(!CD_contains(dict, team_data[4].city));
+
+  CD_stats(dict, &stats);
+  test_assert(stats.size == 4);
+  test_assert(stats.slot_bytes == 0);
+
+  for (CD_iter_begin(dict, &iter); CD_iter_next(&iter);)
+    count++;
+
+  test_assert(count == 4);
+
+  CD_delete(dict, team_data[1].city);
+  test_assert(CD_size(dict) == 3);
+  test_assert(!CD_contains(dict, team_data[1].city));
+  test_assert(CD_retrieve(dict, team_data[3].city) == team_data[3].team);
+
+  // The fifth key moves every entry into a table
+  CD_store(dict, team_data[1].city, team_data[1].team);
+  CD_store(dict, team_data[4].city, team_data[4].team);
+  test_assert(CD_size(dict) == 5);
+  test_assert(CD_capacity(dict) == 16);
+  CD_stats(dict, &stats);
+  test_assert(stats.slot_bytes > 0);
+
+  for (int i = 1; i < 5; i++)
+    test_assert(CD_retrieve(dict, team_data[i].city) == team_data[i].team);
+
+  test_assert(CD_retrieve(dict, team_data[0].city) == team_data[1].team);
+  CD_free(dict);
+
+  // Owned keys are copied while small too
+  char key[16];
+  dict = CD_new_owned();
+
+  for (int i = 0; i < 6; i++)
+  {
+    snprintf(key, sizeof(key), "key%d", i);
+    CD_store(dict, key, key);
+  }
+
+  for (int i = 0; i < 6; i++)
+  {
+    snprintf(key, sizeof(key), "key%d", i);
+    test_assert(strcmp(CD_retrieve(dict, key), key) == 0);
+  }
+
+  CD_free(dict);
+
+  // Reserving room for a few entries keeps a dictionary small
+  dict = CD_new_with_capacity(3);
+  CD_reserve(dict, 4);
+  CD_stats(dict, &stats);
+  test_assert(stats.slot_bytes == 0);
+  CD_store_n(dict, "a\0b", 3, "embedded");
+  test_assert(CD_retrieve_n(dict, "a\0b", 3) != NULL);
+  test_assert(CD_retrieve_n(dict, "a\0c", 3) == NULL);
+  CD_reserve(dict, 5);
+  CD_stats(dict, &stats);
+  test_assert(stats.slot_bytes > 0);
+  test_assert(strcmp(CD_retrieve_n(dict, "a\0b", 3), "embedded") == 0);
+
+  CD_free(dict);
+  return 1;
+
+test_error:
+  CD_free(dict);
+  return 0;
+}
+
+// Allocator that counts what it hands out, for test_allocator
+typedef struct
+{
+  int num_allocs;
+  int num_frees;
+  size_t live_bytes;
+} alloc_count_t;
+
+void *counting_alloc(size_t size, void *ctx)
+{
+  alloc_count_t *count = ctx;
+
+  count->num_allocs++;
+  count->live_bytes += size;
+  return malloc(size);
+}
+
+void counting_free(void *ptr, size_t size, void *ctx)
+{
+  alloc_count_t *count = ctx;
+
+  count->num_frees++;
+  count->live_bytes -= size;
+  free(ptr);
+}
+
+/*
+ * Tests dictionaries using a caller-supplied allocator and the pool
+ * allocator
+ *
+ * Returns: 1 if all tests pass, 0 otherwise
+ */
+int test_allocator()
+{
+  alloc_count_t count = {0, 0, 0};
+  CDictAllocator allocator = {counting_alloc, counting_free, &count};
+  CDict dict = CD_new_with_allocator(&allocator);
+  CDictPool pool = NULL;
+  char(*keys)[16] = malloc(1000 * sizeof(*keys));
+
+  for (int i = 0; i < 1000; i++)
+  {
+    snprintf(keys[i], sizeof(keys[i]), "key%d", i);
+    CD_store(dict, keys[i], keys[i]);
+  }
+
+  // The structure, the first table and each larger one
+  test_assert(count.num_allocs > 2);
+  test_assert(count.live_bytes > 1000 * sizeof(CDictKeyType));
+
+  for (int i = 0; i < 1000; i++)
+    test_assert(CD_retrieve(dict, keys[i]) == keys[i]);
+
+  CD_free(dict);
+  test_assert(count.num_frees == count.num_allocs);
+  test_assert(count.live_bytes == 0);
+
+  // A pool hands freed blocks out again
+  pool = CDP_new(0);
+  allocator = CDP_allocator(pool);
+  dict = CD_new_with_allocator(&allocator);
+
+  for (int i = 0; i < 1000; i++)
+    CD_store(dict, keys[i], keys[i]);
+
+  CDict first = dict;
+  CD_free(dict);
+
+  for (int round = 0; round < 3; round++)
+  {
+    dict = CD_new_with_allocator(&allocator);
+    test_assert(dict == first);
+
+    for (int i = 0; i < 1000; i++)
+      CD_store(dict, keys[i], keys[i]);
+
+    for (int i = 0; i < 1000; i++)
+      test_assert(CD_retrieve(dict, keys[i]) == keys[i]);
+
+    CD_free(dict);
+  }
+
+  // Large blocks beyond the pool's limit go back to malloc
+  CDP_free(pool);
+  pool = CDP_new(1);
+  allocator = CDP_allocator(pool);
+  dict = CD_new_with_allocator(&allocator);
+
+  for (int i = 0; i < 1000; i++)
+    CD_store(dict, keys[i], keys[i]);
+
+  CD_free(dict);
+  CDP_free(pool);
+  free(keys);
+  return 1;
+
+test_error:
+  CD_free(dict);
+  CDP_free(pool);
+  free(keys);
+  return 0;
+}
+
+// A dictionary with fixed-size keys, for test_generated_dicts
+typedef struct
+{
+  char bytes[12];
+} fixed_key_t;
+
+static inline uint64_t fixed_key_hash(fixed_key_t key)
+{
+  uint64_t low;
+  uint32_t high;
+
+  memcpy(&low, key.bytes, sizeof(low));
+  memcpy(&high, key.bytes + sizeof(low), sizeof(high));
+  return CD_hash_u64(low ^ ((uint64_t)high << 32 | high));
+}
+
+#define fixed_key_eq(a, b) (memcmp((a).bytes, (b).bytes, sizeof((a).bytes)) == 0)
+
+CDICT_DEFINE(CDictFixed, fixed_key_t, int, fixed_key_hash, fixed_key_eq)
+
+// A dictionary whose keys land in consecutive slots, for test_generated_dicts
+#define seq_key_hash(key) ((uint64_t)(key) << 7)
+
+CDICT_DEFINE(CDictSeq, uint64_t, uint64_t, seq_key_hash, CD_eq_int)
+
+void sum_u64_callback(uint64_t key, uint64_t value, void *cb_data)
+{
+  *(uint64_t *)cb_data += value - key;
+}
+
+/*
+ * Tests the dictionaries generated by CDICT_DEFINE
+ *
+ * Returns: 1 if all tests pass, 0 otherwise
+ */
+int test_generated_dicts()
+{
+  const uint64_t num_items = 100000;
+  CDictU64 dict = CDictU64_new();
+  CDictU32Ptr ptrs = CDictU32Ptr_new();
+  CDictFixed fixed = CDictFixed_new();
+  CDictSeq seq = CDictSeq_new();
+  uint64_t value = 0;
+
+  // Keys that differ only in their high bits must not collide
+  for (uint64_t i = 0; i < num_items; i++)
+    test_assert(CDictU64_store(dict, i << 40, (i << 40) + 1));
+
+  test_assert(CDictU64_size(dict) == num_items);
+  test_assert(CDictU64_capacity(dict) * 0.6 >= num_items);
+
+  for (uint64_t i = 0; i < num_items; i++)
+  {
+    test_assert(CDictU64_retrieve(dict, i << 40, &value));
+    test_assert(value == (i << 40) + 1);
+  }
+
+  test_assert(!CDictU64_retrieve(dict, 1, &value));
+  test_assert(!CDictU64_contains(dict, num_items << 40));
+
+  for (uint64_t i = 0; i < num_items; i += 2)
+    test_assert(CDictU64_delete(dict, i << 40));
+
+  test_assert(!CDictU64_delete(dict, 0));
+  test_assert(CDictU64_size(dict) == num_items / 2);
+
+  for (uint64_t i = 0; i < num_items; i++)
+    test_assert(CDictU64_contains(dict, i << 40) == (i % 2 == 1));
+
+  // Overwriting keeps the size
+  test_assert(CDictU64_store(dict, 1ull << 40, 7));
+  test_assert(CDictU64_size(dict) == num_items / 2);
+  test_assert(CDictU64_retrieve(dict, 1ull << 40, &value) && value == 7);
+
+  value = 0;
+  CDictU64_foreach(dict, sum_u64_callback, &value);
+  test_assert(value == num_items / 2 - 1 + 7 - (1ull << 40));
+
+  // Deleting and storing many times over must not wear the table out
+  for (uint64_t round = 0; round < 20; round++)
+    for (uint64_t i = 1; i < num_items; i += 2)
+    {
+      test_assert(CDictU64_delete(dict, i << 40));
+      test_assert(CDictU64_store(dict, i << 40, round));
+    }
+
+  test_assert(CDictU64_size(dict) == num_items / 2);
+
+  // A sliding window of keys packed into one run leaves tombstones
+  // behind it, which are purged at the same capacity once the 100 live
+  // keys fit in half the threshold, rather than doubling the table
+  for (uint64_t i = 0; i < num_items; i++)
+  {
+    test_assert(CDictSeq_store(seq, i, i));
+
+    if (i >= 100)
+      test_assert(CDictSeq_delete(seq, i - 100));
+  }
+
+  test_assert(CDictSeq_size(seq) == 100);
+  test_assert(CDictSeq_capacity(seq) == 512);
+
+  // A NULL dictionary is reported rather than dereferenced
+  test_assert(!CDictU64_store(NULL, 1, 1));
+  test_assert(!CDictU64_retrieve(NULL, 1, &value));
+  test_assert(!CDictU64_contains(NULL, 1));
+  test_assert(!CDictU64_delete(NULL, 1));
+  test_assert(CDictU64_size(NULL) == 0);
+  test_assert(CDictU64_capacity(NULL) == 0);
+  CDictU64_foreach(NULL, sum_u64_callback, &value);
+
+  for (uint32_t i = 0; i < 1000; i++)
+    test_assert(CDictU32Ptr_store(ptrs, i, &team_data[i % team_data_len]));
+
+  void *team = NULL;
+
+  test_assert(CDictU32Ptr_retrieve(ptrs, 999, &team));
+  test_assert(team == &team_data[999 % team_data_len]);
+
+  fixed_key_t key = {"abcdefghijk"};
+  int number = 0;
+
+  test_assert(CDictFixed_store(fixed, key, 42));
+  key.bytes[10] = 'K';
+  test_assert(!CDictFixed_contains(fixed, key));
+  key.bytes[10] = 'k';
+  test_assert(CDictFixed_retrieve(fixed, key, &number) && number == 42);
+
+  CDictU64_free(dict);
+  CDictU32Ptr_free(ptrs);
+  CDictFixed_free(fixed);
+  CDictSeq_free(seq);
+  return 1;
+
+test_error:
+  CDictU64_free(dict);
+  CDictU32Ptr_free(ptrs);
+  CDictFixed_free(fixed);
+  CDictSeq_free(seq);
+  return 0;
+}
+
+/*
+ * Tests the statistics reported by CD_stats
+ *
+ * Returns: 1 if all tests pass, 0 otherwise
+ */
+int test_stats()
+{
+  CDict dict = CD_new_owned();
+  CDictStats stats;
+  char key[32];
+
+  for (int i = 0; i < 1000; i++)
+  {
+    snprintf(key, sizeof(key), "key%d", i);
+    CD_store(dict, key, "value");
+  }
+
+  for (int i = 0; i < 1000; i++)
+  {
+    snprintf(key, sizeof(key), "key%d", i);
+    test_assert(CD_contains(dict, key));
+
+    snprintf(key, sizeof(key), "missing%d", i);
+    test_assert(!CD_contains(dict, key));
+  }
+
+  for (int i = 0; i < 1000; i += 2)
+  {
+    snprintf(key, sizeof(key), "key%d", i);
+    CD_delete(dict, key);
+  }
+
+  CD_stats(dict, &stats);
+
+  test_assert(stats.size == 500);
+  test_assert(stats.capacity == 2048);
+  test_assert(stats.tombstone_ratio == (double)stats.num_deleted / stats.capacity);
+  test_assert(stats.slot_bytes >= stats.capacity * (sizeof(CDictKeyType) + sizeof(CDictValueType)));
+  test_assert(stats.owned_bytes > 1000 * strlen("key999"));
+  test_assert(stats.mapped_bytes == 0);
+
+  if (stats.counting)
+  {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+
+    for (int i = 0; i < CD_STATS_PROBE_BUCKETS; i++)
+    {
+      hits += stats.hit_probes[i];
+      misses += stats.miss_probes[i];
+    }
+
+    // Each store and delete looks its key up first
+    test_assert(hits == 1000 + 500);
+    test_assert(misses == 1000 + 1000);
+    test_assert(stats.max_hit_probes >= 1);
+    test_assert(stats.max_miss_probes >= stats.max_hit_probes || stats.max_miss_probes >= 1);
+    test_assert(stats.num_rehashes == 8);
+    test_assert(stats.rehash_seconds > 0);
+  }
+  else
+    test_assert(stats.num_rehashes == 0 && stats.hit_probes[0] == 0);
+
+  CD_free(dict);
+  return 1;
+
+test_error:
+  CD_free(dict);
+  return 0;
+}
+
+/*
+ * Hash for test_purge_and_shrink: keys "A<n>" start probing at slot 0
+ * and keys "B<n>" at slot 32, in a table of 64 slots, with n as the
+ * 7 bits kept in the control byte
+ */
+uint64_t region_hash(const void *key, size_t len)
+{
+  const char *str = key;
+
+  return ((uint64_t)(str[0] == 'A' ? 0 : 32) << 7) | (atoi(str + 1) & 0x7f);
+}
+
+/*
+ * Tests that stores reuse deleted slots, that a table holding mostly
+ * tombstones is purged rather than grown, and that tables shrink after
+ * mass deletes, but not below a reserved capacity
+ *
+ * Returns: 1 if all tests pass, 0 otherwise
+ */
+int test_purge_and_shrink()
+{
+  const int num_items = 10000;
+  char(*keys)[16] = malloc(num_items * sizeof(*keys));
+  CDict dict = CD_new_with_capacity(30);
+  CDictStats stats;
+
+  test_assert(CD_capacity(dict) == 64);
+  CD_free(dict);
+
+  // One long run of colliding keys leaves tombstones when deleted
+  dict = CD_new_with_hash(region_hash);
+  CD_reserve(dict, 30);
+
+  for (int i = 0; i < 30; i++)
+  {
+    snprintf(keys[i], sizeof(keys[i]), "A%d", i);
+    CD_store(dict, keys[i], keys[i]);
+  }
+
+  for (int i = 0; i < 30; i++)
+    CD_delete(dict, keys[i]);
+
+  CD_stats(dict, &stats);
+  test_assert(stats.num_deleted >= 20);
+
+  uint64_t num_rehashes = stats.num_rehashes;
+
+  // Keys probing elsewhere cannot reuse them, so the load factor
+  // passes the threshold while most of the load is tombstones
+  for (int i = 0; i < 20; i++)
+  {
+    snprintf(keys[i], sizeof(keys[i]), "B%d", i);
+    CD_store(dict, keys[i], keys[i]);
+  }
+
+  CD_stats(dict, &stats);
+  test_assert(CD_capacity(dict) == 64);
+  test_assert(stats.num_deleted < 20);
+  test_assert(!stats.counting || stats.num_rehashes == num_rehashes + 1);
+
+  for (int i = 0; i < 20; i++)
+    test_assert(CD_retrieve(dict, keys[i]) == keys[i]);
+
+  test_assert(!CD_contains(dict, "A0"));
+
+  // Keys probing through the tombstones reuse them
+  for (int i = 0; i < 20; i++)
+    CD_delete(dict, keys[i]);
+
+  for (int i = 0; i < 30; i++)
+  {
+    snprintf(keys[i], sizeof(keys[i]), "A%d", i);
+    CD_store(dict, keys[i], keys[i]);
+    CD_delete(dict, keys[i]);
+    CD_store(dict, keys[i], keys[i]);
+  }
+
+  test_assert(CD_capacity(dict) == 64);
+  CD_free(dict);
+
+  // Mass deletes shrink the table, in both modes
+  for (int incremental = 0; incremental < 2; incremental++)
+  {
+    dict = incremental ? CD_new_incremental() : CD_new();
+
+    for (int i = 0; i < num_items; i++)
+    {
+      snprintf(keys[i], sizeof(keys[i]), "key%d", i);
+      CD_store(dict, keys[i], keys[i]);
+    }
+
+    for (int i = 10; i < num_items; i++)
+      CD_delete(dict, keys[i]);
+
+    // An incremental shrink finishes as later operations move entries
+    for (int i = 0; i < 10; i++)
+      CD_store(dict, keys[i], keys[i]);
+
+    test_assert(CD_size(dict) == 10);
+    test_assert(CD_capacity(dict) <= 64);
+
+    for (int i = 0; i < num_items; i++)
+      test_assert(CD_contains(dict, keys[i]) == (i < 10));
+
+    CD_free(dict);
+  }
+
+  // ... but not below the reserved capacity, until CD_shrink_to_fit
+  dict = CD_new_with_capacity(num_items);
+  unsigned int capacity = CD_capacity(dict);
+
+  for (int i = 0; i < num_items; i++)
+    CD_store(dict, keys[i], keys[i]);
+
+  for (int i = 10; i < num_items; i++)
+    CD_delete(dict, keys[i]);
+
+  test_assert(CD_capacity(dict) == capacity);
+
+  CD_shrink_to_fit(dict);
+  CD_stats(dict, &stats);
+  test_assert(CD_capacity(dict) == 32);
+  test_assert(stats.num_deleted == 0);
+
+  for (int i = 0; i < 10; i++)
+    test_assert(CD_retrieve(dict, keys[i]) == keys[i]);
+
+  CD_free(dict);
+  free(keys);
+  return 1;
+
+test_error:
+  CD_free(dict);
+  free(keys);
+  return 0;
+}
+
+/*
+ * Tests CD_new_with_options: that out-of-range options are refused,
+ * that the maximum load factor sets the capacity, and that every probe
+ * sequence finds every key, including keys that all start probing in
+ * the same group
+ *
+ * Returns: 1 if all tests pass, 0 otherwise
+ */
+int test_options()
+{
+  const int num_items = 2000;
+  const CDictProbe probes[] = {CD_PROBE_TRIANGULAR, CD_PROBE_LINEAR, CD_PROBE_DOUBLE_HASH};
+  const double loads[] = {0.5, 0.85, 0.95};
+  char(*keys)[16] = malloc(num_items * sizeof(*keys));
+  CDictOptions options = {.max_load_factor = 0.3};
+  CDict dict = NULL;
+  char buffer[16];
+
+  for (int i = 0; i < num_items; i++)
+    snprintf(keys[i], sizeof(keys[i]), "A%d", i);
+
+  test_assert(CD_new_with_options(&options) == NULL);
+  options.max_load_factor = 0.99;
+  test_assert(CD_new_with_options(&options) == NULL);
+  options = (CDictOptions){.probe = 7};
+  test_assert(CD_new_with_options(&options) == NULL);
+  options = (CDictOptions){.flags = 0x10};
+  test_assert(CD_new_with_options(&options) == NULL);
+
+  dict = CD_new_with_options(NULL);
+  test_assert(dict != NULL && CD_capacity(dict) == 8);
+  CD_free(dict);
+
+  // 850 entries fit in 1024 slots at 0.85, but need 2048 at 0.6
+  options = (CDictOptions){.capacity = 850, .max_load_factor = 0.85};
+  dict = CD_new_with_options(&options);
+  test_assert(CD_capacity(dict) == 1024);
+  CD_free(dict);
+
+  options = (CDictOptions){.capacity = 850};
+  dict = CD_new_with_options(&options);
+  test_assert(CD_capacity(dict) == 2048);
+  CD_free(dict);
+  dict = NULL;
+
+  for (int p = 0; p < sizeof(probes) / sizeof(probes[0]); p++)
+    for (int l = 0; l < sizeof(loads) / sizeof(loads[0]); l++)
+    {
+      options = (CDictOptions){.max_load_factor = loads[l], .probe = probes[p], .flags = CD_NEW_INCREMENTAL};
+      dict = CD_new_with_options(&options);
+
+      for (int i = 0; i < num_items; i++)
+      {
+        CD_store(dict, keys[i], keys[i]);
+        test_assert(CD_load_factor(dict) <= loads[l]);
+      }
+
+      for (int i = 0; i < num_items; i += 2)
+        CD_delete(dict, keys[i]);
+
+      test_assert(CD_size(dict) == num_items / 2);
+
+      for (int i = 0; i < num_items; i++)
+        test_assert(CD_contains(dict, keys[i]) == (i % 2 == 1));
+
+      CD_free(dict);
+
+      // Every key starts probing at slot 0
+      options = (CDictOptions){.max_load_factor = loads[l], .probe = probes[p], .hash = region_hash};
+      dict = CD_new_with_options(&options);
+
+      for (int i = 0; i < 100; i++)
+        CD_store(dict, keys[i], keys[i]);
+
+      for (int i = 0; i < 100; i += 2)
+        CD_delete(dict, keys[i]);
+
+      for (int i = 0; i < 100; i++)
+        test_assert(CD_retrieve(dict, keys[i]) == ((i % 2 == 1) ? keys[i] : INVALID_VALUE));
+
+      CD_shrink_to_fit(dict);
+
+      for (int i = 1; i < 100; i += 2)
+        test_assert(CD_retrieve(dict, keys[i]) == keys[i]);
+
+      CD_free(dict);
+    }
+
+  // Flags combine with the new options as with the other constructors
+  options = (CDictOptions){.max_load_factor = 0.85, .flags = CD_NEW_OWNED};
+  dict = CD_new_with_options(&options);
+  strcpy(buffer, "key");
+  CD_store(dict, buffer, buffer);
+  strcpy(buffer, "xxx");
+  test_assert(strcmp(CD_retrieve(dict, "key"), "key") == 0);
+
+  CD_free(dict);
+  free(keys);
+  return 1;
+
+test_error:
+  CD_free(dict);
+  free(keys);
+  return 0;
+}
+
+/*
+ * Check that iterating over a dictionary visits exactly the keys
+ * expected, in order
+ *
+ * Returns: True if it does
+ */
+bool visits_in_order(CDict dict, char (*keys)[16], const bool *present, int num_keys)
+{
+  CDictIterator iter;
+  int next = 0;
+
+  CD_iter_begin(dict, &iter);
+
+  while (CD_iter_next(&iter))
+  {
+    while (next < num_keys && !present[next])
+      next++;
+
+    if (next == num_keys || iter.key != keys[next])
+      return false;
+
+    next++;
+  }
+
+  while (next < num_keys && !present[next])
+    next++;
+
+  return next == num_keys;
+}
+
+/*
+ * Tests compact dictionaries: entries must be visited in the order
+ * their keys were first stored, through overwrites, deletes, growing,
+ * shrinking and rebuilding, and take less memory than in a plain
+ * dictionary
+ *
+ * Returns: 1 if all tests pass, 0 otherwise
+ */
+int test_compact()
+{
+  const int num_items = 10000;
+  char(*keys)[16] = malloc(num_items * sizeof(*keys));
+  bool *present = calloc(num_items, sizeof(bool));
+  CDictOptions options = {.flags = CD_NEW_COMPACT | CD_NEW_INCREMENTAL};
+  CDict dict = NULL, plain = NULL;
+  CDictStats compact_stats, plain_stats;
+
+  test_assert(CD_new_with_options(&options) == NULL);
+
+  for (int i = 0; i < num_items; i++)
+    snprintf(keys[i], sizeof(keys[i]), "key%d", i);
+
+  // Small dictionaries keep the order too
+  dict = CD_new_compact();
+
+  for (int i = 0; i < 4; i++)
+  {
+    CD_store(dict, keys[i], keys[i]);
+    present[i] = true;
+  }
+
+  CD_delete(dict, keys[1]);
+  present[1] = false;
+  test_assert(visits_in_order(dict, keys, present, 4));
+
+  for (int i = 4; i < num_items; i++)
+  {
+    CD_store(dict, keys[i], keys[i]);
+    present[i] = true;
+  }
+
+  test_assert(visits_in_order(dict, keys, present, num_items));
+
+  // Overwriting keeps an entry's place; deleting and storing again
+  // moves it to the end, so here only deletes are made
+  for (int i = 0; i < num_items; i += 3)
+  {
+    CD_delete(dict, keys[i]);
+    present[i] = false;
+  }
+
+  for (int i = 4; i < num_items; i += 3)
+    CD_store(dict, keys[i], keys[i]);
+
+  test_assert(visits_in_order(dict, keys, present, num_items));
+
+  for (int i = 0; i < num_items; i++)
+    test_assert(CD_contains(dict, keys[i]) == present[i]);
+
+  // Mass deletes shrink the table, rebuilding it without holes
+  for (int i = 0; i < num_items - 10; i++)
+  {
+    CD_delete(dict, keys[i]);
+    present[i] = false;
+  }
+
+  test_assert(CD_capacity(dict) <= 64);
+  test_assert(visits_in_order(dict, keys, present, num_items));
+  CD_shrink_to_fit(dict);
+  test_assert(visits_in_order(dict, keys, present, num_items));
+
+  CD_free(dict);
+
+  // Churn: the oldest key is deleted as each new one is stored, and
+  // the holes left behind are cleared as the table is rebuilt
+  dict = CD_new_compact();
+  memset(present, 0, num_items * sizeof(bool));
+
+  for (int i = 0; i < num_items; i++)
+  {
+    if (i >= 10)
+    {
+      CD_delete(dict, keys[i - 10]);
+      present[i - 10] = false;
+    }
+
+    CD_store(dict, keys[i], keys[i]);
+    present[i] = true;
+    test_assert(CD_size(dict) == ((i < 10) ? i + 1 : 10));
+  }
+
+  test_assert(CD_capacity(dict) <= 32);
+  test_assert(visits_in_order(dict, keys, present, num_items));
+
+  CD_free(dict);
+
+  // The same entries take less room than in a plain dictionary
+  dict = CD_new_compact();
+  plain = CD_new();
+
+  for (int i = 0; i < num_items; i++)
+  {
+    CD_store(dict, keys[i], keys[i]);
+    CD_store(plain, keys[i], keys[i]);
+  }
+
+  CD_stats(dict, &compact_stats);
+  CD_stats(plain, &plain_stats);
+  test_assert(CD_capacity(dict) == CD_capacity(plain));
+  test_assert(compact_stats.slot_bytes < plain_stats.slot_bytes * 3 / 4);
+
+  CD_free(dict);
+  CD_free(plain);
+  free(keys);
+  free(present);
+  return 1;
+
+test_error:
+  CD_free(dict);
+  CD_free(plain);
+  free(keys);
+  free(present);
+  return 0;
+}
+
+// Allocator that fails once the number of allocations in ctx is used up
+void *failing_alloc(size_t size, void *ctx)
+{
+  int *allowed = ctx;
+
+  if (*allowed == 0)
+    return NULL;
+
+  (*allowed)--;
+  return malloc(size);
+}
+
+void failing_free(void *ptr, size_t size, void *ctx)
+{
+  free(ptr);
+}
+
+/*
+ * Tests cloning: a clone must hold the same entries as the original,
+ * in the same order if compact, and be unaffected by later changes to
+ * the original or by freeing it
+ *
+ * Returns: 1 if all tests pass, 0 otherwise
+ */
+int test_clone()
+{
+  const int num_items = 5000;
+  char(*keys)[16] = malloc(num_items * sizeof(*keys));
+  bool *present = malloc(num_items * sizeof(bool));
+  char key[32];
+  char value[32];
+  const char *changed = "changed";
+  CDict dict = CD_new(), clone = NULL;
+
+  for (int i = 0; i < num_items; i++)
+  {
+    snprintf(keys[i], sizeof(keys[i]), "key%d", i);
+    present[i] = true;
+  }
+
+  for (int i = 0; i < num_items; i++)
+    CD_store(dict, keys[i], keys[i]);
+
+  clone = CD_clone(dict);
+  test_assert(clone != NULL);
+  test_assert(CD_size(clone) == num_items);
+  test_assert(CD_capacity(clone) == CD_capacity(dict));
+
+  for (int i = 0; i < num_items; i += 2)
+    CD_delete(dict, keys[i]);
+
+  CD_store(clone, keys[1], changed);
+  test_assert(CD_retrieve(dict, keys[1]) == keys[1]);
+
+  for (int i = 0; i < num_items; i++)
+    test_assert(CD_retrieve(clone, keys[i]) == ((i == 1) ? changed : keys[i]));
+
+  CD_free(dict);
+  CD_free(clone);
+  dict = clone = NULL;
+
+  // An owned clone has its own copies, so the original can go first
+  dict = CD_new_owned();
+
+  for (int i = 0; i < num_items; i++)
+  {
+    snprintf(key, sizeof(key), "owned-key-%d", i);
+    snprintf(value, sizeof(value), "owned-value-%d", i);
+    CD_store(dict, key, value);
+  }
+
+  clone = CD_clone(dict);
+  CD_free(dict);
+  dict = NULL;
+  test_assert(clone != NULL && CD_size(clone) == num_items);
+
+  for (int i = 0; i < num_items; i++)
+  {
+    snprintf(key, sizeof(key), "owned-key-%d", i);
+    snprintf(value, sizeof(value), "owned-value-%d", i);
+    test_assert(strcmp(CD_retrieve(clone, key), value) == 0);
+  }
+
+  CD_free(clone);
+  clone = NULL;
+
+  // Compact clones keep the order, holes and all; small ones clone too
+  dict = CD_new_compact();
+
+  for (int i = 0; i < num_items; i++)
+    CD_store(dict, keys[i], keys[i]);
+
+  for (int i = 0; i < num_items; i += 7)
+  {
+    CD_delete(dict, keys[i]);
+    present[i] = false;
+  }
+
+  clone = CD_clone(dict);
+  test_assert(clone != NULL && visits_in_order(clone, keys, present, num_items));
+  CD_free(dict);
+  CD_free(clone);
+  dict = clone = NULL;
+
+  dict = CD_new();
+  CD_store(dict, "a", "1");
+  CD_store(dict, "b", "2");
+  clone = CD_clone(dict);
+  CD_store(clone, "c", "3");
+  test_assert(CD_size(dict) == 2 && CD_size(clone) == 3);
+  test_assert(strcmp(CD_retrieve(clone, "b"), "2") == 0);
+  CD_free(dict);
+  CD_free(clone);
+  dict = clone = NULL;
+
+  // A clone taken part way through an incremental rehash finishes it
+  // on its own
+  dict = CD_new_incremental();
+
+  for (int i = 0; i < num_items; i++)
+  {
+    CD_store(dict, keys[i], keys[i]);
+
+    if (i == num_items / 2 + 100)
+    {
+      clone = CD_clone(dict);
+      test_assert(clone != NULL);
+    }
+  }
+
+  for (int i = num_items / 2 + 101; i < num_items; i++)
+    CD_store(clone, keys[i], keys[i]);
+
+  for (int i = 0; i < num_items; i++)
+    test_assert(CD_retrieve(clone, keys[i]) == keys[i]);
+
+  CD_free(dict);
+  CD_free(clone);
+  dict = clone = NULL;
+
+  // Running out of memory part way through leaves the original intact,
+  // including while it is rehashing and has two tables
+  int allowed = -1;
+  CDictAllocator failing = {failing_alloc, failing_free, &allowed};
+  CDictOptions options = {.flags = CD_NEW_INCREMENTAL, .allocator = &failing};
+
+  dict = CD_new_with_options(&options);
+
+  // Growing to 2048 slots starts a migration that takes 32 stores
+  for (int i = 0; i < 620; i++)
+    CD_store(dict, keys[i], keys[i]);
+
+  for (int n = 0; n < 3; n++)
+  {
+    allowed = n;
+    test_assert(CD_clone(dict) == NULL);
+  }
+
+  allowed = -1;
+  clone = CD_clone(dict);
+  test_assert(clone != NULL && CD_size(clone) == 620);
+
+  for (int i = 0; i < 620; i++)
+    test_assert(CD_retrieve(dict, keys[i]) == keys[i] && CD_retrieve(clone, keys[i]) == keys[i]);
+
+  CD_free(dict);
+  CD_free(clone);
+  free(keys);
+  free(present);
+  return 1;
+
+test_error:
+  CD_free(dict);
+  CD_free(clone);
+  free(keys);
+  free(present);
+  return 0;
+}
+
+typedef struct
+{
+  CDictSnapshot snap;
+  char (*keys)[16];
+  int num_keys;
+  volatile bool stop;
+  int passes;
+  int errors;
+} snapshot_reader_t;
+
+/*
+ * Thread body for test_snapshot: checks every key of the snapshot,
+ * and counts its entries, over and over until told to stop
+ */
+void *snapshot_reader(void *arg)
+{
+  snapshot_reader_t *reader = arg;
+
+  do
+  {
+    int count = 0;
+
+    for (int i = 0; i < reader->num_keys; i++)
+      if (CDSN_retrieve(reader->snap, reader->keys[i]) != reader->keys[i])
+        reader->errors++;
+
+    CDSN_foreach(reader->snap, count_callback, &count);
+
+    if (count != reader->num_keys)
+      reader->errors++;
+
+    reader->passes++;
+  } while (!reader->stop);
+
+  return NULL;
+}
+
+/*
+ * Tests snapshots: a snapshot must keep returning the entries the
+ * dictionary had when it was taken, through overwrites, deletes,
+ * growing and shrinking, and after the dictionary is freed
+ *
+ * Returns: 1 if all tests pass, 0 otherwise
+ */
+int test_snapshot()
+{
+  const int num_items = 10000;
+  char(*keys)[16] = malloc(2 * num_items * sizeof(*keys));
+  bool *present = malloc(num_items * sizeof(bool));
+  char key[32];
+  char value[32];
   CDict dict = CD_new();
+  CDictSnapshot snap = NULL;
+  int count = 0;
+
+  for (int i = 0; i < 2 * num_items; i++)
+    snprintf(keys[i], sizeof(keys[i]), "key%d", i);
+
+  for (int i = 0; i < num_items; i++)
+    CD_store(dict, keys[i], keys[i]);
+
+  snap = CD_snapshot(dict);
+  test_assert(snap != NULL);
+  test_assert(CD_snapshot(dict) == NULL);
+
+  for (int i = 0; i < num_items; i += 3)
+    CD_store(dict, keys[i], "changed");
+
+  for (int i = 1; i < num_items; i += 3)
+    CD_delete(dict, keys[i]);
+
+  // Growing hands the shared table over to the snapshot
+  for (int i = num_items; i < 2 * num_items; i++)
+    CD_store(dict, keys[i], keys[i]);
+
+  test_assert(CDSN_size(snap) == num_items);
+
+  for (int i = 0; i < 2 * num_items; i++)
+    test_assert(CDSN_retrieve(snap, keys[i]) == ((i < num_items) ? keys[i] : INVALID_VALUE));
+
+  CDSN_foreach(snap, count_callback, &count);
+  test_assert(count == num_items);
+  test_assert(strcmp(CD_retrieve(dict, keys[0]), "changed") == 0);
+  test_assert(!CD_contains(dict, keys[1]));
+
+  CDSN_free(snap);
+  snap = NULL;
+
+  // Deletes, shrinking, and a purge of tombstones
+  snap = CD_snapshot(dict);
+  test_assert(snap != NULL);
+
+  for (int i = 0; i < 2 * num_items - 100; i++)
+    if (i >= num_items || i % 3 != 1)
+      CD_delete(dict, keys[i]);
+
+  CD_shrink_to_fit(dict);
+  test_assert(CD_size(dict) == 100);
+
+  for (int i = 0; i < 2 * num_items; i++)
+    test_assert(CDSN_contains(snap, keys[i]) == (i >= num_items || i % 3 != 1));
+
+  // The snapshot outlives the dictionary
+  CD_free(dict);
+  dict = NULL;
+  test_assert(CDSN_retrieve(snap, keys[num_items]) == keys[num_items]);
+  CDSN_free(snap);
+  snap = NULL;
+
+  // Small and compact dictionaries, and owned values that the
+  // dictionary has since replaced
+  dict = CD_new_owned();
+  CD_store(dict, "a", "1");
+  snap = CD_snapshot(dict);
+
+  for (int i = 0; i < 100; i++)
+  {
+    snprintf(key, sizeof(key), "owned-key-%d", i);
+    snprintf(value, sizeof(value), "owned-value-%d", i);
+    CD_store(dict, key, value);
+  }
+
+  CD_store(dict, "a", "2");
+  CD_free(dict);
+  dict = NULL;
+  test_assert(CDSN_size(snap) == 1);
+  test_assert(strcmp(CDSN_retrieve(snap, "a"), "1") == 0);
+  test_assert(!CDSN_contains(snap, "owned-key-0"));
+  CDSN_free(snap);
+  snap = NULL;
+
+  dict = CD_new_compact();
+
+  for (int i = 0; i < num_items; i++)
+  {
+    CD_store(dict, keys[i], keys[i]);
+    present[i] = (i % 5 != 0);
+  }
+
+  for (int i = 0; i < num_items; i += 5)
+    CD_delete(dict, keys[i]);
+
+  snap = CD_snapshot(dict);
+
+  for (int i = 0; i < num_items; i++)
+  {
+    if (present[i])
+      CD_delete(dict, keys[i]);
+
+    CD_store(dict, keys[num_items + i], keys[num_items + i]);
+  }
+
+  test_assert(CDSN_size(snap) == num_items - num_items / 5);
+
+  for (int i = 0; i < num_items; i++)
+    test_assert(CDSN_contains(snap, keys[i]) == present[i]);
+
+  CDSN_free(snap);
+  snap = NULL;
+
+  // The dictionary kept its own order throughout
+  for (int i = 0; i < num_items; i++)
+    present[i] = true;
+
+  test_assert(visits_in_order(dict, keys + num_items, present, num_items));
+  CD_free(dict);
+
+  // A thread reads the snapshot while the dictionary is overwritten,
+  // deleted from, grown, shrunk and finally freed
+  dict = CD_new();
+
+  for (int i = 0; i < num_items; i++)
+    CD_store(dict, keys[i], keys[i]);
+
+  snapshot_reader_t reader = {CD_snapshot(dict), keys, num_items, false, 0, 0};
+  pthread_t thread;
+
+  snap = reader.snap;
+  test_assert(snap != NULL);
+  test_assert(pthread_create(&thread, NULL, snapshot_reader, &reader) == 0);
+
+  for (int round = 0; round < 4; round++)
+  {
+    for (int i = 0; i < num_items; i++)
+      CD_store(dict, keys[i], keys[num_items + i]);
+
+    for (int i = round % 2; i < num_items; i += 2)
+      CD_delete(dict, keys[i]);
+
+    for (int i = num_items; i < 2 * num_items; i++)
+      CD_store(dict, keys[i], keys[i]);
+
+    for (int i = num_items; i < 2 * num_items; i++)
+      CD_delete(dict, keys[i]);
+  }
+
+  CD_free(dict);
+  dict = NULL;
+  reader.stop = true;
+  pthread_join(thread, NULL);
+  test_assert(reader.passes > 0 && reader.errors == 0);
+  CDSN_free(snap);
+  snap = NULL;
+
+  free(keys);
+  free(present);
+  return 1;
+
+test_error:
+  CDSN_free(snap);
+  CD_free(dict);
+  free(keys);
+  free(present);
+  return 0;
+}
+
+/*
+ * Tests incremental rehashing: every key must stay reachable, whether
+ * it is still in the old table or has been moved to the new one
+ *
+ * Returns: 1 if all tests pass, 0 otherwise
+ */
+int test_incremental_rehash()
+{
+  const int num_items = 2000;
+  char(*keys)[16] = malloc(num_items * sizeof(*keys));
+  CDict dict = CD_new_incremental();
+  int count = 0;
+
+  for (int i = 0; i < num_items; i++)
+  {
+    snprintf(keys[i], sizeof(keys[i]), "key%d", i);
+    CD_store(dict, keys[i], keys[i]);
+
+    test_assert(CD_size(dict) == i + 1);
+    test_assert(CD_load_factor(dict) <= 0.6);
+
+    // spot check keys stored before the latest growth
+    for (int j = 0; j <= i; j += 97)
+      test_assert(CD_retrieve(dict, keys[j]) == keys[j]);
+  }
+
+  // overwrite and delete while entries may still be migrating
+  for (int i = 0; i < num_items; i += 2)
+    CD_store(dict, keys[i], "even");
+
+  for (int i = 0; i < num_items; i += 4)
+    CD_delete(dict, keys[i]);
+
+  for (int i = 0; i < num_items; i++)
+  {
+    const char *expected = (i % 4 == 0) ? NULL : (i % 2 == 0) ? "even" : keys[i];
+    test_assert(CD_retrieve(dict, keys[i]) == expected);
+  }
+
+  CD_foreach(dict, count_callback, &count);
+  test_assert(count == num_items - num_items / 4);
+  test_assert(CD_size(dict) == count);
+
+  CD_free(dict);
+  free(keys);
+  return 1;
+
+test_error:
+  CD_free(dict);
+  free(keys);
+  return 0;
+}
+
+/*
+ * Tests an owned dictionary: keys and values are copied, so the
+ * caller's buffers can be reused right after each store
+ *
+ * Returns: 1 if all tests pass, 0 otherwise
+ */
+int test_owned_keys()
+{
+  const int num_items = 5000;
+  char key[32];
+  char value[32];
+  char big[100000];
+  CDict dict = CD_new_owned();
+
+  for (int i = 0; i < num_items; i++)
+  {
+    snprintf(key, sizeof(key), "owned-key-%d", i);
+    snprintf(value, sizeof(value), "owned-value-%d", i);
+    CD_store(dict, key, value);
+  }
+
+  // the caller's buffers no longer hold anything the dict refers to
+  memset(key, 0, sizeof(key));
+  memset(value, 0, sizeof(value));
+  test_assert(CD_size(dict) == num_items);
+
+  for (int i = 0; i < num_items; i++)
+  {
+    snprintf(key, sizeof(key), "owned-key-%d", i);
+    snprintf(value, sizeof(value), "owned-value-%d", i);
+
+    const char *v = CD_retrieve(dict, key);
+    test_assert(v != NULL && v != value);
+    test_assert(strcmp(v, value) == 0);
+  }
+
+  // overwriting copies the new value
+  snprintf(value, sizeof(value), "replaced");
+  CD_store(dict, "owned-key-7", value);
+  value[0] = 'X';
+  test_assert(strcmp(CD_retrieve(dict, "owned-key-7"), "replaced") == 0);
+
+  // strings larger than an arena chunk
+  memset(big, 'b', sizeof(big) - 1);
+  big[sizeof(big) - 1] = '\0';
+  CD_store(dict, big, big);
+  CD_store(dict, "after-big", "small");
+  test_assert(strcmp(CD_retrieve(dict, big), big) == 0);
+  test_assert(strcmp(CD_retrieve(dict, "after-big"), "small") == 0);
+
+  CD_delete(dict, "owned-key-0");
+  test_assert(!CD_contains(dict, "owned-key-0"));
+
+  CD_free(dict);
+  return 1;
+
+test_error:
+  CD_free(dict);
+  return 0;
+}
+
+/*
+ * Tests presizing: a dictionary created or reserved for n entries must
+ * hold them without growing
+ *
+ * Returns: 1 if all tests pass, 0 otherwise
+ */
+int test_presizing()
+{
+  const int num_items = 1000;
+  char(*keys)[16] = malloc(num_items * sizeof(*keys));
+  CDict dict = CD_new_with_capacity(num_items);
+  unsigned int capacity = CD_capacity(dict);
+
+  test_assert(capacity >= num_items / 0.6);
+  test_assert((capacity & (capacity - 1)) == 0);
+
+  for (int i = 0; i < num_items; i++)
+  {
+    snprintf(keys[i], sizeof(keys[i]), "key%d", i);
+    CD_store(dict, keys[i], keys[i]);
+  }
+
+  test_assert(CD_capacity(dict) == capacity);
+  CD_free(dict);
+
+  // reserving keeps existing entries and never shrinks
+  dict = CD_new_incremental();
+
+  for (int i = 0; i < 100; i++)
+    CD_store(dict, keys[i], keys[i]);
+
+  CD_reserve(dict, num_items);
+  capacity = CD_capacity(dict);
+  test_assert(capacity >= num_items / 0.6);
+
+  for (int i = 0; i < num_items; i++)
+    CD_store(dict, keys[i], keys[i]);
+
+  test_assert(CD_capacity(dict) == capacity);
+  test_assert(CD_size(dict) == num_items);
+
+  for (int i = 0; i < num_items; i++)
+    test_assert(CD_retrieve(dict, keys[i]) == keys[i]);
+
+  CD_reserve(dict, 10);
+  test_assert(CD_capacity(dict) == capacity);
+
+  CD_free(dict);
+  free(keys);
+  return 1;
 
-  for (int i = 0; i < 100 + 10; i++)
+test_error:
+  CD_free(dict);
+  free(keys);
+  return 0;
+}
+
+/*
+ * Tests batched lookups against one-at-a-time lookups, with batches
+ * that are not a whole multiple of the internal batch size
+ *
+ * Returns: 1 if all tests pass, 0 otherwise
+ */
+int test_batched_lookup()
+{
+  const int num_items = 500;
+  char(*keys)[16] = malloc(2 * num_items * sizeof(*keys));
+  CDictKeyType *lookup = malloc(2 * num_items * sizeof(*lookup));
+  CDictValueType *values = malloc(2 * num_items * sizeof(*values));
+  bool *contained = malloc(2 * num_items * sizeof(*contained));
+  CDict dict = CD_new_incremental();
+
+  // keys with odd numbers are never stored
+  for (int i = 0; i < 2 * num_items; i++)
   {
-    char key[15];
-    sprintf(key, "key%d", i);
-    CD_store(dict, key, "value");
+    snprintf(keys[i], sizeof(keys[i]), "key%d", i);
+    lookup[i] = keys[i];
+
+    if (i % 2 == 0)
+      CD_store(dict, keys[i], keys[i]);
   }
 
-  test_assert(CD_capacity(dict) >= 100);
+  lookup[3] = NULL;
+
+  test_assert(CD_retrieve_many(dict, lookup, 2 * num_items - 1, values) == num_items);
+  test_assert(CD_contains_many(dict, lookup, 2 * num_items - 1, contained) == num_items);
+
+  for (int i = 0; i < 2 * num_items - 1; i++)
+  {
+    const char *expected = (i % 2 == 0) ? keys[i] : NULL;
+    test_assert(values[i] == expected);
+    test_assert(contained[i] == (i % 2 == 0));
+  }
+
+  test_assert(CD_retrieve_many(dict, lookup, 0, values) == 0);
+  test_assert(CD_retrieve_many(NULL, lookup, 1, values) == 0);
+
   CD_free(dict);
+  free(keys);
+  free(lookup);
+  free(values);
+  free(contained);
   return 1;
+
 test_error:
   CD_free(dict);
+  free(keys);
+  free(lookup);
+  free(values);
+  free(contained);
   return 0;
 }
 
-int test_null_values()
+/*
+ * Tests keys given with an explicit length, including keys with
+ * embedded NULs and keys that are prefixes of each other
+ *
+ * Returns: 1 if all tests pass, 0 otherwise
+ */
+int test_explicit_length_keys()
 {
+  const char binary1[] = {'a', '\0', 'b'};
+  const char binary2[] = {'a', '\0', 'c'};
   CDict dict = CD_new();
-  CD_store(dict, "key1", NULL);
-  test_assert(CD_retrieve(dict, "key1") == NULL);
+
+  CD_store_n(dict, binary1, sizeof(binary1), "one");
+  CD_store_n(dict, binary2, sizeof(binary2), "two");
+  CD_store_n(dict, "a", 1, "prefix");
+
+  test_assert(CD_size(dict) == 3);
+  test_assert(strcmp(CD_retrieve_n(dict, binary1, sizeof(binary1)), "one") == 0);
+  test_assert(strcmp(CD_retrieve_n(dict, binary2, sizeof(binary2)), "two") == 0);
+
+  // "a" is the same key whether given by length or as a string
+  test_assert(strcmp(CD_retrieve(dict, "a"), "prefix") == 0);
+  test_assert(CD_contains_n(dict, "abc", 1));
+  test_assert(!CD_contains_n(dict, "ab", 2));
+
+  CD_delete_n(dict, binary1, sizeof(binary1));
+  test_assert(!CD_contains_n(dict, binary1, sizeof(binary1)));
+  test_assert(CD_contains_n(dict, binary2, sizeof(binary2)));
+
+  // the empty key
+  CD_store_n(dict, "", 0, "empty");
+  test_assert(strcmp(CD_retrieve(dict, ""), "empty") == 0);
+
+  test_assert(CD_retrieve_n(NULL, "a", 1) == NULL);
+  test_assert(CD_retrieve_n(dict, NULL, 1) == NULL);
   CD_free(dict);
+
+  // owned dictionaries copy the exact bytes
+  dict = CD_new_owned();
+  char buf[3];
+  memcpy(buf, binary1, sizeof(buf));
+  CD_store_n(dict, buf, sizeof(buf), "one");
+  memset(buf, 0, sizeof(buf));
+  test_assert(strcmp(CD_retrieve_n(dict, binary1, sizeof(binary1)), "one") == 0);
+  CD_free(dict);
+
   return 1;
+
 test_error:
   CD_free(dict);
   return 0;
 }
 
-int test_handle_collisions()
+/*
+ * Tests freezing a dictionary into its perfect-hash form
+ *
+ * Returns: 1 if all tests pass, 0 otherwise
+ */
+int test_frozen()
 {
-  CDict dict = CD_new();
-  char *key1 = "key1";
-  char *key2 = "key2";
+  const char binary[] = {'a', '\0', 'b'};
+  const int num_keys = 10000;
+  char key[32];
+  char value[32];
+  CDict dict = CD_new_owned();
+  CDictFrozen frozen = NULL;
+
+  for (int i = 0; i < num_keys; i++)
+  {
+    snprintf(key, sizeof(key), "key%d", i);
+    snprintf(value, sizeof(value), "value%d", i);
+    CD_store(dict, key, value);
+  }
 
-  // Assuming these two keys hash to the same slot
-  CD_store(dict, key1, "value1");
-  CD_store(dict, key2, "value2");
+  CD_store_n(dict, binary, sizeof(binary), "binary");
+  frozen = CD_freeze(dict);
+  test_assert(frozen != NULL);
 
-  test_assert(strcmp(CD_retrieve(dict, key1), "value1") == 0);
-  test_assert(strcmp(CD_retrieve(dict, key2), "value2") == 0);
+  // The frozen copy does not depend on the original
+  CD_free(dict);
+  dict = NULL;
+
+  test_assert(CDF_size(frozen) == num_keys + 1);
+
+  for (int i = 0; i < num_keys; i++)
+  {
+    snprintf(key, sizeof(key), "key%d", i);
+    snprintf(value, sizeof(value), "value%d", i);
+    test_assert(CDF_contains(frozen, key));
+    test_assert(strcmp(CDF_retrieve(frozen, key), value) == 0);
+
+    snprintf(key, sizeof(key), "missing%d", i);
+    test_assert(CDF_retrieve(frozen, key) == INVALID_VALUE);
+  }
+
+  test_assert(strcmp(CDF_retrieve_n(frozen, binary, sizeof(binary)), "binary") == 0);
+  test_assert(!CDF_contains(frozen, "a"));
+  test_assert(CDF_contains_n(frozen, "key12345", 5));
+
+  int count = 0;
+  CDF_foreach(frozen, count_callback, &count);
+  test_assert(count == num_keys + 1);
+  CDF_free(frozen);
+
+  // Empty and tiny dictionaries
+  dict = CD_new();
+  frozen = CD_freeze(dict);
+  test_assert(frozen != NULL);
+  test_assert(CDF_size(frozen) == 0);
+  test_assert(!CDF_contains(frozen, "key"));
+  CDF_free(frozen);
+
+  CD_store(dict, "only", "one");
+  frozen = CD_freeze(dict);
+  test_assert(strcmp(CDF_retrieve(frozen, "only"), "one") == 0);
+  test_assert(CDF_retrieve(frozen, "other") == NULL);
+
+  test_assert(CD_freeze(NULL) == NULL);
+  test_assert(CDF_retrieve(NULL, "only") == NULL);
+
+  CDF_free(frozen);
+  CD_free(dict);
+  return 1;
+
+test_error:
+  CDF_free(frozen);
+  CD_free(dict);
+  return 0;
+}
+
+/*
+ * Tests saving a dictionary to a file and mapping it back
+ *
+ * Returns: 1 if all tests pass, 0 otherwise
+ */
+int test_save_and_mmap()
+{
+  char path[] = "/tmp/cdict_test_XXXXXX";
+  int fd = mkstemp(path);
+  char key[32];
+  char value[32];
+  CDict dict = CD_new_owned();
+  CDictFrozen frozen = NULL;
+
+  test_assert(fd >= 0);
+  close(fd);
+
+  for (int i = 0; i < 5000; i++)
+  {
+    snprintf(key, sizeof(key), "key%d", i);
+    snprintf(value, sizeof(value), "value%d", i);
+    CD_store(dict, key, value);
+  }
+
+  test_assert(CD_save(dict, path));
+
+  frozen = CD_open_mmap(path);
+  test_assert(frozen != NULL);
+  test_assert(CDF_size(frozen) == 5000);
+  test_assert(strcmp(CDF_retrieve(frozen, "key4999"), "value4999") == 0);
+  test_assert(CDF_contains(frozen, "key0"));
+  test_assert(!CDF_contains(frozen, "key5000"));
+
+  int count = 0;
+  CDF_foreach(frozen, count_callback, &count);
+  test_assert(count == 5000);
+  CDF_free(frozen);
+  frozen = NULL;
+
+  // A file that is not a saved dictionary is rejected
+  FILE *file = fopen(path, "r+b");
+  test_assert(file != NULL);
+  fputs("NOTADICT", file);
+  fclose(file);
+  test_assert(CD_open_mmap(path) == NULL);
+
+  // So is a truncated one
+  test_assert(CD_save(dict, path));
+  test_assert(truncate(path, 100) == 0);
+  test_assert(CD_open_mmap(path) == NULL);
+
+  // And one whose header claims more buckets than the file holds, with
+  // a blob size that makes the sizes add up only by wrapping around.
+  // The file header is 24 bytes, and the dictionary's header after it
+  // holds the bucket count at offset 12 and the blob size at 16.
+  uint32_t num_buckets;
+  uint64_t blob_size;
+
+  test_assert(CD_save(dict, path));
+  file = fopen(path, "r+b");
+  test_assert(file != NULL);
+  test_assert(fseek(file, 24 + 12, SEEK_SET) == 0 && fread(&num_buckets, sizeof(num_buckets), 1, file) == 1);
+  test_assert(fread(&blob_size, sizeof(blob_size), 1, file) == 1);
+  num_buckets += 1u << 30;
+  blob_size -= (uint64_t)4 << 30;
+  test_assert(fseek(file, 24 + 12, SEEK_SET) == 0 && fwrite(&num_buckets, sizeof(num_buckets), 1, file) == 1);
+  test_assert(fwrite(&blob_size, sizeof(blob_size), 1, file) == 1);
+  fclose(file);
+  test_assert(CD_open_mmap(path) == NULL);
+
+  // A record whose value has lost its NUL is treated as missing
+  char contents[256 * 1024];
+  size_t length;
+
+  test_assert(CD_save(dict, path));
+  file = fopen(path, "r+b");
+  test_assert(file != NULL);
+  length = fread(contents, 1, sizeof(contents), file);
+  test_assert(length > 0 && length < sizeof(contents));
+
+  for (size_t i = 0; i + sizeof("value4999") <= length; i++)
+    if (memcmp(contents + i, "value4999", sizeof("value4999")) == 0)
+    {
+      test_assert(fseek(file, (long)(i + sizeof("value4999") - 1), SEEK_SET) == 0 && fputc('X', file) == 'X');
+      break;
+    }
+
+  fclose(file);
+  frozen = CD_open_mmap(path);
+  test_assert(frozen != NULL);
+  test_assert(CDF_retrieve(frozen, "key4999") == INVALID_VALUE);
+  test_assert(strcmp(CDF_retrieve(frozen, "key4998"), "value4998") == 0);
+  count = 0;
+  CDF_foreach(frozen, count_callback, &count);
+  test_assert(count == 4999);
+  CDF_free(frozen);
+  frozen = NULL;
+
+  // Or a blob larger than the rest of the file
+  test_assert(CD_save(dict, path));
+  file = fopen(path, "r+b");
+  test_assert(file != NULL);
+  test_assert(fseek(file, 24 + 16, SEEK_SET) == 0 && fread(&blob_size, sizeof(blob_size), 1, file) == 1);
+  blob_size += 8;
+  test_assert(fseek(file, 24 + 16, SEEK_SET) == 0 && fwrite(&blob_size, sizeof(blob_size), 1, file) == 1);
+  fclose(file);
+  test_assert(CD_open_mmap(path) == NULL);
+
+  remove(path);
+  test_assert(CD_open_mmap(path) == NULL);
+  test_assert(!CD_save(dict, "/nonexistent/dir/file"));
+
+  CD_free(dict);
+  return 1;
+
+test_error:
+  remove(path);
+  CDF_free(frozen);
+  CD_free(dict);
+  return 0;
+}
+
+/*
+ * Writes a string to a new temporary file
+ *
+ * Parameters:
+ *   path      Template for mkstemp, replaced by the file's name
+ *   contents  What to write
+ *
+ * Returns: True on success
+ */
+bool write_temp_file(char *path, const char *contents)
+{
+  int fd = mkstemp(path);
+
+  if (fd < 0)
+    return false;
+
+  bool written = write(fd, contents, strlen(contents)) == (ssize_t)strlen(contents);
+  close(fd);
+
+  return written;
+}
+
+/*
+ * Tests bulk loading of tab-separated files
+ *
+ * Returns: 1 if all tests pass, 0 otherwise
+ */
+int test_load_tsv()
+{
+  char path[] = "/tmp/cdict_test_XXXXXX";
+  const char *shared = "shared";
+  CDict dict = NULL, clone = NULL;
+
+  // Duplicates, CRLF, a tab in a value, an empty line, a line with no
+  // tab, and no newline at the end
+  test_assert(write_temp_file(path, "apple\tred\nbanana\tyellow\r\n\nplum\tdark\tpurple\n"
+                                    "no tab here\napple\tgreen\nkiwi\tbrown"));
+
+  dict = CD_new();
+  test_assert(CD_load_tsv(dict, path, 0) == 5);
+  test_assert(CD_size(dict) == 4);
+  test_assert(strcmp(CD_retrieve(dict, "apple"), "green") == 0);
+  test_assert(strcmp(CD_retrieve(dict, "banana"), "yellow") == 0);
+  test_assert(strcmp(CD_retrieve(dict, "plum"), "dark\tpurple") == 0);
+  test_assert(strcmp(CD_retrieve(dict, "kiwi"), "brown") == 0);
+  test_assert(!CD_contains(dict, "no tab here"));
+  CD_free(dict);
+
+  dict = CD_new_owned();
+  test_assert(CD_load_tsv(dict, path, CD_LOAD_KEEP_FIRST) == 4);
+  test_assert(strcmp(CD_retrieve(dict, "apple"), "red") == 0);
+  CD_free(dict);
+
+  // Strict loading stops at the line with no tab
+  dict = CD_new();
+  test_assert(CD_load_tsv(dict, path, CD_LOAD_STRICT) == -1);
+  test_assert(CD_contains(dict, "plum"));
+  test_assert(!CD_contains(dict, "kiwi"));
+  CD_free(dict);
+  remove(path);
+
+  // A larger file grows the dictionary just once, up front
+  FILE *file = fopen(path, "w");
+  test_assert(file != NULL);
 
+  for (int i = 0; i < 10000; i++)
+    fprintf(file, "key%d\tvalue%d\n", i, i);
+
+  fclose(file);
+
+  dict = CD_new();
+  test_assert(CD_load_tsv(dict, path, 0) == 10000);
+  test_assert(CD_capacity(dict) == 32768);
+  test_assert(strcmp(CD_retrieve(dict, "key9999"), "value9999") == 0);
+
+  // A clone copies the loaded strings, and a clone of the clone copies
+  // them again, so each may outlive the one it came from
+  CD_store(dict, "caller", shared);
+  clone = CD_clone(dict);
+  CD_free(dict);
+  dict = CD_clone(clone);
+  CD_free(clone);
+  clone = NULL;
+  test_assert(dict != NULL && CD_size(dict) == 10001);
+  test_assert(strcmp(CD_retrieve(dict, "key0"), "value0") == 0);
+  test_assert(strcmp(CD_retrieve(dict, "key9999"), "value9999") == 0);
+  test_assert(CD_retrieve(dict, "caller") == (CDictValueType)shared);
   CD_free(dict);
+  remove(path);
+
+  dict = CD_new();
+  test_assert(CD_load_tsv(dict, path, 0) == -1);
+  test_assert(CD_load_tsv(NULL, path, 0) == -1);
+  CD_free(dict);
+
   return 1;
 
 test_error:
+  remove(path);
   CD_free(dict);
+  CD_free(clone);
+  return 0;
+}
+
+/*
+ * Returns the current time in seconds, for throughput measurements
+ */
+double now_seconds()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+#define SHARDED_THREADS 8
+#define SHARDED_KEYS_PER_THREAD 20000
+
+typedef struct
+{
+  CDictSharded dict;
+  int id;
+  int errors;
+} sharded_worker_t;
+
+/*
+ * Thread body for test_sharded_threads: stores, reads back, overwrites
+ * and deletes a range of keys of its own, and reads other threads'
+ */
+void *sharded_worker(void *arg)
+{
+  sharded_worker_t *w = arg;
+  char key[32];
+  char value[32];
+
+  for (int i = 0; i < SHARDED_KEYS_PER_THREAD; i++)
+  {
+    snprintf(key, sizeof(key), "t%d-key%d", w->id, i);
+    snprintf(value, sizeof(value), "t%d-value%d", w->id, i);
+    CDS_store(w->dict, key, value);
+  }
+
+  for (int i = 0; i < SHARDED_KEYS_PER_THREAD; i++)
+  {
+    snprintf(key, sizeof(key), "t%d-key%d", w->id, i);
+    snprintf(value, sizeof(value), "t%d-value%d", w->id, i);
+    const char *v = CDS_retrieve(w->dict, key);
+
+    if (v == NULL || strcmp(v, value) != 0)
+      w->errors++;
+
+    // keys of other threads are either there or not yet stored
+    snprintf(key, sizeof(key), "t%d-key%d", (w->id + 1) % SHARDED_THREADS, i);
+    v = CDS_retrieve(w->dict, key);
+
+    if (v != NULL && strncmp(v, key, 2) != 0)
+      w->errors++;
+  }
+
+  for (int i = 0; i < SHARDED_KEYS_PER_THREAD; i += 2)
+  {
+    snprintf(key, sizeof(key), "t%d-key%d", w->id, i);
+    CDS_delete(w->dict, key);
+  }
+
+  return NULL;
+}
+
+/*
+ * Tests the sharded dictionary with several threads storing,
+ * retrieving and deleting at once, and reports its throughput
+ *
+ * Returns: 1 if all tests pass, 0 otherwise
+ */
+int test_sharded_threads()
+{
+  pthread_t threads[SHARDED_THREADS];
+  sharded_worker_t workers[SHARDED_THREADS];
+  CDictSharded dict = CDS_new_owned(0);
+  const int ops_per_thread = SHARDED_KEYS_PER_THREAD * 3 + SHARDED_KEYS_PER_THREAD / 2;
+
+  double start = now_seconds();
+
+  for (int t = 0; t < SHARDED_THREADS; t++)
+  {
+    workers[t] = (sharded_worker_t){dict, t, 0};
+    pthread_create(&threads[t], NULL, sharded_worker, &workers[t]);
+  }
+
+  for (int t = 0; t < SHARDED_THREADS; t++)
+    pthread_join(threads[t], NULL);
+
+  double elapsed = now_seconds() - start;
+
+  printf("Sharded dictionary: %d threads, %.0f ops/sec\n", SHARDED_THREADS,
+         SHARDED_THREADS * ops_per_thread / elapsed);
+
+  for (int t = 0; t < SHARDED_THREADS; t++)
+    test_assert(workers[t].errors == 0);
+
+  test_assert(CDS_size(dict) == SHARDED_THREADS * SHARDED_KEYS_PER_THREAD / 2);
+  test_assert(CDS_contains(dict, "t3-key1"));
+  test_assert(!CDS_contains(dict, "t3-key2"));
+  test_assert(strcmp(CDS_retrieve(dict, "t5-key7"), "t5-value7") == 0);
+  test_assert(CDS_load_factor(dict) <= 0.6);
+
+  int count = 0;
+  CDS_foreach(dict, count_callback, &count);
+  test_assert(count == CDS_size(dict));
+
+  CDS_free(dict);
+  return 1;
+
+test_error:
+  CDS_free(dict);
+  return 0;
+}
+
+#define CONCURRENT_READERS 4
+#define CONCURRENT_KEYS 1000
+#define CONCURRENT_ROUNDS 200
+
+typedef struct
+{
+  CDictConcurrent dict;
+  long reads;
+  int errors;
+} concurrent_reader_t;
+
+/*
+ * Thread body for test_concurrent_readers: looks up every fixed key
+ * over and over while the writer grows and churns the dictionary
+ */
+void *concurrent_reader(void *arg)
+{
+  concurrent_reader_t *r = arg;
+  char key[32];
+  char value[32];
+  char updated[32];
+
+  for (int round = 0; round < CONCURRENT_ROUNDS; round++)
+  {
+    for (int i = 0; i < CONCURRENT_KEYS; i++)
+    {
+      snprintf(key, sizeof(key), "key%d", i);
+      snprintf(value, sizeof(value), "value%d", i);
+      snprintf(updated, sizeof(updated), "updated%d", i);
+      const char *v = CDC_retrieve(r->dict, key);
+
+      // A key is never missing, and only ever has one of two values
+      if (v == NULL || (strcmp(v, value) != 0 && strcmp(v, updated) != 0))
+        r->errors++;
+    }
+
+    r->reads += CONCURRENT_KEYS;
+  }
+
+  return NULL;
+}
+
+/*
+ * Thread body for test_concurrent_readers: stores enough keys to
+ * rehash several times, deletes them again, and overwrites the keys
+ * the readers are looking up
+ */
+void *concurrent_writer(void *arg)
+{
+  CDictConcurrent dict = arg;
+  char key[32];
+  char value[32];
+
+  for (int i = 0; i < 20 * CONCURRENT_KEYS; i++)
+  {
+    snprintf(key, sizeof(key), "extra%d", i);
+    CDC_store(dict, key, key);
+
+    if (i % 2 == 0)
+      CDC_delete(dict, key);
+
+    snprintf(key, sizeof(key), "key%d", i % CONCURRENT_KEYS);
+    snprintf(value, sizeof(value), "updated%d", i % CONCURRENT_KEYS);
+    CDC_store(dict, key, value);
+  }
+
+  return NULL;
+}
+
+/*
+ * Tests lock-free lookups in the concurrent dictionary while another
+ * thread stores, deletes and rehashes, and reports read throughput
+ *
+ * Returns: 1 if all tests pass, 0 otherwise
+ */
+int test_concurrent_readers()
+{
+  pthread_t readers[CONCURRENT_READERS];
+  pthread_t writer;
+  concurrent_reader_t reader_data[CONCURRENT_READERS];
+  CDictConcurrent dict = CDC_new();
+  char key[32];
+  char value[32];
+
+  for (int i = 0; i < CONCURRENT_KEYS; i++)
+  {
+    snprintf(key, sizeof(key), "key%d", i);
+    snprintf(value, sizeof(value), "value%d", i);
+    CDC_store(dict, key, value);
+  }
+
+  // Stored values are copies
+  test_assert(CDC_retrieve(dict, "key1") != NULL);
+  test_assert(strcmp(CDC_retrieve(dict, "key1"), "value1") == 0);
+  test_assert(CDC_size(dict) == CONCURRENT_KEYS);
+
+  double start = now_seconds();
+
+  for (int t = 0; t < CONCURRENT_READERS; t++)
+  {
+    reader_data[t] = (concurrent_reader_t){dict, 0, 0};
+    pthread_create(&readers[t], NULL, concurrent_reader, &reader_data[t]);
+  }
+
+  pthread_create(&writer, NULL, concurrent_writer, dict);
+
+  long reads = 0;
+
+  for (int t = 0; t < CONCURRENT_READERS; t++)
+  {
+    pthread_join(readers[t], NULL);
+    reads += reader_data[t].reads;
+  }
+
+  double elapsed = now_seconds() - start;
+  pthread_join(writer, NULL);
+
+  printf("Concurrent dictionary: %d readers, %.0f reads/sec\n", CONCURRENT_READERS, reads / elapsed);
+
+  for (int t = 0; t < CONCURRENT_READERS; t++)
+    test_assert(reader_data[t].errors == 0);
+
+  test_assert(CDC_size(dict) == CONCURRENT_KEYS + 10 * CONCURRENT_KEYS);
+  test_assert(CDC_capacity(dict) >= CDC_size(dict));
+  test_assert(strcmp(CDC_retrieve(dict, "key7"), "updated7") == 0);
+  test_assert(CDC_contains(dict, "extra1"));
+  test_assert(!CDC_contains(dict, "extra2"));
+
+  CDC_delete(dict, "key7");
+  test_assert(!CDC_contains(dict, "key7"));
+  test_assert(CDC_retrieve(dict, "key7") == NULL);
+
+  test_assert(CDC_contains_n(dict, "key8 and more", 4));
+
+  int count = 0;
+  CDC_foreach(dict, count_callback, &count);
+  test_assert(count == CDC_size(dict));
+
+  CDC_free(dict);
+  return 1;
+
+test_error:
+  CDC_free(dict);
   return 0;
 }
 
@@ -513,6 +2880,54 @@ int main()
   passed += test_handle_collisions();
   num_tests++;
   passed += test_capacity_limits();
+  num_tests++;
+  passed += test_custom_hash();
+  num_tests++;
+  passed += test_seeded_hash();
+  num_tests++;
+  passed += test_long_probe_sequences();
+  num_tests++;
+  passed += test_delete_churn();
+  num_tests++;
+  passed += test_purge_and_shrink();
+  num_tests++;
+  passed += test_options();
+  num_tests++;
+  passed += test_compact();
+  num_tests++;
+  passed += test_clone();
+  num_tests++;
+  passed += test_snapshot();
+  num_tests++;
+  passed += test_incremental_rehash();
+  num_tests++;
+  passed += test_iterators();
+  num_tests++;
+  passed += test_stats();
+  num_tests++;
+  passed += test_small_dict();
+  num_tests++;
+  passed += test_allocator();
+  num_tests++;
+  passed += test_generated_dicts();
+  num_tests++;
+  passed += test_owned_keys();
+  num_tests++;
+  passed += test_presizing();
+  num_tests++;
+  passed += test_batched_lookup();
+  num_tests++;
+  passed += test_explicit_length_keys();
+  num_tests++;
+  passed += test_frozen();
+  num_tests++;
+  passed += test_save_and_mmap();
+  num_tests++;
+  passed += test_load_tsv();
+  num_tests++;
+  passed += test_sharded_threads();
+  num_tests++;
+  passed += test_concurrent_readers();
 
   printf("Passed %d/%d test cases\n", passed, num_tests);
   fflush(stdout);